@@ -0,0 +1,250 @@
+(* Encoding and decoding throughput of synthetic frames, for each
+ * video type, rate control and GOP structure. Results are printed
+ * as JSON. *)
+
+open Schroedinger
+
+let frames = ref 10
+let seed = ref 42
+let outfile = ref ""
+let video_types = ref []
+let rate_controls = ref []
+let gop_structures = ref []
+
+let all_video_types =
+  [
+    QSIF, "QSIF"; QCIF, "QCIF"; SIF, "SIF"; CIF, "CIF"; SIF_4, "SIF_4";
+    CIF_4, "CIF_4"; SD480I_60, "SD480I_60"; SD576I_50, "SD576I_50";
+    HD720P_60, "HD720P_60"; HD720P_50, "HD720P_50";
+    HD1080I_60, "HD1080I_60"; HD1080I_50, "HD1080I_50";
+    HD1080P_60, "HD1080P_60"; HD1080P_50, "HD1080P_50";
+    DC2K_24, "DC2K_24"; DC4K_24, "DC4K_24"
+  ]
+
+let all_rate_controls =
+  [
+    Encoder.Constant_noise_threshold, "Constant_noise_threshold";
+    Encoder.Constant_bitrate, "Constant_bitrate";
+    Encoder.Low_delay, "Low_delay";
+    Encoder.Lossless, "Lossless";
+    Encoder.Constant_lambda, "Constant_lambda";
+    Encoder.Constant_error, "Constant_error"
+  ]
+
+let all_gop_structures =
+  [
+    Encoder.Adaptive, "Adaptive";
+    Encoder.Intra_only, "Intra_only";
+    Encoder.Backref, "Backref";
+    Encoder.Chained_backref, "Chained_backref";
+    Encoder.Biref, "Biref";
+    Encoder.Chained_biref, "Chained_biref"
+  ]
+
+let select all names =
+  match names with
+    | [] -> all
+    | _ ->
+        List.map
+          (fun n ->
+             try
+               List.find (fun (_,n') -> n' = n) all
+             with
+               | Not_found -> raise (Arg.Bad ("unknown value " ^ n)))
+          (List.rev names)
+
+let () =
+  let add l s = l := s :: !l in
+  Arg.parse
+    [
+      "-n", Arg.Set_int frames, "Number of frames per run (default 10)";
+      "-s", Arg.Set_int seed, "Seed of the synthetic frames";
+      "-o", Arg.Set_string outfile, "Output file (default: standard output)";
+      "-t", Arg.String (add video_types), "Only use this video type (repeatable)";
+      "-r", Arg.String (add rate_controls), "Only use this rate control (repeatable)";
+      "-g", Arg.String (add gop_structures), "Only use this GOP structure (repeatable)";
+    ]
+    ignore
+    "schrobench [options]"
+
+let format_of_chroma = function
+  | Chroma_420 -> Yuv_420_p
+  | Chroma_422 -> Yuv_422_p
+  | Chroma_444 -> Yuv_444_p
+
+let string_of_chroma = function
+  | Chroma_420 -> "420"
+  | Chroma_422 -> "422"
+  | Chroma_444 -> "444"
+
+(* Size in bytes of the samples of a frame, without padding. *)
+let frame_bytes format =
+  let luma = format.width * format.height in
+  match format.chroma_format with
+    | Chroma_420 -> luma * 3 / 2
+    | Chroma_422 -> luma * 2
+    | Chroma_444 -> luma * 3
+
+let json_string s =
+  let b = Buffer.create (String.length s + 2) in
+  Buffer.add_char b '"';
+  String.iter
+    (fun c ->
+       match c with
+         | '"' -> Buffer.add_string b "\\\""
+         | '\\' -> Buffer.add_string b "\\\\"
+         | c when Char.code c < 0x20 ->
+             Buffer.add_string b (Printf.sprintf "\\u%04x" (Char.code c))
+         | c -> Buffer.add_char b c)
+    s;
+  Buffer.add_char b '"';
+  Buffer.contents b
+
+(* A moving gradient with seeded noise, so that motion
+ * estimation and rate control have something to work on. *)
+let synthetic_frame format n =
+  let f = Frame.create ~format:(format_of_chroma format.chroma_format)
+                       format.width format.height in
+  Array.iteri
+    (fun j (p,stride) ->
+       let rows = Bigarray.Array1.dim p / stride in
+       for y = 0 to rows - 1 do
+         for x = 0 to stride - 1 do
+           let v = (x + y + 4*n + 64*j + Random.int 16) land 0xff in
+           Bigarray.Array1.unsafe_set p (y*stride + x) v
+         done
+       done)
+    f.planes;
+  f
+
+(* Peak resident set size in kB, from /proc on Linux. *)
+let peak_rss () =
+  try
+    let ic = open_in "/proc/self/status" in
+    let rec f () =
+      let l = input_line ic in
+      try Scanf.sscanf l "VmHWM: %d kB" (fun n -> Some n)
+      with Scanf.Scan_failure _ | Failure _ | End_of_file -> f ()
+    in
+    let ret = try f () with End_of_file -> None in
+    close_in ic;
+    ret
+  with
+    | Sys_error _ -> None
+
+(* Reset the peak resident set size, so that each run reports its
+ * own. Writing 5 to clear_refs needs Linux 4.0 or later. *)
+let reset_peak_rss () =
+  try
+    let oc = open_out "/proc/self/clear_refs" in
+    output_string oc "5";
+    close_out oc
+  with
+    | Sys_error _ -> ()
+
+let encode format rc gop source file =
+  let oc = open_out_bin file in
+  let out (h,b) = output_string oc h; output_string oc b in
+  let os = Ogg.Stream.create () in
+  let enc = Encoder.create format in
+  Encoder.set enc Encoder.Setting.rate_control rc;
+  Encoder.set enc Encoder.Setting.gop_structure gop;
+  let rec flush () =
+    try
+      out (Ogg.Stream.get_page os);
+      flush ()
+    with
+      | Ogg.Not_enough_data -> ()
+  in
+  let t = Unix.gettimeofday () in
+  for i = 0 to !frames - 1 do
+    Encoder.encode_frame enc source.(i mod Array.length source) os;
+    flush ()
+  done;
+  Encoder.eos enc os;
+  output_string oc (Ogg.Stream.flush os);
+  let t = Unix.gettimeofday () -. t in
+  Encoder.close enc;
+  let bytes = pos_out oc in
+  close_out oc;
+  t, bytes
+
+let decode file =
+  let dec = Decoder.create_raw () in
+  let input = Decoder.Mmap.openfile file in
+  let t = Unix.gettimeofday () in
+  let rec f n =
+    match Decoder.Mmap.decode input dec with
+      | Decoder.Frame frame ->
+          Decoder.release_frame dec frame;
+          f (n+1)
+      | Decoder.Repeat -> f (n+1)
+      | Decoder.Need_data | Decoder.Eos -> n
+  in
+  let n = f 0 in
+  let t = Unix.gettimeofday () -. t in
+  Decoder.close dec;
+  t, n
+
+let rate n t = if t > 0. then float n /. t else 0.
+
+let json_of_option = function
+  | Some n -> string_of_int n
+  | None -> "null"
+
+let run (vt, vt_name) source (rc, rc_name) (gop, gop_name) =
+  let format = get_default_video_format vt in
+  let size = frame_bytes format in
+  let file = Filename.temp_file "schrobench" ".ogg" in
+  let result =
+    try
+      reset_peak_rss ();
+      let alloc = Gc.allocated_bytes () in
+      let enc_t, bytes = encode format rc gop source file in
+      let alloc = Gc.allocated_bytes () -. alloc in
+      let dec_t, decoded = decode file in
+      Printf.sprintf
+        "\"encode\": {\"seconds\": %f, \"fps\": %f, \"mb_per_s\": %f, \
+         \"bytes\": %d, \"ocaml_bytes_per_frame\": %f}, \
+         \"decode\": {\"seconds\": %f, \"fps\": %f, \"mb_per_s\": %f, \"frames\": %d}"
+        enc_t (rate !frames enc_t) (rate (!frames * size) enc_t /. 1e6)
+        bytes (alloc /. float !frames)
+        dec_t (rate decoded dec_t) (rate (decoded * size) dec_t /. 1e6) decoded
+    with
+      | e -> Printf.sprintf "\"error\": %s" (json_string (Printexc.to_string e))
+  in
+  (try Sys.remove file with Sys_error _ -> ());
+  Printf.sprintf
+    "{\"video_type\": %s, \"width\": %d, \"height\": %d, \"chroma\": %s, \
+     \"rate_control\": %s, \"gop_structure\": %s, %s, \"peak_rss_kb\": %s}"
+    (json_string vt_name) format.width format.height
+    (json_string (string_of_chroma format.chroma_format))
+    (json_string rc_name) (json_string gop_name) result (json_of_option (peak_rss ()))
+
+let () =
+  let video_types = select all_video_types !video_types in
+  let rate_controls = select all_rate_controls !rate_controls in
+  let gop_structures = select all_gop_structures !gop_structures in
+  let oc = if !outfile = "" then stdout else open_out !outfile in
+  let first = ref true in
+  Printf.fprintf oc "{\"frames\": %d, \"seed\": %d, \"runs\": [\n" !frames !seed;
+  List.iter
+    (fun vt ->
+       Random.init !seed;
+       let format = get_default_video_format (fst vt) in
+       (* A few distinct frames, reused cyclically. *)
+       let source = Array.init (max 1 (min !frames 8)) (synthetic_frame format) in
+       List.iter
+         (fun rc ->
+            List.iter
+              (fun gop ->
+                 if not !first then output_string oc ",\n";
+                 first := false;
+                 output_string oc (run vt source rc gop);
+                 flush oc)
+              gop_structures)
+         rate_controls;
+       Array.iter Frame.release source)
+    video_types;
+  output_string oc "\n]}\n";
+  if oc != stdout then close_out oc
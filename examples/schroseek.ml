@@ -0,0 +1,121 @@
+(* Seeking in a stream whose serial number is at least 0x80000000,
+ * which ocaml-ogg gives as a negative nativeint. Sync points found
+ * by scanning the file must be the same whether the serial is given
+ * or looked for, and as those of an indexer or a Skeleton index.
+ * Bisecting must agree with the index, and the stream must be found
+ * and decoded to its end in a memory mapped file. *)
+
+open Schroedinger
+
+let frames = ref 40
+let au_distance = ref 8
+
+let () =
+  Arg.parse
+    [
+      "-n", Arg.Set_int frames, "Number of frames (default 40)";
+      "-a", Arg.Set_int au_distance, "Distance between sync points (default 8)";
+    ]
+    ignore
+    "schroseek [options]"
+
+let serial = Nativeint.of_int32 0x9c470001l
+
+let video_format = get_default_video_format QSIF
+
+let source_frame n =
+  let f = Frame.create video_format.width video_format.height in
+  Array.iteri
+    (fun j (p,stride) ->
+       for i = 0 to Bigarray.Array1.dim p - 1 do
+         let x = i mod stride and y = i / stride in
+         Bigarray.Array1.unsafe_set p i ((x + 2*y + 9*n + 64*j) land 0xff)
+       done)
+    f.planes;
+  f
+
+(* Returns the index built while writing the file. *)
+let encode file =
+  let oc = open_out_bin file in
+  let indexer = Seek.Indexer.create serial in
+  let out ((h,b) as page) =
+    Seek.Indexer.add_page indexer (Int64.of_int (pos_out oc)) page;
+    output_string oc h;
+    output_string oc b
+  in
+  let os = Ogg.Stream.create ~serial () in
+  let enc = Encoder.create video_format in
+  Encoder.set enc Encoder.Setting.au_distance !au_distance;
+  let rec flush get =
+    try
+      out (get os);
+      flush get
+    with
+      | Ogg.Not_enough_data -> ()
+  in
+  for n = 0 to !frames - 1 do
+    let f = source_frame n in
+    Encoder.encode_frame enc f os;
+    Frame.release f;
+    flush Ogg.Stream.get_page
+  done;
+  Encoder.eos enc os;
+  flush Ogg.Stream.flush_page;
+  Encoder.close enc;
+  close_out oc;
+  Seek.Indexer.index indexer
+
+(* Number of pictures decoded from a memory mapped file, and its serial. *)
+let decode file =
+  let dec = Decoder.create_raw () in
+  let input = Decoder.Mmap.openfile file in
+  let rec f n =
+    match Decoder.Mmap.decode input dec with
+      | Decoder.Frame frame ->
+          Decoder.release_frame dec frame;
+          f (n + 1)
+      | Decoder.Repeat -> f (n + 1)
+      | Decoder.Need_data -> -1
+      | Decoder.Eos -> n
+  in
+  let n = f 0 in
+  (* The end of the stream is only pushed once. *)
+  let n = if Decoder.Mmap.decode input dec = Decoder.Eos then n else -1 in
+  Decoder.close dec;
+  n, Decoder.Mmap.serial input
+
+let errors = ref 0
+
+let check name b =
+  if not b then begin
+    Printf.eprintf "%s: failed\n%!" name;
+    incr errors
+  end
+
+let () =
+  let file = Filename.temp_file "schroseek" ".ogg" in
+  let indexed = encode file in
+  let fd = Unix.openfile file [Unix.O_RDONLY] 0 in
+  let index = Seek.scan fd in
+  check "serial" (Seek.serial index = serial);
+  let points = Seek.sync_points index in
+  check "sync points" (Array.length points > 1);
+  check "given serial" (Seek.sync_points (Seek.scan ~serial fd) = points);
+  check "indexer" (Seek.serial indexed = serial && Seek.sync_points indexed = points);
+  let skeleton =
+    Skeleton.parse_index ~format:video_format (Skeleton.index ~format:video_format index)
+  in
+  check "skeleton index" (Seek.serial skeleton = serial);
+  check "other serial"
+    (Seek.sync_points (Seek.scan ~serial:(Nativeint.logxor serial 1n) fd) = [||]);
+  for n = 0 to !frames - 1 do
+    let p = Seek.find index n in
+    check (Printf.sprintf "bisect %d" n) (Seek.bisect fd n = p);
+    check (Printf.sprintf "bisect %d with serial" n) (Seek.bisect ~serial fd n = p)
+  done;
+  Unix.close fd;
+  check "mmap" (decode file = (!frames, serial));
+  Sys.remove file;
+  Printf.printf "serial %nx, %d sync points: %d errors\n"
+    serial (Array.length points) !errors;
+  if !errors > 0 then exit 1
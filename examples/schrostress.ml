@@ -0,0 +1,137 @@
+(* Encoders and decoders running in several domains at once, sharing
+ * the same source frames. Every stream must be identical, bit for bit,
+ * to the one of a serial run, and so must the decoded pictures.
+ * Needs OCaml 5. *)
+
+open Schroedinger
+
+let frames = ref 20
+let domains = ref 4
+let rounds = ref 2
+
+let () =
+  Arg.parse
+    [
+      "-n", Arg.Set_int frames, "Number of frames per stream (default 20)";
+      "-d", Arg.Set_int domains, "Number of domains (default 4)";
+      "-r", Arg.Set_int rounds, "Number of streams per domain (default 2)";
+    ]
+    ignore
+    "schrostress [options]"
+
+let video_format = get_default_video_format QSIF
+
+(* Frames only depend on their number, so that all the runs
+ * encode the same pictures. *)
+let source_frame n =
+  let f = Frame.create video_format.width video_format.height in
+  Array.iteri
+    (fun j (p,stride) ->
+       for i = 0 to Bigarray.Array1.dim p - 1 do
+         let x = i mod stride and y = i / stride in
+         let v = (3*x + 5*y + 7*n + 64*j + (x*y) mod 13) land 0xff in
+         Bigarray.Array1.unsafe_set p i v
+       done)
+    f.planes;
+  f
+
+let read_file file =
+  let ic = open_in_bin file in
+  let s = really_input_string ic (in_channel_length ic) in
+  close_in ic;
+  s
+
+(* Encode the source into file and return its content. The serial
+ * number is fixed so that streams can be compared. *)
+let encode source file =
+  let oc = open_out_bin file in
+  let out (h,b) = output_string oc h; output_string oc b in
+  let os = Ogg.Stream.create ~serial:0x5c470n () in
+  let enc = Encoder.create video_format in
+  let rec flush () =
+    try
+      out (Ogg.Stream.get_page os);
+      flush ()
+    with
+      | Ogg.Not_enough_data -> ()
+  in
+  Array.iter
+    (fun f ->
+       Encoder.encode_frame enc f os;
+       flush ())
+    source;
+  Encoder.eos enc os;
+  output_string oc (Ogg.Stream.flush os);
+  Encoder.close enc;
+  close_out oc;
+  read_file file
+
+(* Visible samples of a decoded plane, without the padding. *)
+let plane_width (f:frame) j =
+  match j, f.format with
+    | 0, _ | _, Yuv_444_p -> f.frame_width
+    | _ -> (f.frame_width + 1) / 2
+
+let digest (f:frame) =
+  let b = Buffer.create (2 * f.frame_width * f.frame_height) in
+  Array.iteri
+    (fun j (p,stride) ->
+       let w = plane_width f j in
+       for y = 0 to Bigarray.Array1.dim p / stride - 1 do
+         for x = 0 to w - 1 do
+           Buffer.add_char b (Char.unsafe_chr (Bigarray.Array1.get p (y*stride + x)))
+         done
+       done)
+    f.planes;
+  Digest.string (Buffer.contents b)
+
+(* Digests of the decoded pictures of file, in order. *)
+let decode file =
+  let dec = Decoder.create_raw () in
+  let input = Decoder.Mmap.openfile file in
+  let rec f acc =
+    match Decoder.Mmap.decode input dec with
+      | Decoder.Frame frame ->
+          let d = digest frame in
+          Decoder.release_frame dec frame;
+          f (d :: acc)
+      | Decoder.Repeat -> f ("repeat" :: acc)
+      | Decoder.Need_data | Decoder.Eos -> List.rev acc
+  in
+  let ret = f [] in
+  Decoder.close dec;
+  ret
+
+(* Returns the number of streams which differ from the serial run. *)
+let run source reference digests d =
+  let errors = ref 0 in
+  for r = 0 to !rounds - 1 do
+    let file = Filename.temp_file (Printf.sprintf "schrostress%d_" d) ".ogg" in
+    let data = encode source file in
+    if data <> reference then begin
+      Printf.eprintf "domain %d, stream %d: encoded data differs\n%!" d r;
+      incr errors
+    end;
+    if decode file <> digests then begin
+      Printf.eprintf "domain %d, stream %d: decoded pictures differ\n%!" d r;
+      incr errors
+    end;
+    Sys.remove file
+  done;
+  !errors
+
+let () =
+  let source = Array.init !frames source_frame in
+  let file = Filename.temp_file "schrostress" ".ogg" in
+  let reference = encode source file in
+  let digests = decode file in
+  Sys.remove file;
+  let workers =
+    List.init !domains
+      (fun d -> Domain.spawn (fun () -> run source reference digests d))
+  in
+  let errors = List.fold_left (fun n w -> n + Domain.join w) 0 workers in
+  Array.iter Frame.release source;
+  Printf.printf "%d domains, %d streams of %d frames each: %d errors\n"
+    !domains !rounds !frames errors;
+  if errors > 0 then exit 1
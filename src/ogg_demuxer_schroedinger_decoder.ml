@@ -41,43 +41,47 @@ let decoder os =
           let packet1 = get_packet packet1 in
           let packet2 = get_packet packet2 in
           let dec = Schroedinger.Decoder.create packet1 packet2 in
-          let video_format = Schroedinger.Decoder.get_video_format dec in
+          let video_format = Schroedinger.Decoder.probe packet1 in
           decoder := Some (dec,video_format);
           dec,video_format
   in
+  let convert yuv =
+    let format =
+      match yuv.Schroedinger.format with
+        | Schroedinger.Yuv_422_p -> Ogg_demuxer.Yuvj_422
+        | Schroedinger.Yuv_444_p -> Ogg_demuxer.Yuvj_444
+        | Schroedinger.Yuv_420_p -> Ogg_demuxer.Yuvj_420
+        | _ -> assert false
+    in
+    {
+      Ogg_demuxer.
+        format = format;
+        frame_width = yuv.Schroedinger.frame_width;
+        frame_height = yuv.Schroedinger.frame_height;
+        y_stride  = snd yuv.Schroedinger.planes.(0);
+        uv_stride = snd yuv.Schroedinger.planes.(1);
+        y = fst yuv.Schroedinger.planes.(0);
+        u = fst yuv.Schroedinger.planes.(1);
+        v = fst yuv.Schroedinger.planes.(2)
+    }
+  in
   let decode feed = 
     let (decoder,_) = init () in
     let ret = 
-     try
-      let yuv = Schroedinger.Decoder.decode_frame decoder !os in
-      latest_yuv := Some yuv ;
-      yuv
-     with
-       | Schroedinger.Decoder.Skipped_frame -> 
+      match Schroedinger.Decoder.decode decoder !os with
+        | Schroedinger.Decoder.Frame yuv ->
+            let ret = convert yuv in
+            latest_yuv := Some ret ;
+            ret
+        | Schroedinger.Decoder.Repeat ->
           begin
             match !latest_yuv with
-              | Some yuv -> yuv
+              | Some ret -> ret
               | None     -> assert false
           end
-    in
-    let format =
-      match ret.Schroedinger.format with
-        | Schroedinger.Yuv_422_p -> Ogg_demuxer.Yuvj_422
-        | Schroedinger.Yuv_444_p -> Ogg_demuxer.Yuvj_444
-        | Schroedinger.Yuv_420_p -> Ogg_demuxer.Yuvj_420
-    in
-    let ret =
-      {
-        Ogg_demuxer.
-          format = format;
-          frame_width = ret.Schroedinger.frame_width;
-          frame_height = ret.Schroedinger.frame_height;
-          y_stride  = snd ret.Schroedinger.planes.(0);
-          uv_stride = snd ret.Schroedinger.planes.(1);
-          y = fst ret.Schroedinger.planes.(0);
-          u = fst ret.Schroedinger.planes.(1);
-          v = fst ret.Schroedinger.planes.(2)
-      }
+        | Schroedinger.Decoder.Need_data
+        | Schroedinger.Decoder.Eos ->
+            raise Ogg.Not_enough_data
     in
     feed ret
   in
@@ -25,30 +25,75 @@ external init : unit -> unit = "caml_schroedinger_init"
 
 let () = init ()
 
-type plane = (int, Bigarray.int8_unsigned_elt, Bigarray.c_layout) Bigarray.Array1.t
+exception Closed
 
-external int_of_define : string -> int = "ocaml_schroedinger_int_of_define"
+let () =
+  Callback.register_exception "schro_exn_closed" Closed
+
+type 'a generic_plane = (int, 'a, Bigarray.c_layout) Bigarray.Array1.t
+
+type plane = Bigarray.int8_unsigned_elt generic_plane
+
+type plane16 = Bigarray.int16_signed_elt generic_plane
+
+type data = (int, Bigarray.int8_unsigned_elt, Bigarray.c_layout) Bigarray.Array1.t
+
+(* Values of the libschroedinger constants, fetched once. Each array
+ * is in the order of the constructors of the corresponding type. *)
+external defines : unit -> int array array = "ocaml_schroedinger_defines"
+
+let defines = defines ()
+
+(* Reverse lookup table for the constants in [values],
+ * corresponding to [constructors]. *)
+let of_int_table values constructors =
+  let len = Array.fold_left max 0 values + 1 in
+  let table = Array.make len None in
+  Array.iteri (fun i v -> table.(v) <- Some constructors.(i)) values;
+  fun x ->
+    if x < 0 || x >= len then assert false;
+    match table.(x) with
+      | Some c -> c
+      | None -> assert false
 
-(* Only planar formats for now.. *)
 type format = 
   | Yuv_422_p    (** Planar YCbCr 4:2:2. Each component is an uint8_t *)
   | Yuv_444_p    (** Planar YCbCr 4:4:4. Each component is an uint8_t *)
   | Yuv_420_p    (** Planar YCbCr 4:2:0. Each component is an uint8_t,
                    * luma and chroma values are full range (0x00 .. 0xff) *)
+  | Yuyv_422
+  | Uyvy_422
+  | V210
+  | Rgba
+  | Yuv_422_p16
+  | Yuv_444_p16
+  | Yuv_420_p16
+
+let format_values = defines.(0)
 
 let int_of_format f =
   match f with
-   | Yuv_422_p -> int_of_define "SCHRO_FRAME_FORMAT_U8_422"
-   | Yuv_444_p -> int_of_define "SCHRO_FRAME_FORMAT_U8_444"
-   | Yuv_420_p -> int_of_define "SCHRO_FRAME_FORMAT_U8_420"
-
-let format_of_int x = 
-  let f = int_of_define in
-  match x with
-    | x when x = f "SCHRO_FRAME_FORMAT_U8_422" -> Yuv_422_p
-    | x when x = f "SCHRO_FRAME_FORMAT_U8_444" -> Yuv_444_p
-    | x when x = f "SCHRO_FRAME_FORMAT_U8_420" -> Yuv_420_p
-    | _ -> assert false
+   | Yuv_422_p -> format_values.(0)
+   | Yuv_444_p -> format_values.(1)
+   | Yuv_420_p -> format_values.(2)
+   | Yuyv_422 -> format_values.(3)
+   | Uyvy_422 -> format_values.(4)
+   | V210 -> format_values.(5)
+   | Rgba -> format_values.(6)
+   | Yuv_422_p16 -> format_values.(7)
+   | Yuv_444_p16 -> format_values.(8)
+   | Yuv_420_p16 -> format_values.(9)
+
+(* Frames coming from schroedinger are always planar. *)
+let format_of_int =
+  of_int_table
+    (Array.append (Array.sub format_values 0 3) (Array.sub format_values 7 3))
+    [|Yuv_422_p; Yuv_444_p; Yuv_420_p; Yuv_422_p16; Yuv_444_p16; Yuv_420_p16|]
+
+let is_packed f =
+  match f with
+    | Yuyv_422 | Uyvy_422 | V210 | Rgba -> true
+    | _ -> false
 
 type video_type = 
   | CUSTOM
@@ -69,66 +114,49 @@ type video_type =
   | DC2K_24
   | DC4K_24
 
+let video_type_values = defines.(1)
+
 let int_of_video_type x = 
-  let f = int_of_define in
-  match x with
-    | CUSTOM -> f "SCHRO_VIDEO_FORMAT_CUSTOM"
-    | QSIF -> f "SCHRO_VIDEO_FORMAT_QSIF"
-    | QCIF -> f "SCHRO_VIDEO_FORMAT_QCIF"
-    | SIF -> f "SCHRO_VIDEO_FORMAT_SIF"
-    | CIF -> f "SCHRO_VIDEO_FORMAT_CIF"
-    | SIF_4 -> f "SCHRO_VIDEO_FORMAT_4SIF"
-    | CIF_4 -> f "SCHRO_VIDEO_FORMAT_4CIF"
-    | SD480I_60 -> f "SCHRO_VIDEO_FORMAT_SD480I_60"
-    | SD576I_50 -> f "SCHRO_VIDEO_FORMAT_SD576I_50"
-    | HD720P_60 -> f "SCHRO_VIDEO_FORMAT_HD720P_60"
-    | HD720P_50 -> f "SCHRO_VIDEO_FORMAT_HD720P_50"
-    | HD1080I_60 -> f "SCHRO_VIDEO_FORMAT_HD1080I_60"
-    | HD1080I_50 -> f "SCHRO_VIDEO_FORMAT_HD1080I_50"
-    | HD1080P_60 -> f "SCHRO_VIDEO_FORMAT_HD1080P_60"
-    | HD1080P_50 -> f "SCHRO_VIDEO_FORMAT_HD1080P_50"
-    | DC2K_24 -> f "SCHRO_VIDEO_FORMAT_DC2K_24"
-    | DC4K_24 -> f "SCHRO_VIDEO_FORMAT_DC4K_24"
-
-let video_type_of_int x =
-  let f = int_of_define in
   match x with
-    | x when x = f "SCHRO_VIDEO_FORMAT_CUSTOM" -> CUSTOM
-    | x when x = f "SCHRO_VIDEO_FORMAT_QSIF" -> QSIF
-    | x when x = f "SCHRO_VIDEO_FORMAT_QCIF" -> QCIF
-    | x when x = f "SCHRO_VIDEO_FORMAT_SIF" -> SIF
-    | x when x = f "SCHRO_VIDEO_FORMAT_CIF" -> CIF
-    | x when x = f "SCHRO_VIDEO_FORMAT_4SIF" -> SIF_4
-    | x when x = f "SCHRO_VIDEO_FORMAT_4CIF" -> CIF_4
-    | x when x = f "SCHRO_VIDEO_FORMAT_SD480I_60" -> SD480I_60
-    | x when x = f "SCHRO_VIDEO_FORMAT_SD576I_50" -> SD576I_50
-    | x when x = f "SCHRO_VIDEO_FORMAT_HD720P_60" -> HD720P_60
-    | x when x = f "SCHRO_VIDEO_FORMAT_HD720P_50" -> HD720P_50
-    | x when x = f "SCHRO_VIDEO_FORMAT_HD1080I_60" -> HD1080I_60
-    | x when x = f "SCHRO_VIDEO_FORMAT_HD1080I_50" -> HD1080I_50
-    | x when x = f "SCHRO_VIDEO_FORMAT_HD1080P_60" -> HD1080P_60
-    | x when x = f "SCHRO_VIDEO_FORMAT_HD1080P_50" -> HD1080P_50
-    | x when x = f "SCHRO_VIDEO_FORMAT_DC2K_24" -> DC2K_24
-    | x when x = f "SCHRO_VIDEO_FORMAT_DC4K_24" -> DC4K_24
-    | _ -> assert false
+    | CUSTOM -> video_type_values.(0)
+    | QSIF -> video_type_values.(1)
+    | QCIF -> video_type_values.(2)
+    | SIF -> video_type_values.(3)
+    | CIF -> video_type_values.(4)
+    | SIF_4 -> video_type_values.(5)
+    | CIF_4 -> video_type_values.(6)
+    | SD480I_60 -> video_type_values.(7)
+    | SD576I_50 -> video_type_values.(8)
+    | HD720P_60 -> video_type_values.(9)
+    | HD720P_50 -> video_type_values.(10)
+    | HD1080I_60 -> video_type_values.(11)
+    | HD1080I_50 -> video_type_values.(12)
+    | HD1080P_60 -> video_type_values.(13)
+    | HD1080P_50 -> video_type_values.(14)
+    | DC2K_24 -> video_type_values.(15)
+    | DC4K_24 -> video_type_values.(16)
+
+let video_type_of_int =
+  of_int_table video_type_values
+    [|CUSTOM; QSIF; QCIF; SIF; CIF; SIF_4;
+      CIF_4; SD480I_60; SD576I_50; HD720P_60; HD720P_50; HD1080I_60;
+      HD1080I_50; HD1080P_60; HD1080P_50; DC2K_24; DC4K_24|]
 
 type chroma = 
   | Chroma_422
   | Chroma_444
   | Chroma_420
 
+let chroma_values = defines.(2)
+
 let int_of_chroma x = 
   match x with
-    | Chroma_422 -> int_of_define "SCHRO_CHROMA_422"
-    | Chroma_444 -> int_of_define "SCHRO_CHROMA_444"
-    | Chroma_420 -> int_of_define "SCHRO_CHROMA_420"
+    | Chroma_422 -> chroma_values.(0)
+    | Chroma_444 -> chroma_values.(1)
+    | Chroma_420 -> chroma_values.(2)
 
-let chroma_of_int x =
-  match x with
-    | x when x = int_of_define "SCHRO_CHROMA_422" -> Chroma_422
-    | x when x = int_of_define "SCHRO_CHROMA_444" -> Chroma_444
-    | x when x = int_of_define "SCHRO_CHROMA_420" -> Chroma_420
-    | _ -> assert false
+let chroma_of_int =
+  of_int_table chroma_values [|Chroma_422; Chroma_444; Chroma_420|]
 
 type colour_primaries = 
   | HDTV
@@ -136,38 +164,33 @@ type colour_primaries =
   | SDTV_625
   | CINEMA
 
+let colour_primaries_values = defines.(3)
+
 let int_of_colour_primaries x = 
   match x with
-    | HDTV -> int_of_define "SCHRO_COLOUR_PRIMARY_HDTV"
-    | SDTV_525 -> int_of_define "SCHRO_COLOUR_PRIMARY_SDTV_525"
-    | SDTV_625 -> int_of_define "SCHRO_COLOUR_PRIMARY_SDTV_625"
-    | CINEMA -> int_of_define "SCHRO_COLOUR_PRIMARY_CINEMA"
+    | HDTV -> colour_primaries_values.(0)
+    | SDTV_525 -> colour_primaries_values.(1)
+    | SDTV_625 -> colour_primaries_values.(2)
+    | CINEMA -> colour_primaries_values.(3)
 
-let colour_primaries_of_int x =
-  match x with
-    | x when x = int_of_define "SCHRO_COLOUR_PRIMARY_HDTV" -> HDTV
-    | x when x = int_of_define "SCHRO_COLOUR_PRIMARY_SDTV_525" -> SDTV_525
-    | x when x = int_of_define "SCHRO_COLOUR_PRIMARY_SDTV_625" -> SDTV_625
-    | x when x = int_of_define "SCHRO_COLOUR_PRIMARY_CINEMA" -> CINEMA
-    | _ -> assert false
+let colour_primaries_of_int =
+  of_int_table colour_primaries_values [|HDTV; SDTV_525; SDTV_625; CINEMA|]
 
 type colour_matrix = 
   | HDTV
   | SDTV
   | REVERSIBLE
 
+let colour_matrix_values = defines.(4)
+
 let int_of_colour_matrix x = 
   match x with
-    | HDTV -> int_of_define "SCHRO_COLOUR_MATRIX_HDTV"
-    | SDTV -> int_of_define "SCHRO_COLOUR_MATRIX_SDTV"
-    | REVERSIBLE -> int_of_define "SCHRO_COLOUR_MATRIX_REVERSIBLE"
+    | HDTV -> colour_matrix_values.(0)
+    | SDTV -> colour_matrix_values.(1)
+    | REVERSIBLE -> colour_matrix_values.(2)
 
-let colour_matrix_of_int x =
-  match x with
-    | x when x = int_of_define "SCHRO_COLOUR_MATRIX_HDTV" -> HDTV
-    | x when x = int_of_define "SCHRO_COLOUR_MATRIX_SDTV" -> SDTV
-    | x when x = int_of_define "SCHRO_COLOUR_MATRIX_REVERSIBLE" -> REVERSIBLE
-    | _ -> assert false
+let colour_matrix_of_int =
+  of_int_table colour_matrix_values [|HDTV; SDTV; REVERSIBLE|]
 
 type transfer_function = 
   | TV_GAMMA
@@ -175,20 +198,17 @@ type transfer_function =
   | LINEAR
   | DCI_GAMMA
 
-let int_of_transfer_function x =
-  match x with 
-    | TV_GAMMA -> int_of_define "SCHRO_TRANSFER_CHAR_TV_GAMMA"
-    | EXTENDED_GAMMUT -> int_of_define "SCHRO_TRANSFER_CHAR_EXTENDED_GAMMUT"
-    | LINEAR -> int_of_define "SCHRO_TRANSFER_CHAR_LINEAR"
-    | DCI_GAMMA -> int_of_define "SCHRO_TRANSFER_CHAR_DCI_GAMMA"
+let transfer_function_values = defines.(5)
 
-let transfer_function_of_int x =
+let int_of_transfer_function x = 
   match x with
-    | x when x = int_of_define "SCHRO_TRANSFER_CHAR_TV_GAMMA" -> TV_GAMMA
-    | x when x = int_of_define "SCHRO_TRANSFER_CHAR_EXTENDED_GAMMUT" -> EXTENDED_GAMMUT
-    | x when x = int_of_define "SCHRO_TRANSFER_CHAR_LINEAR" -> LINEAR
-    | x when x = int_of_define "SCHRO_TRANSFER_CHAR_DCI_GAMMA" -> DCI_GAMMA
-    | _ -> assert false
+    | TV_GAMMA -> transfer_function_values.(0)
+    | EXTENDED_GAMMUT -> transfer_function_values.(1)
+    | LINEAR -> transfer_function_values.(2)
+    | DCI_GAMMA -> transfer_function_values.(3)
+
+let transfer_function_of_int =
+  of_int_table transfer_function_values [|TV_GAMMA; EXTENDED_GAMMUT; LINEAR; DCI_GAMMA|]
 
 type signal_range = 
   | RANGE_CUSTOM
@@ -197,22 +217,18 @@ type signal_range =
   | RANGE_10BIT_VIDEO
   | RANGE_12BIT_VIDEO
 
-let int_of_signal_range x =
-  match x with
-  | RANGE_CUSTOM -> int_of_define "SCHRO_SIGNAL_RANGE_CUSTOM"
-  | RANGE_8BIT_FULL -> int_of_define "SCHRO_SIGNAL_RANGE_8BIT_FULL"
-  | RANGE_8BIT_VIDEO -> int_of_define "SCHRO_SIGNAL_RANGE_8BIT_VIDEO"
-  | RANGE_10BIT_VIDEO -> int_of_define "SCHRO_SIGNAL_RANGE_10BIT_VIDEO"
-  | RANGE_12BIT_VIDEO -> int_of_define "SCHRO_SIGNAL_RANGE_12BIT_VIDEO"
+let signal_range_values = defines.(6)
 
-let signal_range_of_int x = 
+let int_of_signal_range x = 
   match x with
-    | x when x = int_of_define "SCHRO_SIGNAL_RANGE_CUSTOM" -> RANGE_CUSTOM
-    | x when x = int_of_define "SCHRO_SIGNAL_RANGE_8BIT_FULL" -> RANGE_8BIT_FULL
-    | x when x = int_of_define "SCHRO_SIGNAL_RANGE_8BIT_VIDEO" -> RANGE_8BIT_VIDEO
-    | x when x = int_of_define "SCHRO_SIGNAL_RANGE_10BIT_VIDEO" -> RANGE_10BIT_VIDEO
-    | x when x = int_of_define "SCHRO_SIGNAL_RANGE_12BIT_VIDEO" -> RANGE_12BIT_VIDEO
-    | _ -> assert false
+    | RANGE_CUSTOM -> signal_range_values.(0)
+    | RANGE_8BIT_FULL -> signal_range_values.(1)
+    | RANGE_8BIT_VIDEO -> signal_range_values.(2)
+    | RANGE_10BIT_VIDEO -> signal_range_values.(3)
+    | RANGE_12BIT_VIDEO -> signal_range_values.(4)
+
+let signal_range_of_int =
+  of_int_table signal_range_values [|RANGE_CUSTOM; RANGE_8BIT_FULL; RANGE_8BIT_VIDEO; RANGE_10BIT_VIDEO; RANGE_12BIT_VIDEO|]
 
 type video_format = 
  {
@@ -356,26 +372,29 @@ let get_default_video_format x =
   video_format_of_internal_video_format
     (get_default_internal_video_format (int_of_video_type x))
 
-type frame = 
+type 'a generic_frame = 
   { 
-    planes : (plane*int) array;
+    planes : ('a generic_plane*int) array;
     frame_width  : int;
     frame_height : int;
     format : format
   }
 
-type internal_frame = 
+type frame = Bigarray.int8_unsigned_elt generic_frame
+
+type frame16 = Bigarray.int16_signed_elt generic_frame
+
+type 'a internal_frame = 
   {
-    int_planes : (plane*int) array;
+    int_planes : ('a generic_plane*int) array;
     int_width  : int;
     int_height : int;
     int_format : int
   }
 
 let internal_frame_of_frame f = 
-  if (Array.length f.planes <> 3) then
-    failwith "Frame does not have 3 planes. \
-              Only planar formats are supported for now..";
+  if (Array.length f.planes <> (if is_packed f.format then 1 else 3)) then
+    failwith "Frame does not have 3 planes, or 1 for packed formats.";
   { int_planes = f.planes;
     int_width  = f.frame_width;
     int_height = f.frame_height;
@@ -397,6 +416,59 @@ external frames_of_granulepos : Int64.t -> bool -> Int64.t = "ocaml_schroedinger
 let frames_of_granulepos ~interlaced pos = 
   frames_of_granulepos pos interlaced
 
+module Frame =
+struct
+
+  type filter = Bilinear | Box
+
+  external create : int -> int -> int -> ('a generic_plane*int) array = "ocaml_schroedinger_frame_create"
+
+  (* Planes are views of a single block, freed
+   * once none of them is reachable anymore. *)
+  let create_generic format width height =
+    {
+      planes = create (int_of_format format) width height;
+      frame_width = width;
+      frame_height = height;
+      format = format
+    }
+
+  let is_s16 format =
+    match format with
+      | Yuv_422_p16 | Yuv_444_p16 | Yuv_420_p16 -> true
+      | _ -> false
+
+  let create ?(format=Yuv_420_p) width height : frame =
+    if is_s16 format then
+      raise (Invalid_argument "Schroedinger.Frame.create");
+    create_generic format width height
+
+  let create16 ?(format=Yuv_420_p16) width height : frame16 =
+    if not (is_s16 format) then
+      raise (Invalid_argument "Schroedinger.Frame.create16");
+    create_generic format width height
+
+  external release : ('a generic_plane*int) array -> unit = "ocaml_schroedinger_frame_release"
+
+  let release f = release f.planes
+
+  external scale_into : Bigarray.int8_unsigned_elt internal_frame -> Bigarray.int8_unsigned_elt internal_frame -> filter -> unit = "ocaml_schroedinger_frame_scale"
+
+  let scale_into ?(filter=Bilinear) src dst =
+    scale_into (internal_frame_of_frame src) (internal_frame_of_frame dst) filter
+
+  let scale ?filter ?format src width height =
+    let format =
+      match format with
+        | Some format -> format
+        | None -> src.format
+    in
+    let dst = create ~format width height in
+    scale_into ?filter src dst;
+    dst
+
+end
+
 module Encoder = 
 struct
 
@@ -407,6 +479,20 @@ struct
   let create f = 
     create (internal_video_format_of_video_format f)
 
+  external close : t -> unit = "ocaml_schroedinger_enc_close"
+
+  type stats = {
+    frames_pushed : int;
+    packets : int;
+    bytes : int;
+    sync_points : int;
+    frames_in_flight : int;
+    wait_time : float;
+    max_wait_time : float
+  }
+
+  external stats : t -> stats = "ocaml_schroedinger_enc_stats"
+
   external get_video_format : t -> internal_video_format = "ocaml_schroedinger_enc_video_format"
 
   let get_video_format x = 
@@ -416,12 +502,88 @@ struct
 
   external encode_header : t -> Ogg.Stream.t -> unit = "ocaml_schroedinger_encode_header"
 
-  external encode_frame : t -> internal_frame -> Ogg.Stream.t -> unit = "ocaml_schroedinger_encode_frame" 
+  external encode_frame : t -> 'a internal_frame -> Ogg.Stream.t -> unit = "ocaml_schroedinger_encode_frame" 
 
   let encode_frame t f = encode_frame t (internal_frame_of_frame f)
 
+  external encode_frame_nocopy : t -> 'a internal_frame -> Ogg.Stream.t -> unit = "ocaml_schroedinger_encode_frame_nocopy"
+
+  let encode_frame_nocopy t f = encode_frame_nocopy t (internal_frame_of_frame f)
+
   external encoded_of_granulepos : Int64.t -> t -> Int64.t = "ocaml_schroedinger_encoded_of_granulepos"
 
+  type packet =
+    {
+      data : data;
+      granulepos : Int64.t;
+      packet_no : Int64.t;
+      sync_point : bool
+    }
+
+  external push_frame : t -> 'a internal_frame -> unit = "ocaml_schroedinger_enc_push_frame"
+
+  let push_frame t f = push_frame t (internal_frame_of_frame f)
+
+  external push_frame_nocopy : t -> 'a internal_frame -> unit = "ocaml_schroedinger_enc_push_frame_nocopy"
+
+  let push_frame_nocopy t f = push_frame_nocopy t (internal_frame_of_frame f)
+
+  external end_of_stream : t -> unit = "ocaml_schroedinger_enc_end_of_stream"
+
+  (* The packet's data points to the encoder's buffer, freed
+   * once neither data nor any sub-array of it is reachable. *)
+  external pull_packet : t -> (data * Int64.t * Int64.t * bool) option = "ocaml_schroedinger_enc_pull_packet"
+
+  let pull_packet t =
+    match pull_packet t with
+      | None -> None
+      | Some (data,granulepos,packet_no,sync_point) ->
+          Some { data = data; granulepos = granulepos;
+                 packet_no = packet_no; sync_point = sync_point }
+
+  module Pipeline =
+  struct
+
+    type encoder = t
+
+    type t
+
+    external create : encoder -> int -> t = "ocaml_schroedinger_pipeline_create"
+
+    let create ?(queue_depth=2) enc = create enc queue_depth
+
+    type push_result = Queued | Busy
+
+    external push_frame : t -> 'a internal_frame -> bool -> bool -> bool = "ocaml_schroedinger_pipeline_push_frame"
+
+    let try_push_frame ?(copy=true) t f =
+      if push_frame t (internal_frame_of_frame f) copy false then
+        Queued
+      else
+        Busy
+
+    let push_frame ?(copy=true) t f =
+      ignore (push_frame t (internal_frame_of_frame f) copy true)
+
+    external end_of_stream : t -> unit = "ocaml_schroedinger_pipeline_end_of_stream"
+
+    external poll_packet : t -> bool -> (data * Int64.t * Int64.t * bool) option = "ocaml_schroedinger_pipeline_poll_packet"
+
+    let packet_of_result r =
+      match r with
+        | None -> None
+        | Some (data,granulepos,packet_no,sync_point) ->
+            Some { data = data; granulepos = granulepos;
+                   packet_no = packet_no; sync_point = sync_point }
+
+    let poll_packet t = packet_of_result (poll_packet t false)
+
+    let wait_packet t = packet_of_result (poll_packet t true)
+
+    external notify_fd : t -> Unix.file_descr = "ocaml_schroedinger_pipeline_notify_fd"
+
+  end
+
   type rate_control = 
     | Constant_noise_threshold
     | Constant_bitrate
@@ -527,117 +689,301 @@ struct
     magic_lambda: float
   }
 
-  external set_setting : t -> string -> 'a -> unit = "ocaml_schroedinger_set_setting"
-
-  let set_settings enc x = 
-    set_setting enc "rate_control" x.rate_control;
-    set_setting enc "bitrate" x.bitrate;
-    set_setting enc "max_bitrate" x.max_bitrate;
-    set_setting enc "min_bitrate" x.min_bitrate;
-    set_setting enc "buffer_size" x.buffer_size;
-    set_setting enc "buffer_level" x.buffer_level;
-    set_setting enc "noise_threshold" x.noise_threshold;
-    set_setting enc "gop_structure" x.gop_structure;
-    set_setting enc "queue_depth" x.queue_depth;
-    set_setting enc "perceptual_weighting" x.perceptual_weighting;
-    set_setting enc "perceptual_distance" x.perceptual_distance;
-    set_setting enc "filtering" x.filtering;
-    set_setting enc "filter_value" x.filter_value;
-    set_setting enc "profile" x.profile;
-    set_setting enc "level" x.level;
-    set_setting enc "au_distance" x.au_distance;
-    set_setting enc "enable_psnr" x.enable_psnr;
-    set_setting enc "enable_ssim" x.enable_ssim;
-    set_setting enc "ref_distance" x.ref_distance;
-    set_setting enc "transform_depth" x.transform_depth;
-    set_setting enc "intra_wavelet" x.intra_wavelet;
-    set_setting enc "inter_wavelet" x.inter_wavelet;
-    set_setting enc "mv_precision" x.mv_precision;
-    set_setting enc "motion_block_size" x.motion_block_size;
-    set_setting enc "motion_block_overlap" x.motion_block_overlap;
-    set_setting enc "interlaced_coding" x.interlaced_coding;
-    set_setting enc "enable_internal_testing" x.enable_internal_testing;
-    set_setting enc "enable_noarith" x.enable_noarith;
-    set_setting enc "enable_md5" x.enable_md5;
-    set_setting enc "enable_fullscan_estimation" x.enable_fullscan_estimation;
-    set_setting enc "enable_hierarchical_estimation" x.enable_hierarchical_estimation;
-    set_setting enc "enable_zero_estimation" x.enable_zero_estimation;
-    set_setting enc "enable_phasecorr_estimation" x.enable_phasecorr_estimation;
-    set_setting enc "enable_bigblock_estimation" x.enable_bigblock_estimation;
-    set_setting enc "horiz_slices" x.horiz_slices;
-    set_setting enc "vert_slices" x.vert_slices;
-    set_setting enc "magic_dc_metric_offset" x.magic_dc_metric_offset;
-    set_setting enc "magic_subband0_lambda_scale" x.magic_subband0_lambda_scale;
-    set_setting enc "magic_chroma_lambda_scale" x.magic_chroma_lambda_scale;
-    set_setting enc "magic_nonref_lambda_scale" x.magic_nonref_lambda_scale;
-    set_setting enc "magic_allocation_scale" x.magic_allocation_scale;
-    set_setting enc "magic_keyframe_weight" x.magic_keyframe_weight;
-    set_setting enc "magic_scene_change_threshold" x.magic_scene_change_threshold;
-    set_setting enc "magic_inter_p_weight" x.magic_inter_p_weight;
-    set_setting enc "magic_inter_b_weight" x.magic_inter_b_weight;
-    set_setting enc "magic_mc_bailout_limit" x.magic_mc_bailout_limit;
-    set_setting enc "magic_bailout_weight" x.magic_bailout_weight;
-    set_setting enc "magic_error_power" x.magic_error_power;
-    set_setting enc "magic_mc_lambda" x.magic_mc_lambda;
-    set_setting enc "magic_subgroup_length" x.magic_subgroup_length;
-    set_setting enc "magic_lambda" x.magic_lambda
-
-  external get_setting : t -> string -> 'a = "ocaml_schroedinger_get_setting"
-
-  let get_settings enc = 
+  (* Settings are given to the C side as a float array,
+   * in the order of the fields of the record. *)
+  let float_of_bool b = if b then 1. else 0.
+
+  let bool_of_float f = f <> 0.
+
+  (* Variants are given as their constructor's index,
+   * which is the corresponding libschroedinger value. *)
+  let float_of_variant (x : 'a) = float_of_int (Obj.magic x : int)
+
+  let variant_of_float f : 'a = Obj.magic (int_of_float f)
+
+  external set_settings : t -> float array -> unit = "ocaml_schroedinger_set_settings"
+
+  let set_settings enc x =
+    set_settings enc
+     [|
+      float_of_variant x.rate_control;
+      float_of_int x.bitrate;
+      float_of_int x.max_bitrate;
+      float_of_int x.min_bitrate;
+      float_of_int x.buffer_size;
+      float_of_int x.buffer_level;
+      x.noise_threshold;
+      float_of_variant x.gop_structure;
+      float_of_int x.queue_depth;
+      float_of_variant x.perceptual_weighting;
+      x.perceptual_distance;
+      float_of_variant x.filtering;
+      x.filter_value;
+      float_of_int x.profile;
+      float_of_int x.level;
+      float_of_int x.au_distance;
+      float_of_bool x.enable_psnr;
+      float_of_bool x.enable_ssim;
+      float_of_int x.ref_distance;
+      float_of_int x.transform_depth;
+      float_of_variant x.intra_wavelet;
+      float_of_variant x.inter_wavelet;
+      float_of_int x.mv_precision;
+      float_of_variant x.motion_block_size;
+      float_of_variant x.motion_block_overlap;
+      float_of_bool x.interlaced_coding;
+      float_of_bool x.enable_internal_testing;
+      float_of_bool x.enable_noarith;
+      float_of_bool x.enable_md5;
+      float_of_bool x.enable_fullscan_estimation;
+      float_of_bool x.enable_hierarchical_estimation;
+      float_of_bool x.enable_zero_estimation;
+      float_of_bool x.enable_phasecorr_estimation;
+      float_of_bool x.enable_bigblock_estimation;
+      float_of_int x.horiz_slices;
+      float_of_int x.vert_slices;
+      x.magic_dc_metric_offset;
+      x.magic_subband0_lambda_scale;
+      x.magic_chroma_lambda_scale;
+      x.magic_nonref_lambda_scale;
+      x.magic_allocation_scale;
+      x.magic_keyframe_weight;
+      x.magic_scene_change_threshold;
+      x.magic_inter_p_weight;
+      x.magic_inter_b_weight;
+      x.magic_mc_bailout_limit;
+      x.magic_bailout_weight;
+      x.magic_error_power;
+      x.magic_mc_lambda;
+      x.magic_subgroup_length;
+      x.magic_lambda
+     |]
+
+  external get_settings : t -> float array = "ocaml_schroedinger_get_settings"
+
+  let get_settings enc =
+   let a = get_settings enc in
    {
-    rate_control = get_setting enc "rate_control";
-    bitrate = get_setting enc "bitrate";
-    max_bitrate = get_setting enc "max_bitrate";
-    min_bitrate = get_setting enc "min_bitrate";
-    buffer_size = get_setting enc "buffer_size";
-    buffer_level = get_setting enc "buffer_level";
-    noise_threshold = get_setting enc "noise_threshold";
-    gop_structure = get_setting enc "gop_structure";
-    queue_depth = get_setting enc "queue_depth";
-    perceptual_weighting = get_setting enc "perceptual_weighting";
-    perceptual_distance = get_setting enc "perceptual_distance";
-    filtering = get_setting enc "filtering";
-    filter_value = get_setting enc "filter_value";
-    profile = get_setting enc "profile";
-    level = get_setting enc "level";
-    au_distance = get_setting enc "au_distance";
-    enable_psnr = get_setting enc "enable_psnr";
-    enable_ssim = get_setting enc "enable_ssim";
-    ref_distance = get_setting enc "ref_distance";
-    transform_depth = get_setting enc "transform_depth";
-    intra_wavelet = get_setting enc "intra_wavelet";
-    inter_wavelet = get_setting enc "inter_wavelet";
-    mv_precision = get_setting enc "mv_precision";
-    motion_block_size = get_setting enc "motion_block_size";
-    motion_block_overlap = get_setting enc "motion_block_overlap";
-    interlaced_coding = get_setting enc "interlaced_coding";
-    enable_internal_testing = get_setting enc "enable_internal_testing";
-    enable_noarith = get_setting enc "enable_noarith";
-    enable_md5 = get_setting enc "enable_md5";
-    enable_fullscan_estimation = get_setting enc "enable_fullscan_estimation";
-    enable_hierarchical_estimation = get_setting enc "enable_hierarchical_estimation";
-    enable_zero_estimation = get_setting enc "enable_zero_estimation";
-    enable_phasecorr_estimation = get_setting enc "enable_phasecorr_estimation";
-    enable_bigblock_estimation = get_setting enc "enable_bigblock_estimation";
-    horiz_slices = get_setting enc "horiz_slices";
-    vert_slices = get_setting enc "vert_slices";
-    magic_dc_metric_offset = get_setting enc "magic_dc_metric_offset";
-    magic_subband0_lambda_scale = get_setting enc "magic_subband0_lambda_scale";
-    magic_chroma_lambda_scale = get_setting enc "magic_chroma_lambda_scale";
-    magic_nonref_lambda_scale = get_setting enc "magic_nonref_lambda_scale";
-    magic_allocation_scale = get_setting enc "magic_allocation_scale";
-    magic_keyframe_weight = get_setting enc "magic_keyframe_weight";
-    magic_scene_change_threshold = get_setting enc "magic_scene_change_threshold";
-    magic_inter_p_weight = get_setting enc "magic_inter_p_weight";
-    magic_inter_b_weight = get_setting enc "magic_inter_b_weight";
-    magic_mc_bailout_limit = get_setting enc "magic_mc_bailout_limit";
-    magic_bailout_weight = get_setting enc "magic_bailout_weight";
-    magic_error_power = get_setting enc "magic_error_power";
-    magic_mc_lambda = get_setting enc "magic_mc_lambda";
-    magic_subgroup_length = get_setting enc "magic_subgroup_length";
-    magic_lambda = get_setting enc "magic_lambda"
+    rate_control = variant_of_float a.(0);
+    bitrate = int_of_float a.(1);
+    max_bitrate = int_of_float a.(2);
+    min_bitrate = int_of_float a.(3);
+    buffer_size = int_of_float a.(4);
+    buffer_level = int_of_float a.(5);
+    noise_threshold = a.(6);
+    gop_structure = variant_of_float a.(7);
+    queue_depth = int_of_float a.(8);
+    perceptual_weighting = variant_of_float a.(9);
+    perceptual_distance = a.(10);
+    filtering = variant_of_float a.(11);
+    filter_value = a.(12);
+    profile = int_of_float a.(13);
+    level = int_of_float a.(14);
+    au_distance = int_of_float a.(15);
+    enable_psnr = bool_of_float a.(16);
+    enable_ssim = bool_of_float a.(17);
+    ref_distance = int_of_float a.(18);
+    transform_depth = int_of_float a.(19);
+    intra_wavelet = variant_of_float a.(20);
+    inter_wavelet = variant_of_float a.(21);
+    mv_precision = int_of_float a.(22);
+    motion_block_size = variant_of_float a.(23);
+    motion_block_overlap = variant_of_float a.(24);
+    interlaced_coding = bool_of_float a.(25);
+    enable_internal_testing = bool_of_float a.(26);
+    enable_noarith = bool_of_float a.(27);
+    enable_md5 = bool_of_float a.(28);
+    enable_fullscan_estimation = bool_of_float a.(29);
+    enable_hierarchical_estimation = bool_of_float a.(30);
+    enable_zero_estimation = bool_of_float a.(31);
+    enable_phasecorr_estimation = bool_of_float a.(32);
+    enable_bigblock_estimation = bool_of_float a.(33);
+    horiz_slices = int_of_float a.(34);
+    vert_slices = int_of_float a.(35);
+    magic_dc_metric_offset = a.(36);
+    magic_subband0_lambda_scale = a.(37);
+    magic_chroma_lambda_scale = a.(38);
+    magic_nonref_lambda_scale = a.(39);
+    magic_allocation_scale = a.(40);
+    magic_keyframe_weight = a.(41);
+    magic_scene_change_threshold = a.(42);
+    magic_inter_p_weight = a.(43);
+    magic_inter_b_weight = a.(44);
+    magic_mc_bailout_limit = a.(45);
+    magic_bailout_weight = a.(46);
+    magic_error_power = a.(47);
+    magic_mc_lambda = a.(48);
+    magic_subgroup_length = a.(49);
+    magic_lambda = a.(50)
    }
+
+  type 'a setting =
+    {
+      index : int;
+      to_float : 'a -> float;
+      of_float : float -> 'a
+    }
+
+  let int_setting index =
+    { index = index; to_float = float_of_int; of_float = int_of_float }
+
+  let float_setting index =
+    { index = index; to_float = (fun x -> x); of_float = (fun x -> x) }
+
+  let bool_setting index =
+    { index = index; to_float = float_of_bool; of_float = bool_of_float }
+
+  let variant_setting index =
+    { index = index; to_float = float_of_variant; of_float = variant_of_float }
+
+  module Setting =
+  struct
+    let rate_control : rate_control setting = variant_setting 0
+    let bitrate = int_setting 1
+    let max_bitrate = int_setting 2
+    let min_bitrate = int_setting 3
+    let buffer_size = int_setting 4
+    let buffer_level = int_setting 5
+    let noise_threshold = float_setting 6
+    let gop_structure : gop_structure setting = variant_setting 7
+    let queue_depth = int_setting 8
+    let perceptual_weighting : perceptual_weighting setting = variant_setting 9
+    let perceptual_distance = float_setting 10
+    let filtering : filtering setting = variant_setting 11
+    let filter_value = float_setting 12
+    let profile = int_setting 13
+    let level = int_setting 14
+    let au_distance = int_setting 15
+    let enable_psnr = bool_setting 16
+    let enable_ssim = bool_setting 17
+    let ref_distance = int_setting 18
+    let transform_depth = int_setting 19
+    let intra_wavelet : wavelet setting = variant_setting 20
+    let inter_wavelet : wavelet setting = variant_setting 21
+    let mv_precision = int_setting 22
+    let motion_block_size : block_size setting = variant_setting 23
+    let motion_block_overlap : block_overlap setting = variant_setting 24
+    let interlaced_coding = bool_setting 25
+    let enable_internal_testing = bool_setting 26
+    let enable_noarith = bool_setting 27
+    let enable_md5 = bool_setting 28
+    let enable_fullscan_estimation = bool_setting 29
+    let enable_hierarchical_estimation = bool_setting 30
+    let enable_zero_estimation = bool_setting 31
+    let enable_phasecorr_estimation = bool_setting 32
+    let enable_bigblock_estimation = bool_setting 33
+    let horiz_slices = int_setting 34
+    let vert_slices = int_setting 35
+    let magic_dc_metric_offset = float_setting 36
+    let magic_subband0_lambda_scale = float_setting 37
+    let magic_chroma_lambda_scale = float_setting 38
+    let magic_nonref_lambda_scale = float_setting 39
+    let magic_allocation_scale = float_setting 40
+    let magic_keyframe_weight = float_setting 41
+    let magic_scene_change_threshold = float_setting 42
+    let magic_inter_p_weight = float_setting 43
+    let magic_inter_b_weight = float_setting 44
+    let magic_mc_bailout_limit = float_setting 45
+    let magic_bailout_weight = float_setting 46
+    let magic_error_power = float_setting 47
+    let magic_mc_lambda = float_setting 48
+    let magic_subgroup_length = float_setting 49
+    let magic_lambda = float_setting 50
+  end
+
+  external set_setting : t -> int -> float -> unit = "ocaml_schroedinger_set_setting"
+
+  let set enc s x = set_setting enc s.index (s.to_float x)
+
+  external get_setting : t -> int -> float = "ocaml_schroedinger_get_setting"
+
+  let get enc s = s.of_float (get_setting enc s.index)
+
+  module Parallel =
+  struct
+
+    type encoder = t
+
+    type parallel
+
+    type t =
+      {
+        enc : encoder;
+        par : parallel
+      }
+
+    external create : encoder -> int -> int -> parallel = "ocaml_schroedinger_parallel_create"
+
+    let create ?(jobs=0) ?gop_size enc =
+      let gop_size =
+        match gop_size with
+          | Some n -> n
+          | _ -> max 1 (get enc Setting.au_distance)
+      in
+      { enc = enc; par = create enc jobs gop_size }
+
+    let encode_header t os = encode_header t.enc os
+
+    external push_frame : parallel -> 'a internal_frame -> unit = "ocaml_schroedinger_parallel_push_frame"
+
+    let push_frame t f = push_frame t.par (internal_frame_of_frame f)
+
+    external end_of_stream : parallel -> unit = "ocaml_schroedinger_parallel_end_of_stream"
+
+    let end_of_stream t = end_of_stream t.par
+
+    external poll_packet : parallel -> bool -> (data * Int64.t * Int64.t * bool) option = "ocaml_schroedinger_parallel_poll_packet"
+
+    let poll_packet t = Pipeline.packet_of_result (poll_packet t.par false)
+
+    let wait_packet t = Pipeline.packet_of_result (poll_packet t.par true)
+
+    external encode_frame : parallel -> 'a internal_frame -> Ogg.Stream.t -> unit = "ocaml_schroedinger_parallel_encode_frame"
+
+    let encode_frame t f os = encode_frame t.par (internal_frame_of_frame f) os
+
+    external eos : parallel -> Ogg.Stream.t -> unit = "ocaml_schroedinger_parallel_eos"
+
+    let eos t os = eos t.par os
+
+  end
+
+  module Ladder =
+  struct
+
+    type encoder = t
+
+    type t =
+      {
+        encoders : encoder array;
+        streams : Ogg.Stream.t array
+      }
+
+    let create format renditions =
+      let encoder (settings,_) =
+        let enc = create format in
+        set_settings enc settings;
+        enc
+      in
+      {
+        encoders = Array.of_list (List.map encoder renditions);
+        streams = Array.of_list (List.map snd renditions)
+      }
+
+    let encoders t = Array.to_list t.encoders
+
+    let encode_header t =
+      Array.iteri (fun i enc -> encode_header enc t.streams.(i)) t.encoders
+
+    external encode_frame : encoder array -> Ogg.Stream.t array -> 'a internal_frame -> bool -> unit = "ocaml_schroedinger_ladder_encode_frame"
+
+    let encode_frame ?(copy=true) t f =
+      encode_frame t.encoders t.streams (internal_frame_of_frame f) copy
+
+    let eos t =
+      Array.iteri (fun i enc -> eos enc t.streams.(i)) t.encoders
+
+  end
 end
 
 module Decoder = 
@@ -654,37 +1000,414 @@ struct
 
   type t
 
-  external create : Ogg.Stream.packet -> t = "ocaml_schroedinger_create_dec"
+  external create : Ogg.Stream.packet -> Ogg.Stream.packet -> t = "ocaml_schroedinger_create_dec"
+
+  external set_s16 : t -> bool -> unit = "ocaml_schroedinger_decoder_set_s16"
+
+  external is_s16 : t -> bool = "ocaml_schroedinger_decoder_s16"
+
+  let create ?(s16=false) p1 p2 =
+    let dec = create p1 p2 in
+    set_s16 dec s16;
+    dec
+
+  external close : t -> unit = "ocaml_schroedinger_decoder_close"
 
-  let check p = 
-    try
-      ignore(create p);
-      true
-    with
-       | Invalid_header -> false
+  (* Functions returning frames check that
+   * they have the expected depth. *)
+  let check_depth dec s16 name =
+    if is_s16 dec <> s16 then
+      raise (Invalid_argument ("Schroedinger.Decoder." ^ name))
 
-  let create p1 p2 = create p2
+  external check : Ogg.Stream.packet -> bool = "ocaml_schroedinger_check_header"
 
-  external get_video_format : t -> video_format = "ocaml_schroedinger_decoder_get_format"
+  external probe : Ogg.Stream.packet -> internal_video_format = "ocaml_schroedinger_probe"
+
+  let probe p =
+    video_format_of_internal_video_format (probe p)
+
+  external probe_data : data -> int -> int -> internal_video_format = "ocaml_schroedinger_probe_data"
+
+  let probe_data ?(offset=0) ?length data =
+    let length =
+      match length with
+        | Some l -> l
+        | None -> Bigarray.Array1.dim data - offset
+    in
+    video_format_of_internal_video_format (probe_data data offset length)
+
+  external get_video_format : t -> internal_video_format = "ocaml_schroedinger_decoder_get_format"
+
+  let get_video_format dec =
+    video_format_of_internal_video_format (get_video_format dec)
 
   external get_picture_number : t -> int = "ocaml_schroedinger_decoder_get_picture_number"
 
-  external decode_frame : t -> Ogg.Stream.t -> internal_frame = "ocaml_schroedinger_decoder_decode_frame"
+  external reset : t -> unit = "ocaml_schroedinger_decoder_reset"
+
+  (* Decoded planes point to a frame owned by the decoder's
+   * pool. The frame goes back to the pool once no plane, nor
+   * any sub-array of a plane, is reachable anymore. *)
+  external decode_frame : t -> Ogg.Stream.t -> Bigarray.int8_unsigned_elt internal_frame = "ocaml_schroedinger_decoder_decode_frame"
 
   let decode_frame dec os = 
-    frame_of_internal_frame (decode_frame dec os)    
+    check_depth dec false "decode_frame";
+    frame_of_internal_frame (decode_frame dec os)
+
+  external decode_frame16 : t -> Ogg.Stream.t -> Bigarray.int16_signed_elt internal_frame = "ocaml_schroedinger_decoder_decode_frame"
+
+  let decode_frame16 dec os = 
+    check_depth dec true "decode_frame16";
+    frame_of_internal_frame (decode_frame16 dec os)
+
+  type 'a generic_result =
+    | Frame of 'a generic_frame
+    | Repeat
+    | Need_data
+    | Eos
+
+  type result = Bigarray.int8_unsigned_elt generic_result
+
+  type result16 = Bigarray.int16_signed_elt generic_result
+
+  type 'a internal_result =
+    | Internal_frame of 'a internal_frame
+    | Internal_repeat
+    | Internal_need_data
+    | Internal_eos
+
+  let result_of_internal_result r =
+    match r with
+      | Internal_frame f -> Frame (frame_of_internal_frame f)
+      | Internal_repeat -> Repeat
+      | Internal_need_data -> Need_data
+      | Internal_eos -> Eos
+
+  external decode : t -> Ogg.Stream.t -> Bigarray.int8_unsigned_elt internal_result = "ocaml_schroedinger_decoder_decode"
+
+  let decode dec os =
+    check_depth dec false "decode";
+    result_of_internal_result (decode dec os)
+
+  external release_frame : t -> 'a generic_frame -> unit = "ocaml_schroedinger_decoder_release_frame"
+
+  external create_raw : unit -> t = "ocaml_schroedinger_create_dec_raw"
+
+  let create_raw ?(s16=false) () =
+    let dec = create_raw () in
+    set_s16 dec s16;
+    dec
+
+  external push_data : t -> data -> int -> int -> unit = "ocaml_schroedinger_decoder_push_data"
+
+  let push_data dec ?(offset=0) ?length data =
+    let length =
+      match length with
+        | Some l -> l
+        | None -> Bigarray.Array1.dim data - offset
+    in
+    push_data dec data offset length
+
+  external push_eos : t -> unit = "ocaml_schroedinger_decoder_push_eos"
+
+  external eos_pushed : t -> bool = "ocaml_schroedinger_decoder_eos_pushed"
+
+  external pull_frame : t -> Bigarray.int8_unsigned_elt internal_frame = "ocaml_schroedinger_decoder_pull_frame"
+
+  let pull_frame dec =
+    check_depth dec false "pull_frame";
+    frame_of_internal_frame (pull_frame dec)
+
+  external pull : t -> Bigarray.int8_unsigned_elt internal_result = "ocaml_schroedinger_decoder_pull"
+
+  let pull dec =
+    check_depth dec false "pull";
+    result_of_internal_result (pull dec)
+
+  external decode_frame_into : t -> Ogg.Stream.t -> 'a internal_frame -> unit = "ocaml_schroedinger_decoder_decode_frame_into"
+
+  let decode_frame_into dec os f =
+    decode_frame_into dec os (internal_frame_of_frame f)
+
+  module Async =
+  struct
+
+    type t
+
+    external create : int -> bool -> t = "ocaml_schroedinger_async_create"
+
+    let create ?(depth=4) ?(s16=false) () = create depth s16
+
+    external is_s16 : t -> bool = "ocaml_schroedinger_async_s16"
+
+    let check_depth dec s16 name =
+      if is_s16 dec <> s16 then
+        raise (Invalid_argument ("Schroedinger.Decoder.Async." ^ name))
+
+    external push_data : t -> data -> int -> int -> unit = "ocaml_schroedinger_async_push_data"
+
+    let push_data dec ?(offset=0) ?length data =
+      let length =
+        match length with
+          | Some l -> l
+          | None -> Bigarray.Array1.dim data - offset
+      in
+      push_data dec data offset length
+
+    external push_packet : t -> Ogg.Stream.packet -> unit = "ocaml_schroedinger_async_push_packet"
+
+    external push_eos : t -> unit = "ocaml_schroedinger_async_push_eos"
+
+    external get_video_format : t -> internal_video_format option = "ocaml_schroedinger_async_get_format"
+
+    let get_video_format dec =
+      match get_video_format dec with
+        | Some f -> Some (video_format_of_internal_video_format f)
+        | None -> None
+
+    external pull : t -> bool -> 'a internal_result option = "ocaml_schroedinger_async_pull"
+
+    let try_pull_generic dec =
+      match pull dec false with
+        | Some r -> Some (result_of_internal_result r)
+        | None -> None
+
+    let pull_generic dec =
+      match pull dec true with
+        | Some r -> result_of_internal_result r
+        | None -> Need_data
+
+    let try_pull dec : result option =
+      check_depth dec false "try_pull";
+      try_pull_generic dec
+
+    let pull dec : result =
+      check_depth dec false "pull";
+      pull_generic dec
+
+    let try_pull16 dec : result16 option =
+      check_depth dec true "try_pull16";
+      try_pull_generic dec
+
+    let pull16 dec : result16 =
+      check_depth dec true "pull16";
+      pull_generic dec
+
+    external stop : t -> unit = "ocaml_schroedinger_async_stop"
+
+  end
+
+  module Mmap =
+  struct
+
+    type decoder = t
+
+    type reader
+
+    type t = {
+      reader : reader;
+      data : data
+    }
+
+    external create : Nativeint.t option -> reader = "ocaml_schroedinger_mmap_reader_create"
+
+    external serial : reader -> Nativeint.t = "ocaml_schroedinger_mmap_reader_serial"
+
+    external seek : reader -> Int64.t -> unit = "ocaml_schroedinger_mmap_reader_seek"
+
+    external push_packet : reader -> data -> decoder -> bool = "ocaml_schroedinger_mmap_reader_push"
+
+    let of_fd ?serial fd =
+      let data =
+        Bigarray.array1_of_genarray
+          (Unix.map_file fd Bigarray.int8_unsigned Bigarray.c_layout false [|-1|])
+      in
+      { reader = create serial; data = data }
+
+    let openfile ?serial file =
+      let fd = Unix.openfile file [Unix.O_RDONLY] 0 in
+      let t = try of_fd ?serial fd with e -> Unix.close fd; raise e in
+      Unix.close fd;
+      t
+
+    let serial t = serial t.reader
+
+    let seek t offset = seek t.reader offset
+
+    let push_packet t dec = push_packet t.reader t.data dec
+
+    (* Once the end of the stream is pushed, the decoder
+     * only needs data again after a reset. *)
+    let rec decode t dec =
+      match pull dec with
+        | Need_data when eos_pushed dec -> Eos
+        | Need_data ->
+            if not (push_packet t dec) then push_eos dec;
+            decode t dec
+        | r -> r
+
+  end
+
+end
+
+module Seek =
+struct
+
+  type sync_point = {
+    offset : Int64.t;
+    picture : int
+  }
+
+  type index = {
+    serial : Nativeint.t;
+    sync_points : sync_point array
+  }
+
+  let serial i = i.serial
+
+  let sync_points i = i.sync_points
+
+  external scan : Unix.file_descr -> Nativeint.t option -> Int64.t -> Int64.t ->
+                  Nativeint.t * (Int64.t * int) array = "ocaml_schroedinger_seek_scan"
+
+  external next_granule : Unix.file_descr -> Nativeint.t -> Int64.t ->
+                          Int64.t * Int64.t = "ocaml_schroedinger_seek_next_granule"
+
+  let scan_range fd serial start stop =
+    let serial, points = scan fd serial start stop in
+    serial,
+    Array.map (fun (offset, picture) -> { offset = offset; picture = picture }) points
+
+  let scan ?serial fd =
+    let serial, points = scan_range fd serial 0L Int64.max_int in
+    { serial = serial; sync_points = points }
+
+  let magic = "OCAML-SCHROEDINGER-INDEX-1"
+
+  let save i oc =
+    Printf.fprintf oc "%s\n%nd %d\n" magic i.serial (Array.length i.sync_points);
+    Array.iter (fun p -> Printf.fprintf oc "%Ld %d\n" p.offset p.picture) i.sync_points
+
+  let load ic =
+    if input_line ic <> magic then
+      failwith "Schroedinger.Seek.load: invalid index";
+    let serial, len = Scanf.sscanf (input_line ic) "%nd %d" (fun s n -> s, n) in
+    let point _ =
+      Scanf.sscanf (input_line ic) "%Ld %d"
+        (fun offset picture -> { offset = offset; picture = picture })
+    in
+    { serial = serial; sync_points = Array.init len point }
+
+  (* Last element of points whose picture is at most n. *)
+  let last_before points n =
+    let rec f lo hi =
+      (* points.(lo) is before n, points.(hi) is not. *)
+      if hi - lo <= 1 then points.(lo) else
+        let mid = (lo + hi) / 2 in
+        if points.(mid).picture <= n then f mid hi else f lo mid
+    in
+    let len = Array.length points in
+    if len = 0 || points.(0).picture > n then raise Not_found;
+    f 0 len
+
+  let find i n = last_before i.sync_points n
+
+  (* Below this size, the file is scanned instead of bisected. *)
+  let bisect_min = 1048576L
+
+  (* Returns the serial number along with the sync point. *)
+  let bisect_serial ?serial ?(interlaced=false) fd n =
+    let serial =
+      match serial with
+        | Some s -> s
+        | None -> fst (scan_range fd None 0L 1L)
+    in
+    (* Presentation number of the last picture of a page, the
+     * numbering of sync points. *)
+    let picture gp = frames_of_granulepos ~interlaced gp in
+    let n64 = Int64.of_int n in
+    let size = (Unix.LargeFile.fstat fd).Unix.LargeFile.st_size in
+    (* Pages at lo end before picture n, pages after hi do not. *)
+    let rec f lo hi =
+      if Int64.sub hi lo <= bisect_min then lo else
+        let mid = Int64.add lo (Int64.div (Int64.sub hi lo) 2L) in
+        match
+          (try Some (next_granule fd serial mid) with Not_found -> None)
+        with
+          | Some (offset, gp) when offset < hi && picture gp < n64 -> f mid hi
+          | _ -> f lo mid
+    in
+    let lo = f 0L size in
+    (* The sync point is found by scanning backwards from lo
+     * with a growing window. *)
+    let rec g window =
+      let start = max 0L (Int64.sub lo window) in
+      let _, points = scan_range fd (Some serial) start (Int64.add lo bisect_min) in
+      try last_before points n with
+        | Not_found when start > 0L -> g (Int64.mul window 2L)
+    in
+    serial, g bisect_min
+
+  let bisect ?serial ?interlaced fd n =
+    snd (bisect_serial ?serial ?interlaced fd n)
+
+  module Indexer =
+  struct
+
+    type t
+
+    external create : Nativeint.t -> t = "ocaml_schroedinger_indexer_create"
+
+    external add_page : t -> Int64.t -> Ogg.Page.t -> unit = "ocaml_schroedinger_indexer_add_page"
+
+    external sync_points : t -> (Int64.t * int) array = "ocaml_schroedinger_indexer_sync_points"
+
+    external serial : t -> Nativeint.t = "ocaml_schroedinger_indexer_serial"
+
+    let index t =
+      { serial = serial t;
+        sync_points =
+          Array.map (fun (offset, picture) -> { offset = offset; picture = picture })
+                    (sync_points t) }
+
+  end
+
+  let seek_to_frame ?index ?interlaced dec sync fd n =
+    let serial, p =
+      match index with
+        | Some i -> i.serial, find i n
+        | None -> bisect_serial ?interlaced fd n
+    in
+    ignore (Unix.LargeFile.lseek fd p.offset Unix.SEEK_SET);
+    (* Drop the data read before seeking. *)
+    Ogg.Sync.reset sync;
+    Decoder.reset dec;
+    p, Ogg.Stream.create ~serial ()
 
 end
 
 module Skeleton =
 struct
 
+  external fishead : Int64.t * Int64.t -> Int64.t * Int64.t -> Int64.t -> Int64.t ->
+                     Ogg.Stream.packet = "ocaml_schroedinger_skeleton_fishead"
+
+  let fishead ?(presentation_time=(0L,1000L)) ?(base_time=(0L,1000L))
+              ?(segment_length=0L) ?(content_offset=0L) () =
+    fishead presentation_time base_time segment_length content_offset
+
   external fisbone : Nativeint.t -> internal_video_format -> 
                      Int64.t -> string -> Ogg.Stream.packet = "ocaml_schroedinger_skeleton_fisbone"
 
-  let fisbone ?(start_granule=Int64.zero)
-              ?(headers=["Content-type","video/dirac"])
-              ~serialno ~format () =
+  let fisbone ?(start_granule=Int64.zero) ?headers ~serialno ~format () =
+    let headers =
+      match headers with
+        | Some h -> h
+        | None ->
+            ["Content-Type", "video/dirac";
+             "Role", "video/main";
+             "Name", Printf.sprintf "video_%nx" serialno]
+    in
     let concat s (h,v) =
       Printf.sprintf "%s%s: %s\r\n" s h v
     in
@@ -694,4 +1417,64 @@ struct
     fisbone serialno (internal_video_format_of_video_format format) 
             start_granule s
 
+  external index : Nativeint.t -> (Int64.t * Int64.t) array -> Int64.t ->
+                   Int64.t * Int64.t -> int -> Ogg.Stream.packet = "ocaml_schroedinger_skeleton_index"
+
+  external parse_index : Ogg.Stream.packet ->
+                         Nativeint.t * Int64.t * (Int64.t * Int64.t) * (Int64.t * Int64.t) array
+                         = "ocaml_schroedinger_skeleton_parse_index"
+
+  (* Timestamps are counted in pictures, which are
+   * fields with interlaced coding. *)
+  let picture_rate format =
+    let n = Int64.of_int format.frame_rate_numerator in
+    let d = Int64.of_int format.frame_rate_denominator in
+    if format.interlaced_coding then Int64.mul n 2L, d else n, d
+
+  let index ?(size=0) ?end_picture ~format i =
+    let n, d = picture_rate format in
+    let time p = Int64.mul (Int64.of_int p) d in
+    let points = i.Seek.sync_points in
+    let len = Array.length points in
+    let first = if len = 0 then 0L else time points.(0).Seek.picture in
+    let last =
+      match end_picture with
+        | Some p -> time p
+        | None -> if len = 0 then 0L else time points.(len-1).Seek.picture
+    in
+    index i.Seek.serial
+          (Array.map (fun p -> p.Seek.offset, time p.Seek.picture) points)
+          n (first, last) size
+
+  let parse_index ~format packet =
+    let n, d = picture_rate format in
+    let serial, den, _, points = parse_index packet in
+    (* Rounded to the nearest picture. *)
+    let picture t =
+      let num = Int64.mul t n in
+      let den = Int64.mul den d in
+      Int64.to_int (Int64.div (Int64.add num (Int64.div den 2L)) den)
+    in
+    { Seek.
+        serial = serial;
+        sync_points =
+          Array.map (fun (offset, t) -> { Seek.offset = offset; picture = picture t }) points }
+
+  (* Pages are flushed before and after the packet,
+   * which fits in a single page. *)
+  let index_pages os packet =
+    let rec pages acc =
+      match (try Some (Ogg.Stream.flush_page os) with Ogg.Not_enough_data -> None) with
+        | Some p -> pages (p :: acc)
+        | None -> List.rev acc
+    in
+    let before = pages [] in
+    Ogg.Stream.put_packet os packet;
+    match pages [] with
+      | [p] -> before, p
+      | _ -> failwith "Schroedinger.Skeleton.index_pages"
+
+  external patch_index : Unix.file_descr -> Int64.t -> Ogg.Stream.packet -> unit
+                       = "ocaml_schroedinger_skeleton_patch_index"
+
 end
@@ -19,16 +19,45 @@
  *)
 
   (** OCaml API for the schroedinger video encoding/decoding library
-      implementing the Dirac video codec. *)
+      implementing the Dirac video codec.
 
-type plane = (int, Bigarray.int8_unsigned_elt, Bigarray.c_layout) Bigarray.Array1.t
+      The bindings can be used from several threads or domains, each
+      encoder, decoder or frame being used by one of them at a time.
+      Frames are copied or converted, and data is encoded or decoded,
+      without holding the runtime lock. *)
 
-(* Only planar formats for now.. *)
+type 'a generic_plane = (int, 'a, Bigarray.c_layout) Bigarray.Array1.t
+
+(** Plane of 8 bits samples. *)
+type plane = Bigarray.int8_unsigned_elt generic_plane
+
+(** Plane of 16 bits samples, used for sources of more than 8 bits. *)
+type plane16 = Bigarray.int16_signed_elt generic_plane
+
+(** Raised when using an encoder or a decoder after closing it. *)
+exception Closed
+
+(** Compressed data. *)
+type data = (int, Bigarray.int8_unsigned_elt, Bigarray.c_layout) Bigarray.Array1.t
+
+(** Frames in packed formats have a single plane. They are converted
+  * to the chroma format of the encoder when encoding, and can be
+  * decoded into using [Decoder.decode_frame_into]. Decoded frames
+  * are always planar. *)
 type format =
    | Yuv_422_p    (** Planar YCbCr 4:2:2. Each component is an uint8_t *)
    | Yuv_444_p    (** Planar YCbCr 4:4:4. Each component is an uint8_t *)
    | Yuv_420_p   (** Planar YCbCr 4:2:0. Each component is an uint8_t,
                    * luma and chroma values are full range (0x00 .. 0xff) *)
+   | Yuyv_422     (** Packed YCbCr 4:2:2, as Y0 Cb Y1 Cr. *)
+   | Uyvy_422     (** Packed YCbCr 4:2:2, as Cb Y0 Cr Y1. *)
+   | V210         (** Packed 10 bits YCbCr 4:2:2, 6 pixels in 16 bytes.
+                    * Samples are converted to and from 8 bits. *)
+   | Rgba         (** Packed R G B A, converted to and from video range
+                    * YCbCr with the ITU-R BT.601 matrix. *)
+   | Yuv_422_p16  (** Same as [Yuv_422_p] with 16 bits samples. *)
+   | Yuv_444_p16  (** Same as [Yuv_444_p] with 16 bits samples. *)
+   | Yuv_420_p16  (** Same as [Yuv_420_p] with 16 bits samples. *)
 
 type video_type = 
   | CUSTOM
@@ -114,17 +143,66 @@ type video_format =
 
 val get_default_video_format : video_type -> video_format
 
-type frame =
+type 'a generic_frame =
   {
-    (** The integer is the stride for the plane. *)
-    planes : (plane*int) array;
+    (** The integer is the stride for the plane, in samples. *)
+    planes : ('a generic_plane*int) array;
     frame_width  : int;
     frame_height : int;
     format : format
   }
 
+type frame = Bigarray.int8_unsigned_elt generic_frame
+
+(** Frames with 16 bits samples, in the [Yuv_*_p16] formats. Samples
+  * are passed to and from schroedinger as they are, for instance to
+  * encode 10 bits sources with a [RANGE_10BIT_VIDEO] signal range. *)
+type frame16 = Bigarray.int16_signed_elt generic_frame
+
 val frames_of_granulepos : interlaced:bool -> Int64.t -> Int64.t
 
+(** Operations on frames. *)
+module Frame :
+sig
+
+  (** [Box] averages the source pixels covered by each
+    * destination pixel, which is best for large downscaling. *)
+  type filter = Bilinear | Box
+
+  (** Create a frame of the given width and height. Its planes are
+    * slices of a single block, each starting on a 64 bytes boundary
+    * and with a stride multiple of 64 bytes, which is the layout
+    * used by the encoder and decoder internally. Default [format]
+    * is [Yuv_420_p], 16 bits formats raise [Invalid_argument]. *)
+  val create : ?format:format -> int -> int -> frame
+
+  (** Same as [create] for 16 bits formats. Default [format] is
+    * [Yuv_420_p16]. *)
+  val create16 : ?format:format -> int -> int -> frame16
+
+  (** Free the memory of the planes of a frame now instead of when
+    * they are collected. The planes become empty. The memory is only
+    * freed at once when no bigarray was taken from the planes, for
+    * instance with [sub], and no encoder, pipeline or decoder still
+    * reads or writes them; otherwise this happens once they are all
+    * done and the bigarrays are collected. Only planes allocated by
+    * this module, with [create], [create16] or by a decoder, are
+    * released: other planes are left untouched. *)
+  val release : 'a generic_frame -> unit
+
+  (** Scale a frame into another one, reading and writing the planes
+    * with their strides. The frames may have different planar formats,
+    * packed formats raise [Invalid_argument]. Default [filter] is
+    * [Bilinear]. *)
+  val scale_into : ?filter:filter -> frame -> frame -> unit
+
+  (** Scale a frame to the given width and height, in a new frame
+    * with the given format. Default [format] is the format of the
+    * source frame. *)
+  val scale : ?filter:filter -> ?format:format -> frame -> int -> int -> frame
+
+end
+
 module Encoder :
 sig
 
@@ -132,16 +210,132 @@ sig
 
   val create : video_format -> t
 
+  (** Free the encoder now instead of when it is collected. It is
+    * kept until pipelines and parallel encoders created from it are
+    * done with it. Functions using it afterwards raise [Closed]. *)
+  val close : t -> unit
+
+  (** Counters kept by an encoder since its creation. *)
+  type stats = {
+    frames_pushed : int; (** Frames given to the encoder. *)
+    packets : int; (** Packets output. *)
+    bytes : int; (** Size of the packets output. *)
+    sync_points : int; (** Sequence headers output. *)
+    frames_in_flight : int; (** Frames given but not output yet. *)
+    wait_time : float; (** Time spent waiting for the encoder, in seconds. *)
+    max_wait_time : float (** Longest single wait, in seconds. *)
+  }
+
+  (** Current counters of an encoder. They can be read while a
+    * pipeline or a parallel encoder uses it. Waits of the encoders
+    * of [Parallel] are not counted. Per frame PSNR and SSIM are not
+    * available: schroedinger only prints them in its debug log. *)
+  val stats : t -> stats
+
   val get_video_format : t -> video_format
 
   val encode_header : t -> Ogg.Stream.t -> unit
 
-  val encode_frame : t -> frame -> Ogg.Stream.t -> unit
+  (** Encode a frame. Frames with 16 bits samples are given to the
+    * encoder as they are, its video format should then have a signal
+    * range of more than 8 bits. *)
+  val encode_frame : t -> 'a generic_frame -> Ogg.Stream.t -> unit
+
+  (** Same as [encode_frame] but the encoder reads the planes of the frame
+    * directly instead of copying them first. The planes are kept alive
+    * until the encoder is done with them, which may be several frames
+    * later, and must not be modified in the meantime: use fresh planes
+    * for each frame. Frames in packed formats are still converted. *)
+  val encode_frame_nocopy : t -> 'a generic_frame -> Ogg.Stream.t -> unit
 
   val encoded_of_granulepos : Int64.t -> t -> Int64.t
 
   val eos : t -> Ogg.Stream.t -> unit
 
+  (** {2 Packet API}
+    *
+    * These functions give access to the encoded packets without
+    * going through an ogg stream. After pushing a frame, packets
+    * should be pulled until [pull_packet] returns [None] before
+    * pushing the next one. *)
+
+  (** An encoded packet. [data] points directly to the encoder's
+    * buffer, which is released once [data] and all the bigarrays
+    * taken from it are collected. *)
+  type packet =
+    {
+      data : data;
+      granulepos : Int64.t;
+      packet_no : Int64.t;
+      sync_point : bool
+    }
+
+  val push_frame : t -> 'a generic_frame -> unit
+
+  (** Same as [push_frame] without copying the planes, see
+    * [encode_frame_nocopy]. *)
+  val push_frame_nocopy : t -> 'a generic_frame -> unit
+
+  (** Signal the end of the stream. Remaining packets
+    * should then be pulled until [pull_packet] returns [None]. *)
+  val end_of_stream : t -> unit
+
+  (** Get the next encoded packet, [None] if the encoder needs
+    * a new frame or has reached the end of the stream. *)
+  val pull_packet : t -> packet option
+
+  (** {2 Pipelined encoding}
+    *
+    * A pipeline runs the encoder in its own native thread. Frames are
+    * queued and handed to the encoder as soon as it can take them
+    * while encoded packets are collected in the background, so that
+    * the application can capture or mux in the meantime. *)
+  module Pipeline :
+  sig
+
+    type encoder = t
+
+    type t
+
+    (** Start encoding with the given encoder. Until the pipeline is
+      * collected, functions encoding with the encoder or changing its
+      * settings raise [Invalid_argument], and so does creating another
+      * pipeline or a parallel encoder with it. [encode_header],
+      * [get_video_format], [get], [get_settings] and [stats] can still
+      * be used. At most [queue_depth] frames are queued while the
+      * encoder is busy. Default [queue_depth] is [2]. *)
+    val create : ?queue_depth:int -> encoder -> t
+
+    type push_result = Queued | Busy
+
+    (** Queue a frame, waiting for some room in the queue if needed.
+      * If [copy] is [false], the planes are not copied, see
+      * [encode_frame_nocopy]. Default [copy] is [true]. *)
+    val push_frame : ?copy:bool -> t -> 'a generic_frame -> unit
+
+    (** Same as [push_frame] but returns [Busy] without queuing the
+      * frame if the queue is full. *)
+    val try_push_frame : ?copy:bool -> t -> 'a generic_frame -> push_result
+
+    (** Signal the end of the stream, once the queued frames have
+      * been encoded. *)
+    val end_of_stream : t -> unit
+
+    (** Get the next encoded packet, [None] if none is available yet.
+      * Encoded packets are kept until they are retrieved. *)
+    val poll_packet : t -> packet option
+
+    (** Get the next encoded packet, waiting for it if needed.
+      * Returns [None] at the end of the stream. *)
+    val wait_packet : t -> packet option
+
+    (** A file descriptor which is readable while encoded packets
+      * are available. It must only be used to wait for packets,
+      * for instance with [Unix.select]. *)
+    val notify_fd : t -> Unix.file_descr
+
+  end
+
   type rate_control = 
     | Constant_noise_threshold
     | Constant_bitrate
@@ -251,6 +445,168 @@ sig
 
   val set_settings : t -> settings -> unit
 
+  (** {2 Individual settings}
+    *
+    * These give access to a single setting, for instance to
+    * change the bitrate while encoding. *)
+
+  (** A setting of type ['a]. *)
+  type 'a setting
+
+  module Setting :
+  sig
+    val rate_control : rate_control setting
+    val bitrate : int setting
+    val max_bitrate : int setting
+    val min_bitrate : int setting
+    val buffer_size : int setting
+    val buffer_level : int setting
+    val noise_threshold : float setting
+    val gop_structure : gop_structure setting
+    val queue_depth : int setting
+    val perceptual_weighting : perceptual_weighting setting
+    val perceptual_distance : float setting
+    val filtering : filtering setting
+    val filter_value : float setting
+    val profile : int setting
+    val level : int setting
+    val au_distance : int setting
+    val enable_psnr : bool setting
+    val enable_ssim : bool setting
+    val ref_distance : int setting
+    val transform_depth : int setting
+    val intra_wavelet : wavelet setting
+    val inter_wavelet : wavelet setting
+    val mv_precision : int setting
+    val motion_block_size : block_size setting
+    val motion_block_overlap : block_overlap setting
+    val interlaced_coding : bool setting
+    val enable_internal_testing : bool setting
+    val enable_noarith : bool setting
+    val enable_md5 : bool setting
+    val enable_fullscan_estimation : bool setting
+    val enable_hierarchical_estimation : bool setting
+    val enable_zero_estimation : bool setting
+    val enable_phasecorr_estimation : bool setting
+    val enable_bigblock_estimation : bool setting
+    val horiz_slices : int setting
+    val vert_slices : int setting
+    val magic_dc_metric_offset : float setting
+    val magic_subband0_lambda_scale : float setting
+    val magic_chroma_lambda_scale : float setting
+    val magic_nonref_lambda_scale : float setting
+    val magic_allocation_scale : float setting
+    val magic_keyframe_weight : float setting
+    val magic_scene_change_threshold : float setting
+    val magic_inter_p_weight : float setting
+    val magic_inter_b_weight : float setting
+    val magic_mc_bailout_limit : float setting
+    val magic_bailout_weight : float setting
+    val magic_error_power : float setting
+    val magic_mc_lambda : float setting
+    val magic_subgroup_length : float setting
+    val magic_lambda : float setting
+  end
+
+  val set : t -> 'a setting -> 'a -> unit
+
+  val get : t -> 'a setting -> 'a
+
+  (** {2 Parallel encoding}
+    *
+    * A stream can be encoded on several cores at once by splitting it
+    * into groups of pictures which are encoded independently, each
+    * one starting with a sync point. The resulting packets are the
+    * same as for a serial encoding where a sync point would be forced
+    * at the beginning of each group. *)
+  module Parallel :
+  sig
+
+    type encoder = t
+
+    type t
+
+    (** Encode using [jobs] threads, each one encoding [gop_size]
+      * frames at a time with the format and settings of [encoder].
+      * Until the parallel encoder is collected, functions encoding
+      * with [encoder] raise [Invalid_argument], and so does creating
+      * a pipeline or another parallel encoder with it. Its settings
+      * can still be changed with [set] and [set_settings]: new
+      * settings apply from the next group. Default [jobs] is the
+      * number of processors and default [gop_size] is the
+      * [au_distance] setting of [encoder]. Up to
+      * [jobs + 1] groups are kept in memory, including the encoded
+      * ones whose packets have not been retrieved yet:
+      * libschroedinger's own threads, whose number can be set with
+      * the [SCHRO_THREADS] environment variable, are created for
+      * each group. *)
+    val create : ?jobs:int -> ?gop_size:int -> encoder -> t
+
+    val encode_header : t -> Ogg.Stream.t -> unit
+
+    (** Queue a frame. Raises [Invalid_argument] when a new group has
+      * to be started while [jobs + 1] groups are kept: the packets of
+      * the oldest one must be retrieved first, for instance with
+      * [wait_packet]. *)
+    val push_frame : t -> 'a generic_frame -> unit
+
+    (** Signal the end of the stream. *)
+    val end_of_stream : t -> unit
+
+    (** Get the next encoded packet, [None] if none is available yet.
+      * Packets are kept until they are retrieved. *)
+    val poll_packet : t -> packet option
+
+    (** Get the next encoded packet, waiting for the groups being
+      * encoded. Returns [None] when more frames are needed or at the
+      * end of the stream. *)
+    val wait_packet : t -> packet option
+
+    (** Queue a frame and put the packets available so far in the
+      * ogg stream. When a new group has to be started while [jobs + 1]
+      * groups are kept, this waits for the oldest one to be encoded
+      * and puts its packets in the stream first. *)
+    val encode_frame : t -> 'a generic_frame -> Ogg.Stream.t -> unit
+
+    (** End the stream, putting all the remaining
+      * packets in the ogg stream. *)
+    val eos : t -> Ogg.Stream.t -> unit
+
+  end
+
+  (** {2 Multiple renditions}
+    *
+    * A ladder encodes the same input with different settings, for
+    * instance at several bitrates. Each frame is converted once and
+    * shared by all the encoders. *)
+  module Ladder :
+  sig
+
+    type encoder = t
+
+    type t
+
+    (** Create one encoder for each pair of settings and
+      * ogg stream, where its packets are put. *)
+    val create : video_format -> (settings * Ogg.Stream.t) list -> t
+
+    (** The encoders, in the order given to [create]. *)
+    val encoders : t -> encoder list
+
+    val encode_header : t -> unit
+
+    (** Encode a frame with every encoder. All the encoders work on
+      * the frame at the same time, and this returns once they have
+      * put their packets in their stream. If [copy] is [false], the
+      * planes are not copied, see [encode_frame_nocopy]. Default
+      * [copy] is [true]. *)
+    val encode_frame : ?copy:bool -> t -> 'a generic_frame -> unit
+
+    (** End the stream of every encoder. *)
+    val eos : t -> unit
+
+  end
+
 end
 
 module Decoder :
@@ -262,32 +618,350 @@ sig
 
   type t
 
-  val create : Ogg.Stream.packet -> Ogg.Stream.packet -> t
+  (** Create a decoder from the first two packets of a stream. Raises
+    * [Invalid_header] if the first one is not a sequence header.
+    * If [s16] is [true], frames are decoded with 16 bits samples
+    * and must be obtained using [decode_frame16] or [decode_frame_into];
+    * the other decoding functions raise [Invalid_argument]. Default
+    * [s16] is [false]. *)
+  val create : ?s16:bool -> Ogg.Stream.packet -> Ogg.Stream.packet -> t
 
+  (** Free the decoder now instead of when it is collected. Decoded
+    * frames remain valid. Functions using the decoder afterwards
+    * raise [Closed]. *)
+  val close : t -> unit
+
+  (** Check whether a packet starts with a sequence header. *)
   val check : Ogg.Stream.packet -> bool
 
+  (** Parse the sequence header at the beginning of a packet,
+    * without creating a decoder. Raises [Invalid_header] if the
+    * packet does not start with a valid sequence header. *)
+  val probe : Ogg.Stream.packet -> video_format
+
+  (** Same as [probe] for raw Dirac data. The sequence header
+    * must start at [offset]. *)
+  val probe_data : ?offset:int -> ?length:int -> data -> video_format
+
   val get_video_format : t -> video_format
 
   val get_picture_number : t -> int
 
+  (** Drop the decoder's state and queued data, for instance after
+    * seeking. Decoding restarts at the next sequence header. *)
+  val reset : t -> unit
+
+  (** Decode a frame. The planes of the returned frame point to
+    * memory owned by the decoder, which reuses it for a later
+    * frame once the planes and the bigarrays taken from them have
+    * been garbage collected, or the frame has been released using
+    * [release_frame]. The decoder keeps up to 16 such frames, more
+    * frames are allocated when OCaml holds on to all of them. *)
   val decode_frame : t -> Ogg.Stream.t -> frame
 
+  (** Same as [decode_frame] for decoders created with [s16]. *)
+  val decode_frame16 : t -> Ogg.Stream.t -> frame16
+
+  (** Result of a decoding step. *)
+  type 'a generic_result =
+    | Frame of 'a generic_frame (** A new frame. *)
+    | Repeat                    (** The picture was skipped: the
+                                  * previous frame should be
+                                  * displayed again. *)
+    | Need_data                 (** More input is needed. *)
+    | Eos                       (** The end of the stream
+                                  * was reached. *)
+
+  type result = Bigarray.int8_unsigned_elt generic_result
+
+  type result16 = Bigarray.int16_signed_elt generic_result
+
+  (** Same as [decode_frame] but never raises on skipped pictures,
+    * missing input or end of stream. The end of the stream is
+    * reached once all the packets of an ended ogg stream have been
+    * decoded. *)
+  val decode : t -> Ogg.Stream.t -> result
+
+  (** Give a frame returned by [decode_frame] back to the decoder
+    * without waiting for its planes to be collected. Its planes
+    * become empty. The frame is only given back at once when no
+    * bigarray was taken from its planes, otherwise this happens
+    * when they are collected. *)
+  val release_frame : t -> 'a generic_frame -> unit
+
+  (** Decode a frame into the planes of the given frame, which must
+    * have the stream's format and dimensions. The decoder writes the
+    * picture directly into these planes when they were allocated by
+    * this module, no bigarray was taken from them and the decoder has
+    * no other output picture queued. Otherwise the picture is copied
+    * into them. When pictures are reordered, the decoder may still
+    * hold the memory it was given once this function returns or
+    * raises: the frame's planes then get new memory, so that they
+    * are never written after the call. The frame may also have a
+    * packed format, the picture is then converted. *)
+  val decode_frame_into : t -> Ogg.Stream.t -> 'a generic_frame -> unit
+
+  (** {2 Raw input}
+    *
+    * These functions feed the decoder directly with Dirac data,
+    * for instance from a memory-mapped file or a network buffer,
+    * without going through an ogg stream. *)
+
+  (** Create a decoder to be fed with [push_data]. See [create]
+    * for [s16]. *)
+  val create_raw : ?s16:bool -> unit -> t
+
+  (** Give Dirac data to the decoder. Data do not need to be
+    * aligned on parse units. The decoder reads the given slice of
+    * [data] directly: it is kept alive until the decoder is done
+    * with it and must not be modified in the meantime. Default
+    * [length] is the rest of [data] after [offset]. *)
+  val push_data : t -> ?offset:int -> ?length:int -> data -> unit
+
+  (** Signal the end of the input data. *)
+  val push_eos : t -> unit
+
+  (** Decode a frame from the data given so far. Raises
+    * [Ogg.Not_enough_data] if more data is needed. The returned
+    * frame is the same as for [decode_frame]. *)
+  val pull_frame : t -> frame
+
+  (** Same as [pull_frame] but returns a [result]. [Eos] is
+    * returned once the data pushed before [push_eos] has been
+    * decoded. *)
+  val pull : t -> result
+
+  (** {2 Background decoding}
+    *
+    * An asynchronous decoder runs in its own native thread and
+    * decodes ahead of the application, up to [depth] frames. Decoded
+    * frames are then retrieved without waiting for costly pictures
+    * to be decoded, which keeps frame delivery regular. *)
+  module Async :
+  sig
+
+    type t
+
+    (** Create an asynchronous decoder and start its thread. The
+      * decoder stops once it has decoded up to [depth] frames which
+      * have not been pulled yet. Default [depth] is [4]. See
+      * [Decoder.create] for [s16]. *)
+    val create : ?depth:int -> ?s16:bool -> unit -> t
+
+    (** Same as [Decoder.push_data]. This function does not wait for
+      * the data to be decoded. *)
+    val push_data : t -> ?offset:int -> ?length:int -> data -> unit
+
+    (** Give an ogg packet to the decoder. Header packets must be
+      * given too. *)
+    val push_packet : t -> Ogg.Stream.packet -> unit
+
+    (** Signal the end of the input. *)
+    val push_eos : t -> unit
+
+    (** Stream's format, known once the first picture is about
+      * to be decoded. *)
+    val get_video_format : t -> video_format option
+
+    (** Get the next decoding result, waiting for it if needed.
+      * Returns [Need_data] if the decoder has used all the input
+      * given so far. [Eos] is returned once the input has been
+      * decoded after [push_eos]. Frames are the same as for
+      * [Decoder.decode_frame]. Raises [Error] if decoding failed. *)
+    val pull : t -> result
+
+    (** Same as [pull] but returns [None] instead of waiting
+      * when no result is available. *)
+    val try_pull : t -> result option
+
+    (** Same as [pull] for decoders created with [s16]. *)
+    val pull16 : t -> result16
+
+    (** Same as [try_pull] for decoders created with [s16]. *)
+    val try_pull16 : t -> result16 option
+
+    (** Stop the decoding thread and drop pending input and frames.
+      * The decoder cannot be used afterward. It is also stopped when
+      * garbage collected. *)
+    val stop : t -> unit
+
+  end
+
+  (** Input from an Ogg file mapped in memory. Pages are located in
+    * place and packets are given to the decoder as slices of the
+    * mapping, without copy, except for the packets spanning several
+    * pages. Page checksums are not verified. *)
+  module Mmap :
+  sig
+
+    type decoder = t
+
+    type t
+
+    (** Map a file. Default value for [serial] is the first Dirac
+      * stream's serial number. *)
+    val openfile : ?serial:Nativeint.t -> string -> t
+
+    (** Same as [openfile] for a file descriptor, which
+      * can be closed afterwards. *)
+    val of_fd : ?serial:Nativeint.t -> Unix.file_descr -> t
+
+    (** Serial number of the stream read. Raises [Not_found] if no
+      * Dirac stream has been found yet. *)
+    val serial : t -> Nativeint.t
+
+    (** Go to the page at the given offset, for instance
+      * a sync point found using [Seek]. *)
+    val seek : t -> Int64.t -> unit
+
+    (** Push the next packet of the stream to a decoder created with
+      * [create_raw]. Returns [false] at the end of the file. *)
+    val push_packet : t -> decoder -> bool
+
+    (** Same as [pull], pushing packets read from the file when more
+      * input is needed and the end of the stream at the end of the
+      * file. Returns [Eos] once the decoder needs data after the end
+      * of the stream, until it is [reset]. *)
+    val decode : t -> decoder -> result
+
+  end
+
+end
+
+(** Random access in Ogg files.
+  *
+  * Decoding can start at sync points, where a sequence header is
+  * followed by an intra picture. They are found by reading Ogg pages
+  * directly from a file descriptor, either once for the whole file
+  * to build an index, or by bisecting the file. Pictures are numbered
+  * as in [Decoder.get_picture_number], which is the frame number for
+  * progressive content. *)
+module Seek :
+sig
+  type sync_point = {
+    offset : Int64.t; (** Offset of the Ogg page where the sequence header starts. *)
+    picture : int (** Number of the following picture. *)
+  }
+
+  (** Sync points of a stream, in file order. *)
+  type index
+
+  (** Serial number of the indexed stream. *)
+  val serial : index -> Nativeint.t
+
+  val sync_points : index -> sync_point array
+
+  (** Build the index of a Dirac stream by reading the whole file.
+    * Default value for [serial] is the first Dirac stream's serial
+    * number. Raises [Not_found] if there is no Dirac stream. *)
+  val scan : ?serial:Nativeint.t -> Unix.file_descr -> index
+
+  (** Write the index in a text format. *)
+  val save : index -> out_channel -> unit
+
+  (** Read an index written by [save]. *)
+  val load : in_channel -> index
+
+  (** Last sync point whose picture is at most the given one. Raises
+    * [Not_found] if there is none. *)
+  val find : index -> int -> sync_point
+
+  (** Same as [find], bisecting the file instead of using an index.
+    * [interlaced] must be set for streams using interlaced coding.
+    * Pictures are compared in presentation order, using the granule
+    * positions of the pages, as for [find]. *)
+  val bisect : ?serial:Nativeint.t -> ?interlaced:bool -> Unix.file_descr -> int -> sync_point
+
+  (** Index built while writing a stream, fed with its pages. *)
+  module Indexer :
+  sig
+    type t
+
+    (** Create an indexer for the stream with the given serial number. *)
+    val create : Nativeint.t -> t
+
+    (** [add_page t offset page] adds a page written at [offset].
+      * Pages of other streams are ignored. *)
+    val add_page : t -> Int64.t -> Ogg.Page.t -> unit
+
+    (** Index of the pages added so far. *)
+    val index : t -> index
+  end
+
+  (** [seek_to_frame dec sync fd n] positions [fd] at the sync point
+    * preceding picture [n], found using [index] if given or by
+    * bisecting the file otherwise, and resets [dec] and [sync], which
+    * must read from [fd]. Decoding then goes on with the returned
+    * ogg stream, fed with the pages of [sync], and pictures before
+    * [n] are to be dropped. *)
+  val seek_to_frame : ?index:index -> ?interlaced:bool ->
+                      Decoder.t -> Ogg.Sync.t -> Unix.file_descr -> int ->
+                      sync_point * Ogg.Stream.t
 end
 
 module Skeleton :
 sig
 
-  (** Generate a vorbis fisbone packet with
+  (** Generate a Skeleton 4.0 fishead packet, which starts the
+    * skeleton stream and must be alone on its page, as any first
+    * packet of a stream. Times are (numerator, denominator) pairs,
+    * default is zero for both. [segment_length] and [content_offset],
+    * the offset of the first page which is not a header, are
+    * usually only known once the file has been written: they default
+    * to zero and the packet can then be replaced with [patch_index],
+    * as its size does not change.
+    *
+    * See: http://wiki.xiph.org/SkeletonHeaders. *)
+  val fishead :
+    ?presentation_time:(Int64.t * Int64.t) ->
+    ?base_time:(Int64.t * Int64.t) ->
+    ?segment_length:Int64.t -> ?content_offset:Int64.t ->
+    unit -> Ogg.Stream.packet
+
+  (** Generate a Skeleton 4.0 fisbone packet with
     * these parameters, to use in an ogg skeleton.
     * Default value for [start_granule] is [Int64.zero],
-    * Default value for [headers] is ["Content-type","video/dirac"]
+    * Default value for [headers] is ["Content-Type","video/dirac"],
+    * ["Role","video/main"] and a ["Name"] made of [serialno].
     *
-    * See: http://xiph.org/ogg/doc/skeleton.html. *)
+    * See: http://wiki.xiph.org/SkeletonHeaders. *)
   val fisbone :
     ?start_granule:Int64.t ->
     ?headers:(string * string) list ->
     serialno:Nativeint.t -> format:video_format -> 
     unit -> Ogg.Stream.packet
 
+  (** Generate a Skeleton 4 index packet from the sync points of
+    * an index, with timestamps computed from the frame rate of
+    * [format]. The last sample time is the one of [end_picture],
+    * by default the last sync point's picture.
+    *
+    * An index can be written before the data it points to: the
+    * packet is padded with zeros when shorter than [size] bytes, so
+    * that it can be replaced using [patch_index] once all the pages
+    * are written. It must then be alone on its page, see
+    * [index_pages]. A keypoint takes at most 20 bytes after a 42
+    * bytes header. Raises [Invalid_argument] if the packet would not
+    * fit in a single page, that is 65024 bytes.
+    *
+    * See: http://wiki.xiph.org/Ogg_Index. *)
+  val index :
+    ?size:int -> ?end_picture:int ->
+    format:video_format -> Seek.index -> Ogg.Stream.packet
+
+  (** Read a Skeleton 4 index packet, for use with [Seek.find]. *)
+  val parse_index : format:video_format -> Ogg.Stream.packet -> Seek.index
+
+  (** [index_pages os packet] flushes the pages of [os], puts the
+    * index [packet] and flushes it on its own page, so that it can be
+    * patched. Returns the pages flushed before and the index page. *)
+  val index_pages : Ogg.Stream.t -> Ogg.Stream.packet -> Ogg.Page.t list * Ogg.Page.t
+
+  (** [patch_index fd offset packet] replaces the index packet of the
+    * page written at [offset] with [packet], which must have the same
+    * size, and updates the page's checksum. Any packet alone on its
+    * page, such as a fishead packet, can be replaced this way. *)
+  val patch_index : Unix.file_descr -> Int64.t -> Ogg.Stream.packet -> unit
+
 end
 
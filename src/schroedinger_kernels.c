@@ -0,0 +1,635 @@
+/*
+  Copyright 2003-2011 Savonet team
+
+  This file is part of Ocaml-schroedinger.
+
+  Ocaml-schroedinger is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  Ocaml-schroedinger is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Ocaml-schroedinger; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "schroedinger_kernels.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+/* Scaling is done in two passes for each output line: source lines
+ * are first combined vertically into a line of the source width,
+ * which is then resampled horizontally. The vertical pass works on
+ * contiguous data and is the one with SIMD versions. */
+
+/* dst = a * (256 - fy) + b * fy, with 0 <= fy <= 256. */
+typedef void (*blend_rows_fn)(const uint8_t *a, const uint8_t *b, uint16_t *dst, int n, int fy);
+
+/* acc += src. */
+typedef void (*add_row_fn)(const uint8_t *src, uint32_t *acc, int n);
+
+static void blend_rows_c(const uint8_t *a, const uint8_t *b, uint16_t *dst, int n, int fy)
+{
+  int i;
+
+  for (i=0; i<n; i++)
+    dst[i] = a[i] * (256 - fy) + b[i] * fy;
+}
+
+static void add_row_c(const uint8_t *src, uint32_t *acc, int n)
+{
+  int i;
+
+  for (i=0; i<n; i++)
+    acc[i] += src[i];
+}
+
+/* Packed rows are converted from and to one row of each plane, the
+ * chroma rows having the subsampling of the packed format. */
+typedef void (*unpack_fn)(const uint8_t *src, uint8_t *y, uint8_t *u, uint8_t *v, int width);
+typedef void (*pack_fn)(const uint8_t *y, const uint8_t *u, const uint8_t *v, uint8_t *dst, int width);
+
+/* Offsets of the samples of a pixel pair in 4:2:2 packed formats. */
+#define YUYV_OFFSETS 0, 2, 1, 3
+#define UYVY_OFFSETS 1, 3, 0, 2
+
+static inline void unpack_422_c(const uint8_t *src, uint8_t *y, uint8_t *u, uint8_t *v, int width,
+                                int y0, int y1, int uo, int vo)
+{
+  int i;
+
+  for (i=0; i<width; i+=2, src+=4) {
+    y[i] = src[y0];
+    if (i + 1 < width)
+      y[i + 1] = src[y1];
+    u[i / 2] = src[uo];
+    v[i / 2] = src[vo];
+  }
+}
+
+static inline void pack_422_c(const uint8_t *y, const uint8_t *u, const uint8_t *v, uint8_t *dst, int width,
+                              int y0, int y1, int uo, int vo)
+{
+  int i;
+
+  for (i=0; i<width; i+=2, dst+=4) {
+    dst[y0] = y[i];
+    dst[y1] = i + 1 < width ? y[i + 1] : y[i];
+    dst[uo] = u[i / 2];
+    dst[vo] = v[i / 2];
+  }
+}
+
+static void unpack_yuyv_c(const uint8_t *src, uint8_t *y, uint8_t *u, uint8_t *v, int width)
+{
+  unpack_422_c(src, y, u, v, width, YUYV_OFFSETS);
+}
+
+static void unpack_uyvy_c(const uint8_t *src, uint8_t *y, uint8_t *u, uint8_t *v, int width)
+{
+  unpack_422_c(src, y, u, v, width, UYVY_OFFSETS);
+}
+
+static void pack_yuyv_c(const uint8_t *y, const uint8_t *u, const uint8_t *v, uint8_t *dst, int width)
+{
+  pack_422_c(y, u, v, dst, width, YUYV_OFFSETS);
+}
+
+static void pack_uyvy_c(const uint8_t *y, const uint8_t *u, const uint8_t *v, uint8_t *dst, int width)
+{
+  pack_422_c(y, u, v, dst, width, UYVY_OFFSETS);
+}
+
+static inline uint32_t read32le(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void write32le(uint8_t *p, uint32_t x)
+{
+  p[0] = x;
+  p[1] = x >> 8;
+  p[2] = x >> 16;
+  p[3] = x >> 24;
+}
+
+/* v210 stores 6 pixels of 10 bit 4:2:2 in four 32 bit words, as
+ * Cb0 Y0 Cr0, Y1 Cb1 Y2, Cr1 Y3 Cb2, Y4 Cr2 Y5. Samples are
+ * converted to and from 8 bits by dropping or adding 2 bits. */
+static const int v210_y[6] = {1, 3, 5, 7, 9, 11};
+static const int v210_u[3] = {0, 4, 8};
+static const int v210_v[3] = {2, 6, 10};
+
+static void unpack_v210_c(const uint8_t *src, uint8_t *y, uint8_t *u, uint8_t *v, int width)
+{
+  uint8_t s[12];
+  uint32_t w;
+  int i, j, k, n;
+
+  for (i=0; i<width; i+=6, src+=16) {
+    for (j=0; j<4; j++) {
+      w = read32le(src + 4 * j);
+      for (k=0; k<3; k++)
+        s[3 * j + k] = (w >> (10 * k + 2)) & 0xff;
+    }
+    n = width - i < 6 ? width - i : 6;
+    for (j=0; j<n; j++)
+      y[i + j] = s[v210_y[j]];
+    for (j=0; 2*j<n; j++) {
+      u[i / 2 + j] = s[v210_u[j]];
+      v[i / 2 + j] = s[v210_v[j]];
+    }
+  }
+}
+
+static void pack_v210_c(const uint8_t *y, const uint8_t *u, const uint8_t *v, uint8_t *dst, int width)
+{
+  uint32_t s[12];
+  int i, j, n;
+
+  for (i=0; i<width; i+=6, dst+=16) {
+    n = width - i < 6 ? width - i : 6;
+    /* Missing pixels of the last group repeat the last one. */
+    for (j=0; j<6; j++)
+      s[v210_y[j]] = y[i + (j < n ? j : n - 1)] << 2;
+    for (j=0; j<3; j++) {
+      s[v210_u[j]] = u[i / 2 + (2 * j < n ? j : (n - 1) / 2)] << 2;
+      s[v210_v[j]] = v[i / 2 + (2 * j < n ? j : (n - 1) / 2)] << 2;
+    }
+    for (j=0; j<4; j++)
+      write32le(dst + 4 * j, s[3 * j] | (s[3 * j + 1] << 10) | (s[3 * j + 2] << 20));
+  }
+}
+
+/* RGB is converted with the ITU-R BT.601 matrix, to and from video
+ * range YCbCr. The SIMD versions give the very same results. */
+static void unpack_rgba_c(const uint8_t *src, uint8_t *y, uint8_t *u, uint8_t *v, int width)
+{
+  int r, g, b;
+  int i;
+
+  for (i=0; i<width; i++, src+=4) {
+    r = src[0];
+    g = src[1];
+    b = src[2];
+    y[i] = (66 * r + 129 * g + 25 * b + 4224) >> 8;
+    u[i] = (-38 * r - 74 * g + 112 * b + 32896) >> 8;
+    v[i] = (112 * r - 94 * g - 18 * b + 32896) >> 8;
+  }
+}
+
+static inline uint8_t clip_u8(int x)
+{
+  return x < 0 ? 0 : (x > 255 ? 255 : x);
+}
+
+static void pack_rgba_c(const uint8_t *y, const uint8_t *u, const uint8_t *v, uint8_t *dst, int width)
+{
+  int c, d, e;
+  int i;
+
+  for (i=0; i<width; i++, dst+=4) {
+    c = y[i] - 16;
+    d = u[i] - 128;
+    e = v[i] - 128;
+    dst[0] = clip_u8((298 * c + 409 * e + 128) >> 8);
+    dst[1] = clip_u8((298 * c - 100 * d - 208 * e + 128) >> 8);
+    dst[2] = clip_u8((298 * c + 516 * d + 128) >> 8);
+    dst[3] = 0xff;
+  }
+}
+
+#ifdef HAVE_X86_KERNELS
+
+__attribute__((target("sse2")))
+static void blend_rows_sse2(const uint8_t *a, const uint8_t *b, uint16_t *dst, int n, int fy)
+{
+  __m128i wa = _mm_set1_epi16(256 - fy);
+  __m128i wb = _mm_set1_epi16(fy);
+  __m128i z = _mm_setzero_si128();
+  __m128i va, vb;
+  int i;
+
+  for (i=0; i+16<=n; i+=16) {
+    va = _mm_loadu_si128((const __m128i *)(a + i));
+    vb = _mm_loadu_si128((const __m128i *)(b + i));
+    _mm_storeu_si128((__m128i *)(dst + i),
+                     _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(va, z), wa),
+                                   _mm_mullo_epi16(_mm_unpacklo_epi8(vb, z), wb)));
+    _mm_storeu_si128((__m128i *)(dst + i + 8),
+                     _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(va, z), wa),
+                                   _mm_mullo_epi16(_mm_unpackhi_epi8(vb, z), wb)));
+  }
+  blend_rows_c(a + i, b + i, dst + i, n - i, fy);
+}
+
+__attribute__((target("sse2")))
+static void add_row_sse2(const uint8_t *src, uint32_t *acc, int n)
+{
+  __m128i z = _mm_setzero_si128();
+  __m128i v, lo, hi;
+  __m128i *p;
+  int i;
+
+  for (i=0; i+16<=n; i+=16) {
+    v = _mm_loadu_si128((const __m128i *)(src + i));
+    lo = _mm_unpacklo_epi8(v, z);
+    hi = _mm_unpackhi_epi8(v, z);
+    p = (__m128i *)(acc + i);
+    _mm_storeu_si128(p, _mm_add_epi32(_mm_loadu_si128(p), _mm_unpacklo_epi16(lo, z)));
+    _mm_storeu_si128(p + 1, _mm_add_epi32(_mm_loadu_si128(p + 1), _mm_unpackhi_epi16(lo, z)));
+    _mm_storeu_si128(p + 2, _mm_add_epi32(_mm_loadu_si128(p + 2), _mm_unpacklo_epi16(hi, z)));
+    _mm_storeu_si128(p + 3, _mm_add_epi32(_mm_loadu_si128(p + 3), _mm_unpackhi_epi16(hi, z)));
+  }
+  add_row_c(src + i, acc + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void blend_rows_avx2(const uint8_t *a, const uint8_t *b, uint16_t *dst, int n, int fy)
+{
+  __m256i wa = _mm256_set1_epi16(256 - fy);
+  __m256i wb = _mm256_set1_epi16(fy);
+  __m256i va, vb;
+  int i;
+
+  for (i=0; i+16<=n; i+=16) {
+    va = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(a + i)));
+    vb = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(b + i)));
+    _mm256_storeu_si256((__m256i *)(dst + i),
+                        _mm256_add_epi16(_mm256_mullo_epi16(va, wa),
+                                         _mm256_mullo_epi16(vb, wb)));
+  }
+  blend_rows_c(a + i, b + i, dst + i, n - i, fy);
+}
+
+__attribute__((target("avx2")))
+static void add_row_avx2(const uint8_t *src, uint32_t *acc, int n)
+{
+  __m256i *p;
+  int i;
+
+  for (i=0; i+16<=n; i+=16) {
+    p = (__m256i *)(acc + i);
+    _mm256_storeu_si256(p, _mm256_add_epi32(_mm256_loadu_si256(p),
+                        _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(src + i)))));
+    _mm256_storeu_si256(p + 1, _mm256_add_epi32(_mm256_loadu_si256(p + 1),
+                        _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(src + i + 8)))));
+  }
+  add_row_c(src + i, acc + i, n - i);
+}
+
+/* 16 pixels at a time. */
+__attribute__((target("sse2")))
+static inline void unpack_422_sse2(const uint8_t *src, uint8_t *y, uint8_t *u, uint8_t *v, int width,
+                                   int luma_high)
+{
+  __m128i mask = _mm_set1_epi16(0xff);
+  __m128i z = _mm_setzero_si128();
+  __m128i a, b, c;
+  int i;
+
+  for (i=0; i+16<=width; i+=16) {
+    a = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+    b = _mm_loadu_si128((const __m128i *)(src + 2 * i + 16));
+    if (luma_high) {
+      _mm_storeu_si128((__m128i *)(y + i),
+                       _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8)));
+      c = _mm_packus_epi16(_mm_and_si128(a, mask), _mm_and_si128(b, mask));
+    } else {
+      _mm_storeu_si128((__m128i *)(y + i),
+                       _mm_packus_epi16(_mm_and_si128(a, mask), _mm_and_si128(b, mask)));
+      c = _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+    }
+    _mm_storel_epi64((__m128i *)(u + i / 2), _mm_packus_epi16(_mm_and_si128(c, mask), z));
+    _mm_storel_epi64((__m128i *)(v + i / 2), _mm_packus_epi16(_mm_srli_epi16(c, 8), z));
+  }
+  if (luma_high)
+    unpack_uyvy_c(src + 2 * i, y + i, u + i / 2, v + i / 2, width - i);
+  else
+    unpack_yuyv_c(src + 2 * i, y + i, u + i / 2, v + i / 2, width - i);
+}
+
+__attribute__((target("sse2")))
+static void unpack_yuyv_sse2(const uint8_t *src, uint8_t *y, uint8_t *u, uint8_t *v, int width)
+{
+  unpack_422_sse2(src, y, u, v, width, 0);
+}
+
+__attribute__((target("sse2")))
+static void unpack_uyvy_sse2(const uint8_t *src, uint8_t *y, uint8_t *u, uint8_t *v, int width)
+{
+  unpack_422_sse2(src, y, u, v, width, 1);
+}
+
+__attribute__((target("sse2")))
+static inline void pack_422_sse2(const uint8_t *y, const uint8_t *u, const uint8_t *v, uint8_t *dst, int width,
+                                 int luma_high)
+{
+  __m128i l, c;
+  int i;
+
+  for (i=0; i+16<=width; i+=16) {
+    l = _mm_loadu_si128((const __m128i *)(y + i));
+    c = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(u + i / 2)),
+                          _mm_loadl_epi64((const __m128i *)(v + i / 2)));
+    if (luma_high) {
+      _mm_storeu_si128((__m128i *)(dst + 2 * i), _mm_unpacklo_epi8(c, l));
+      _mm_storeu_si128((__m128i *)(dst + 2 * i + 16), _mm_unpackhi_epi8(c, l));
+    } else {
+      _mm_storeu_si128((__m128i *)(dst + 2 * i), _mm_unpacklo_epi8(l, c));
+      _mm_storeu_si128((__m128i *)(dst + 2 * i + 16), _mm_unpackhi_epi8(l, c));
+    }
+  }
+  if (luma_high)
+    pack_uyvy_c(y + i, u + i / 2, v + i / 2, dst + 2 * i, width - i);
+  else
+    pack_yuyv_c(y + i, u + i / 2, v + i / 2, dst + 2 * i, width - i);
+}
+
+__attribute__((target("sse2")))
+static void pack_yuyv_sse2(const uint8_t *y, const uint8_t *u, const uint8_t *v, uint8_t *dst, int width)
+{
+  pack_422_sse2(y, u, v, dst, width, 0);
+}
+
+__attribute__((target("sse2")))
+static void pack_uyvy_sse2(const uint8_t *y, const uint8_t *u, const uint8_t *v, uint8_t *dst, int width)
+{
+  pack_422_sse2(y, u, v, dst, width, 1);
+}
+
+/* 8 pixels at a time, with 16 bit arithmetic wrapping around
+ * where the final result is known to fit. */
+__attribute__((target("sse2")))
+static void unpack_rgba_sse2(const uint8_t *src, uint8_t *y, uint8_t *u, uint8_t *v, int width)
+{
+  __m128i mask = _mm_set1_epi32(0xff);
+  __m128i z = _mm_setzero_si128();
+  __m128i a, b, r, g, bl;
+  int i;
+
+#define MUL(x, k) _mm_mullo_epi16(x, _mm_set1_epi16(k))
+  for (i=0; i+8<=width; i+=8) {
+    a = _mm_loadu_si128((const __m128i *)(src + 4 * i));
+    b = _mm_loadu_si128((const __m128i *)(src + 4 * i + 16));
+    r = _mm_packs_epi32(_mm_and_si128(a, mask), _mm_and_si128(b, mask));
+    g = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(a, 8), mask),
+                        _mm_and_si128(_mm_srli_epi32(b, 8), mask));
+    bl = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(a, 16), mask),
+                         _mm_and_si128(_mm_srli_epi32(b, 16), mask));
+    _mm_storel_epi64((__m128i *)(y + i), _mm_packus_epi16(_mm_srli_epi16(
+      _mm_add_epi16(_mm_add_epi16(MUL(r, 66), MUL(g, 129)),
+                    _mm_add_epi16(MUL(bl, 25), _mm_set1_epi16(4224))), 8), z));
+    _mm_storel_epi64((__m128i *)(u + i), _mm_packus_epi16(_mm_srli_epi16(
+      _mm_add_epi16(_mm_add_epi16(MUL(r, -38), MUL(g, -74)),
+                    _mm_add_epi16(MUL(bl, 112), _mm_set1_epi16(32896))), 8), z));
+    _mm_storel_epi64((__m128i *)(v + i), _mm_packus_epi16(_mm_srli_epi16(
+      _mm_add_epi16(_mm_add_epi16(MUL(r, 112), MUL(g, -94)),
+                    _mm_add_epi16(MUL(bl, -18), _mm_set1_epi16(32896))), 8), z));
+  }
+#undef MUL
+  unpack_rgba_c(src + 4 * i, y + i, u + i, v + i, width - i);
+}
+
+__attribute__((target("sse2")))
+static void pack_rgba_sse2(const uint8_t *y, const uint8_t *u, const uint8_t *v, uint8_t *dst, int width)
+{
+  __m128i z = _mm_setzero_si128();
+  __m128i round = _mm_set1_epi32(128);
+  __m128i c, d, e, r, g, b, rg, ba;
+  int i;
+
+  /* x1 * k1 + x2 * k2 on 32 bits, for 4 of the 8 pixels. */
+#define MADD(x1, k1, x2, k2, half) \
+  _mm_madd_epi16(_mm_unpack##half##_epi16(x1, x2), \
+                 _mm_set_epi16(k2, k1, k2, k1, k2, k1, k2, k1))
+#define SHIFT(x) _mm_srai_epi32(_mm_add_epi32(x, round), 8)
+  for (i=0; i+8<=width; i+=8) {
+    c = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(y + i)), z), _mm_set1_epi16(16));
+    d = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(u + i)), z), _mm_set1_epi16(128));
+    e = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(v + i)), z), _mm_set1_epi16(128));
+    r = _mm_packs_epi32(SHIFT(MADD(c, 298, e, 409, lo)),
+                        SHIFT(MADD(c, 298, e, 409, hi)));
+    g = _mm_packs_epi32(SHIFT(_mm_add_epi32(MADD(c, 298, d, -100, lo), MADD(e, -208, z, 0, lo))),
+                        SHIFT(_mm_add_epi32(MADD(c, 298, d, -100, hi), MADD(e, -208, z, 0, hi))));
+    b = _mm_packs_epi32(SHIFT(MADD(c, 298, d, 516, lo)),
+                        SHIFT(MADD(c, 298, d, 516, hi)));
+    rg = _mm_unpacklo_epi8(_mm_packus_epi16(r, z), _mm_packus_epi16(g, z));
+    ba = _mm_unpacklo_epi8(_mm_packus_epi16(b, z), _mm_set1_epi8((char)0xff));
+    _mm_storeu_si128((__m128i *)(dst + 4 * i), _mm_unpacklo_epi16(rg, ba));
+    _mm_storeu_si128((__m128i *)(dst + 4 * i + 16), _mm_unpackhi_epi16(rg, ba));
+  }
+#undef MADD
+#undef SHIFT
+  pack_rgba_c(y + i, u + i, v + i, dst + 4 * i, width - i);
+}
+
+#endif
+
+static blend_rows_fn blend_rows = blend_rows_c;
+static add_row_fn add_row = add_row_c;
+
+/* Indexed by the PACKED_ values. */
+static unpack_fn unpack_row[] = {unpack_yuyv_c, unpack_uyvy_c, unpack_v210_c, unpack_rgba_c};
+static pack_fn pack_row[] = {pack_yuyv_c, pack_uyvy_c, pack_v210_c, pack_rgba_c};
+
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+static void kernels_init(void)
+{
+#ifdef HAVE_X86_KERNELS
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2")) {
+    blend_rows = blend_rows_sse2;
+    add_row = add_row_sse2;
+    unpack_row[PACKED_YUYV] = unpack_yuyv_sse2;
+    unpack_row[PACKED_UYVY] = unpack_uyvy_sse2;
+    unpack_row[PACKED_RGBA] = unpack_rgba_sse2;
+    pack_row[PACKED_YUYV] = pack_yuyv_sse2;
+    pack_row[PACKED_UYVY] = pack_uyvy_sse2;
+    pack_row[PACKED_RGBA] = pack_rgba_sse2;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    blend_rows = blend_rows_avx2;
+    add_row = add_row_avx2;
+  }
+#endif
+}
+
+/* Position in the source, in 1/65536th of a pixel, of the centre
+ * of the i-th destination pixel. */
+static inline int64_t centre_pos(int i, int src_len, int dst_len)
+{
+  int64_t pos = (((int64_t)(2 * i + 1) * src_len << 16) / dst_len - 65536) / 2;
+
+  if (pos < 0)
+    return 0;
+  if (pos > (int64_t)(src_len - 1) << 16)
+    return (int64_t)(src_len - 1) << 16;
+  return pos;
+}
+
+static int scale_bilinear(const uint8_t *src, int src_stride, int sw, int sh,
+                          uint8_t *dst, int dst_stride, int dw, int dh)
+{
+  uint16_t *line;
+  int *xofs;
+  int *xfrac;
+  const uint8_t *a;
+  const uint8_t *b;
+  uint8_t *out;
+  int64_t pos;
+  int x, y, x0, y0, fx, fy;
+
+  line = malloc(sizeof(uint16_t) * (sw + 1));
+  xofs = malloc(sizeof(int) * dw);
+  xfrac = malloc(sizeof(int) * dw);
+  if (line == NULL || xofs == NULL || xfrac == NULL) {
+    free(line);
+    free(xofs);
+    free(xfrac);
+    return -1;
+  }
+
+  for (x=0; x<dw; x++) {
+    pos = centre_pos(x, sw, dw);
+    xofs[x] = pos >> 16;
+    xfrac[x] = (pos >> 8) & 0xff;
+  }
+
+  for (y=0; y<dh; y++) {
+    pos = centre_pos(y, sh, dh);
+    y0 = pos >> 16;
+    fy = (pos >> 8) & 0xff;
+    a = src + (int64_t)y0 * src_stride;
+    b = y0 + 1 < sh ? a + src_stride : a;
+    blend_rows(a, b, line, sw, fy);
+    /* Sample past the right edge gets a null weight. */
+    line[sw] = line[sw - 1];
+
+    out = dst + (int64_t)y * dst_stride;
+    for (x=0; x<dw; x++) {
+      x0 = xofs[x];
+      fx = xfrac[x];
+      out[x] = ((uint32_t)line[x0] * (256 - fx) + (uint32_t)line[x0 + 1] * fx + 32768) >> 16;
+    }
+  }
+
+  free(line);
+  free(xofs);
+  free(xfrac);
+
+  return 0;
+}
+
+/* Each destination pixel is the average of the source pixels it
+ * covers, which amounts to nearest neighbour when upscaling. */
+static int scale_box(const uint8_t *src, int src_stride, int sw, int sh,
+                     uint8_t *dst, int dst_stride, int dw, int dh)
+{
+  uint32_t *acc;
+  int *xofs;
+  uint8_t *out;
+  uint64_t sum;
+  uint64_t count;
+  int x, y, i, x1, y0, y1;
+
+  acc = malloc(sizeof(uint32_t) * sw);
+  xofs = malloc(sizeof(int) * (dw + 1));
+  if (acc == NULL || xofs == NULL) {
+    free(acc);
+    free(xofs);
+    return -1;
+  }
+
+  for (x=0; x<=dw; x++)
+    xofs[x] = (int64_t)x * sw / dw;
+
+  for (y=0; y<dh; y++) {
+    y0 = (int64_t)y * sh / dh;
+    y1 = (int64_t)(y + 1) * sh / dh;
+    if (y1 <= y0)
+      y1 = y0 + 1;
+
+    for (i=0; i<sw; i++)
+      acc[i] = 0;
+    for (i=y0; i<y1; i++)
+      add_row(src + (int64_t)i * src_stride, acc, sw);
+
+    out = dst + (int64_t)y * dst_stride;
+    for (x=0; x<dw; x++) {
+      x1 = xofs[x + 1];
+      if (x1 <= xofs[x])
+        x1 = xofs[x] + 1;
+      sum = 0;
+      for (i=xofs[x]; i<x1; i++)
+        sum += acc[i];
+      count = (uint64_t)(x1 - xofs[x]) * (y1 - y0);
+      out[x] = (sum + count / 2) / count;
+    }
+  }
+
+  free(acc);
+  free(xofs);
+
+  return 0;
+}
+
+int schroedinger_kernels_scale_plane(const uint8_t *src, int src_stride, int sw, int sh,
+                                     uint8_t *dst, int dst_stride, int dw, int dh,
+                                     int filter)
+{
+  pthread_once(&kernels_once, kernels_init);
+
+  if (sw <= 0 || sh <= 0 || dw <= 0 || dh <= 0)
+    return 0;
+
+  switch (filter) {
+    case SCALE_BOX:
+      return scale_box(src, src_stride, sw, sh, dst, dst_stride, dw, dh);
+    default:
+      return scale_bilinear(src, src_stride, sw, sh, dst, dst_stride, dw, dh);
+  }
+}
+
+int schroedinger_kernels_packed_h_shift(int format)
+{
+  return format == PACKED_RGBA ? 0 : 1;
+}
+
+int schroedinger_kernels_packed_row_size(int format, int width)
+{
+  switch (format) {
+    case PACKED_V210:
+      return (width + 5) / 6 * 16;
+    case PACKED_RGBA:
+      return 4 * width;
+    default:
+      return (width + 1) / 2 * 4;
+  }
+}
+
+void schroedinger_kernels_unpack_row(int format, const uint8_t *src,
+                                     uint8_t *y, uint8_t *u, uint8_t *v, int width)
+{
+  pthread_once(&kernels_once, kernels_init);
+  unpack_row[format](src, y, u, v, width);
+}
+
+void schroedinger_kernels_pack_row(int format, const uint8_t *y, const uint8_t *u,
+                                   const uint8_t *v, uint8_t *dst, int width)
+{
+  pthread_once(&kernels_once, kernels_init);
+  pack_row[format](y, u, v, dst, width);
+}
@@ -0,0 +1,64 @@
+/*
+  Copyright 2003-2011 Savonet team
+
+  This file is part of Ocaml-schroedinger.
+
+  Ocaml-schroedinger is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  Ocaml-schroedinger is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Ocaml-schroedinger; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/* Pixel kernels working on 8 bit planes. They do not use the
+ * OCaml runtime and may be called from a blocking section. The
+ * SSE2 or AVX2 versions are picked at runtime when the CPU has them. */
+
+#ifndef SCHROEDINGER_KERNELS_H
+#define SCHROEDINGER_KERNELS_H
+
+#include <stdint.h>
+
+/* Same order as Schroedinger.Frame.filter. */
+enum {
+  SCALE_BILINEAR,
+  SCALE_BOX
+};
+
+/* Scale a sw x sh plane into a dw x dh plane. Returns 0, or -1
+ * when out of memory. */
+int schroedinger_kernels_scale_plane(const uint8_t *src, int src_stride, int sw, int sh,
+                                     uint8_t *dst, int dst_stride, int dw, int dh,
+                                     int filter);
+
+/* Packed formats, converted from and to 8 bit planes. */
+enum {
+  PACKED_YUYV,
+  PACKED_UYVY,
+  PACKED_V210,
+  PACKED_RGBA
+};
+
+/* 1 for 4:2:2 formats, 0 for RGBA which has 4:4:4 chroma. */
+int schroedinger_kernels_packed_h_shift(int format);
+
+/* Number of bytes of a row of width pixels. */
+int schroedinger_kernels_packed_row_size(int format, int width);
+
+/* Convert a packed row into rows of the Y, Cb and Cr planes,
+ * chroma rows being subsampled according to the format. */
+void schroedinger_kernels_unpack_row(int format, const uint8_t *src,
+                                     uint8_t *y, uint8_t *u, uint8_t *v, int width);
+
+void schroedinger_kernels_pack_row(int format, const uint8_t *y, const uint8_t *u,
+                                   const uint8_t *v, uint8_t *dst, int width);
+
+#endif
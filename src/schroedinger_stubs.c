@@ -27,18 +27,39 @@
 #include <caml/alloc.h>
 #include <caml/callback.h>
 #include <caml/signals.h>
+#include <caml/version.h>
 
 #include <ogg/ogg.h>
 #include <ocaml-ogg.h>
 
 #include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
 
 #include <schroedinger/schro.h>
 #include <schroedinger/schroencoder.h>
 #include <schroedinger/schrodecoder.h>
 
+#include "schroedinger_kernels.h"
+
 #define ROUND_UP_SHIFT(x,y) (((x) + (1<<(y)) - 1)>>(y))
 
+/* Packed formats are converted to and from schroedinger's planar
+ * formats by the bindings, they never reach schroedinger. */
+#define FRAME_FORMAT_PACKED 0x10000
+#define FRAME_FORMAT_IS_PACKED(f) ((f) & FRAME_FORMAT_PACKED)
+#define PACKED_OF_FRAME_FORMAT(f) ((f) & ~FRAME_FORMAT_PACKED)
+
+/* Planes of S16 formats are int16 Bigarrays, whose strides are
+ * given to OCaml in samples instead of bytes. */
+#define FRAME_FORMAT_IS_S16(f) \
+  (!FRAME_FORMAT_IS_PACKED(f) && SCHRO_FRAME_FORMAT_DEPTH(f) == SCHRO_FRAME_FORMAT_DEPTH_S16)
+#define FRAME_FORMAT_SAMPLE_SIZE(f) (FRAME_FORMAT_IS_S16(f) ? 2 : 1)
+#define FRAME_FORMAT_BA_KIND(f) (FRAME_FORMAT_IS_S16(f) ? CAML_BA_SINT16 : CAML_BA_UINT8)
+
 /* Common */
 
 static inline SchroFrameFormat schro_frame_format_of_chroma_format(SchroChromaFormat format)
@@ -55,6 +76,72 @@ static inline SchroFrameFormat schro_frame_format_of_chroma_format(SchroChromaFo
   }
 }
 
+static inline SchroFrameFormat schro_s16_frame_format_of_chroma_format(SchroChromaFormat format)
+{
+  switch (format) {
+    case SCHRO_CHROMA_444:
+      return SCHRO_FRAME_FORMAT_S16_444;
+    case SCHRO_CHROMA_422:
+      return SCHRO_FRAME_FORMAT_S16_422;
+    case SCHRO_CHROMA_420:
+      return SCHRO_FRAME_FORMAT_S16_420;
+    default:
+      caml_failwith("invalid value");
+  }
+}
+
+/* Exceptions registered by the OCaml side, looked up once. Domains
+ * racing on the first lookup only store the same pointer twice. */
+enum {
+  EXN_INVALID_HEADER,
+  EXN_SKIP,
+  EXN_ERROR,
+  EXN_CLOSED,
+  EXN_OGG_OUT_OF_SYNC,
+  EXN_OGG_NOT_ENOUGH_DATA,
+  EXN_MAX
+};
+
+static const char *exn_names[EXN_MAX] = {
+  "schro_exn_invalid_header",
+  "schro_exn_skip",
+  "schro_exn_error",
+  "schro_exn_closed",
+  "ogg_exn_out_of_sync",
+  "ogg_exn_not_enough_data"
+};
+
+static const value *exn_values[EXN_MAX];
+
+CAMLnoreturn_start
+static void raise_named_exn(int exn)
+CAMLnoreturn_end;
+
+static void raise_named_exn(int exn)
+{
+  const value *v = __atomic_load_n(&exn_values[exn], __ATOMIC_ACQUIRE);
+
+  if (v == NULL) {
+    v = caml_named_value(exn_names[exn]);
+    if (v == NULL)
+      caml_failwith(exn_names[exn]);
+    __atomic_store_n(&exn_values[exn], v, __ATOMIC_RELEASE);
+  }
+
+  caml_raise_constant(*v);
+}
+
+/* Serial numbers are compared as unsigned 32 bits integers and given
+ * to OCaml as signed nativeints, as ocaml-ogg does. */
+#define Serial_val(v) ((ogg_uint32_t)Nativeint_val(v))
+#define Val_serial(s) caml_copy_nativeint((int32_t)(s))
+#define Page_serial(p) ((ogg_uint32_t)ogg_page_serialno(p))
+
+static ogg_uint32_t read32le(const unsigned char *ptr)
+{
+  return ptr[0] | (ptr[1] << 8) | (ptr[2] << 16) | ((ogg_uint32_t)ptr[3] << 24);
+}
+
 static SchroBuffer *schro_buffer_of_ogg_packet(ogg_packet *op)
 {
   SchroBuffer *buffer = schro_buffer_new_and_alloc(op->bytes);
@@ -62,28 +149,387 @@ static SchroBuffer *schro_buffer_of_ogg_packet(ogg_packet *op)
   return buffer;
 }
 
-void frame_planar_free(SchroFrame *frame, void *private)
+/* Frames are allocated as a single block. Planes start on, and have
+ * strides multiple of, FRAME_ALIGN bytes so that rows suit SIMD code. */
+#define FRAME_ALIGN 64
+#define ALIGN_UP(x) (((x) + FRAME_ALIGN - 1) & ~(size_t)(FRAME_ALIGN - 1))
+
+static void frame_block_free(SchroFrame *frame, void *private)
 {
   free(frame->components[0].data);
-  free(frame->components[1].data);
-  free(frame->components[2].data);
 }
 
-static SchroFrame *schro_frame_of_val(value v)
+/* Encoders and decoders keep reference frames, their upsampled
+ * versions and queued frames. Their native memory is reported to
+ * the GC as this rough number of frames of their video format. */
+#define ENC_FOOTPRINT_FRAMES 32
+#define DEC_FOOTPRINT_FRAMES 16
+
+static mlsize_t video_format_frame_size(SchroVideoFormat *format)
 {
-  SchroFrame *frame = schro_frame_new();
-  if (frame == NULL)
+  mlsize_t luma = (mlsize_t)format->width*format->height;
+  mlsize_t size;
+
+  switch (format->chroma_format) {
+    case SCHRO_CHROMA_444:
+      size = 3*luma;
+      break;
+    case SCHRO_CHROMA_422:
+      size = 2*luma;
+      break;
+    default:
+      size = luma + luma/2;
+      break;
+  }
+  /* More than 8 bits samples are stored on 16 bits. */
+  if (format->luma_excursion > 255)
+    size *= 2;
+
+  return size;
+}
+
+/* OCaml values handed to schroedinger without a copy are kept alive
+ * through a generational global root. Schroedinger may drop its last
+ * reference to them from one of its worker threads, where the OCaml
+ * runtime must not be used, so released roots are only queued there
+ * and actually removed the next time we hold the runtime lock. */
+
+typedef struct pinned_value {
+  value v;
+  struct pinned_value *next;
+} pinned_value;
+
+static pthread_mutex_t pinned_lock = PTHREAD_MUTEX_INITIALIZER;
+static pinned_value *pinned_released = NULL;
+
+static pinned_value *pin_value(value v)
+{
+  pinned_value *p = malloc(sizeof(pinned_value));
+  if (p == NULL)
     caml_raise_out_of_memory();
+  p->v = v;
+  p->next = NULL;
+  caml_register_generational_global_root(&p->v);
+  return p;
+}
+
+/* Can be called from any thread. */
+static void unpin_value(pinned_value *p)
+{
+  pthread_mutex_lock(&pinned_lock);
+  p->next = pinned_released;
+  pinned_released = p;
+  pthread_mutex_unlock(&pinned_lock);
+}
+
+/* Must be called with the runtime lock held. */
+static void release_pinned_values(void)
+{
+  pinned_value *p, *next;
+
+  pthread_mutex_lock(&pinned_lock);
+  p = pinned_released;
+  pinned_released = NULL;
+  pthread_mutex_unlock(&pinned_lock);
+
+  while (p != NULL)
+  {
+    next = p->next;
+    caml_remove_generational_global_root(&p->v);
+    free(p);
+    p = next;
+  }
+}
+
+/* Planes whose memory is not owned by the GC, such as decoded frames
+ * taken from a decoder's pool, are Bigarrays sharing a frame_proxy, and
+ * so is the data of encoded packets.
+ * Their custom operations are the Bigarray ones, except for the
+ * finalizer which gives the memory back to its owner once the last
+ * view, including sub-arrays made by OCaml, is collected. */
+
+typedef struct frame_pool frame_pool;
+typedef struct pool_slot pool_slot;
+
+static void pool_put(frame_pool *pool, pool_slot *slot);
+static void pool_unref(frame_pool *pool);
+
+#if OCAML_VERSION_MAJOR >= 5
+#define Proxy_ref(p) atomic_fetch_add(&(p)->refcount, 1)
+#define Proxy_unref(p) (atomic_fetch_sub(&(p)->refcount, 1) - 1)
+#define Proxy_refcount(p) atomic_load(&(p)->refcount)
+#else
+#define Proxy_ref(p) (++(p)->refcount)
+#define Proxy_unref(p) (--(p)->refcount)
+#define Proxy_refcount(p) ((p)->refcount)
+#endif
+
+typedef struct {
+  /* Must come first, OCaml only knows about this part. */
+  struct caml_ba_proxy proxy;
+  /* One for the OCaml views as a whole, while there are
+   * some, plus one per native user of the memory. */
+  int users;
+  /* Set once the memory has been given back. */
+  int given_back;
+  /* The memory is either a pool slot, a frame,
+   * an encoded buffer or a block. */
+  frame_pool *pool;
+  pool_slot *slot;
+  SchroFrame *frame;
+  SchroBuffer *buffer;
+} frame_proxy;
+
+static struct custom_operations frame_ba_ops;
+static pthread_mutex_t frame_ba_ops_lock = PTHREAD_MUTEX_INITIALIZER;
+static int frame_ba_ops_ready = 0;
+
+/* Returns NULL when out of memory. Takes over the caller's
+ * reference to the pool or to the frame. */
+static frame_proxy *frame_proxy_new(frame_pool *pool, pool_slot *slot, SchroFrame *frame, void *block)
+{
+  frame_proxy *fp = malloc(sizeof(frame_proxy));
+  if (fp == NULL)
+    return NULL;
+  fp->proxy.refcount = 0;
+  fp->proxy.data = block;
+  fp->proxy.size = 0;
+  fp->users = 1;
+  fp->given_back = 0;
+  fp->pool = pool;
+  fp->slot = slot;
+  fp->frame = frame;
+  fp->buffer = NULL;
+  return fp;
+}
+
+/* Does not use the OCaml runtime. */
+static void frame_proxy_free_memory(frame_proxy *fp)
+{
+  if (fp->pool != NULL) {
+    pool_put(fp->pool, fp->slot);
+    pool_unref(fp->pool);
+  } else if (fp->frame != NULL)
+    schro_frame_unref(fp->frame);
+  else if (fp->buffer != NULL)
+    schro_buffer_unref(fp->buffer);
+  else
+    free(fp->proxy.data);
+}
+
+/* Can be called from any thread. */
+static void frame_proxy_unuse(frame_proxy *fp)
+{
+  if (__atomic_sub_fetch(&fp->users, 1, __ATOMIC_SEQ_CST) > 0)
+    return;
+  if (!__atomic_exchange_n(&fp->given_back, 1, __ATOMIC_SEQ_CST))
+    frame_proxy_free_memory(fp);
+  free(fp);
+}
+
+/* Register a native user of the memory, which must call
+ * frame_proxy_unuse when done. Returns 0 if the memory has
+ * already been given back. Must be called with the runtime
+ * lock held, while a view is reachable. */
+static int frame_proxy_use(frame_proxy *fp)
+{
+  __atomic_add_fetch(&fp->users, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&fp->given_back, __ATOMIC_SEQ_CST)) {
+    frame_proxy_unuse(fp);
+    return 0;
+  }
+  return 1;
+}
+
+/* Whether the given number of views of a frame are the only
+ * ones left and no native code uses the memory. */
+static int frame_proxy_is_exclusive(frame_proxy *fp, uintnat views)
+{
+  return Proxy_refcount(&fp->proxy) == views &&
+         __atomic_load_n(&fp->users, __ATOMIC_SEQ_CST) == 1;
+}
+
+/* Give the memory back at once if the given number of views of a
+ * released frame are the only ones left and no native code uses it.
+ * Otherwise this is left to the finalizer. */
+static void frame_proxy_release(frame_proxy *fp, uintnat views)
+{
+  /* Marking the memory as given back first makes
+   * concurrent calls to frame_proxy_use fail. */
+  if (__atomic_exchange_n(&fp->given_back, 1, __ATOMIC_SEQ_CST))
+    return;
+  if (frame_proxy_is_exclusive(fp, views))
+    frame_proxy_free_memory(fp);
+  else
+    __atomic_store_n(&fp->given_back, 0, __ATOMIC_SEQ_CST);
+}
+
+static void frame_ba_finalize(value v)
+{
+  frame_proxy *fp = (frame_proxy *)Caml_ba_array_val(v)->proxy;
+
+  /* Not attached yet. */
+  if (fp == NULL)
+    return;
+  if (Proxy_unref(&fp->proxy) == 0)
+    frame_proxy_unuse(fp);
+}
+
+static int is_frame_proxy_val(value v)
+{
+  return Custom_ops_val(v) == &frame_ba_ops;
+}
+
+/* Returns a one dimension Bigarray of len bytes at data, not attached
+ * to a proxy yet. The memory is accounted for so that unused frames
+ * are given back early enough. */
+static value frame_proxy_array(void *data, intnat len, int kind, int size)
+{
+  value ret = caml_alloc_custom_mem(&frame_ba_ops, sizeof(struct caml_ba_array) + sizeof(intnat), len);
+  struct caml_ba_array *b = Caml_ba_array_val(ret);
+
+  b->data = data;
+  b->num_dims = 1;
+  b->flags = CAML_BA_MANAGED | CAML_BA_C_LAYOUT | kind;
+  b->proxy = NULL;
+  b->dim[0] = len/size;
+  return ret;
+}
+
+/* Returns the planes array of an internal_frame pointing to the
+ * memory of frame, to be attached to a proxy with frame_proxy_attach. */
+static value frame_proxy_planes(SchroFrame *frame)
+{
+  CAMLparam0();
+  CAMLlocal3(planes, plane, data);
+  int size = FRAME_FORMAT_SAMPLE_SIZE(frame->format);
+  int n = FRAME_FORMAT_IS_PACKED(frame->format) ? 1 : 3;
+  int j;
+
+  planes = caml_alloc_tuple(n);
+  for (j=0; j<n; j++) {
+    data = frame_proxy_array(frame->components[j].data, frame->components[j].length,
+                             FRAME_FORMAT_BA_KIND(frame->format), size);
+    plane = caml_alloc_tuple(2);
+    Store_field(plane, 0, data);
+    Store_field(plane, 1, Val_int(frame->components[j].stride/size));
+    Store_field(planes, j, plane);
+  }
+
+  CAMLreturn(planes);
+}
+
+/* Make fp the owner of the planes' memory. Does not allocate. */
+static void frame_proxy_attach(value planes, frame_proxy *fp)
+{
+  struct caml_ba_array *b;
+  int j;
+
+  for (j=0; j<Wosize_val(planes); j++) {
+    b = Caml_ba_array_val(Field(Field(planes, j), 0));
+    b->proxy = &fp->proxy;
+    Proxy_ref(&fp->proxy);
+  }
+}
+
+/* Can be called from any thread. */
+static void planes_unuse(frame_proxy *proxies[3])
+{
+  int j;
+
+  for (j=0; j<3 && proxies[j] != NULL; j++)
+    frame_proxy_unuse(proxies[j]);
+}
+
+/* Register native code as a user of the planes with a frame_proxy,
+ * storing their distinct proxies in proxies. Returns 0, with no user
+ * registered, if some of them have been released meanwhile. */
+static int planes_use(value planes, frame_proxy *proxies[3])
+{
+  frame_proxy *fp;
+  value data;
+  int i, j;
+  int n = 0;
+
+  memset(proxies, 0, 3*sizeof(frame_proxy *));
+  for (j=0; j<Wosize_val(planes) && j<3; j++) {
+    data = Field(Field(planes, j), 0);
+    if (!is_frame_proxy_val(data))
+      continue;
+    fp = (frame_proxy *)Caml_ba_array_val(data)->proxy;
+    for (i=0; i<n && proxies[i] != fp; i++);
+    if (i < n)
+      continue;
+    if (!frame_proxy_use(fp)) {
+      planes_unuse(proxies);
+      return 0;
+    }
+    proxies[n++] = fp;
+  }
+
+  return 1;
+}
+
+/* Make the planes of a frame empty, so that later accesses fail. Planes
+ * with a frame_proxy give their memory back at once when they are its
+ * only views and no native code uses it, otherwise once they are all
+ * collected. Other planes are left to the GC: other views may still
+ * point to them. */
+static void planes_release(value planes)
+{
+  struct caml_ba_array *b;
+  frame_proxy *fp;
+  value data;
+  uintnat views;
+  int i, j;
+
+  for (j=0; j<Wosize_val(planes); j++) {
+    data = Field(Field(planes, j), 0);
+    b = Caml_ba_array_val(data);
+    if (!is_frame_proxy_val(data) || b->data == NULL)
+      continue;
+    /* Planes of a frame usually share the same proxy. */
+    fp = (frame_proxy *)b->proxy;
+    views = 0;
+    for (i=0; i<Wosize_val(planes); i++) {
+      data = Field(Field(planes, i), 0);
+      if (is_frame_proxy_val(data) &&
+          Caml_ba_array_val(data)->proxy == &fp->proxy &&
+          Caml_ba_array_val(data)->data != NULL) {
+        views++;
+        Caml_ba_array_val(data)->data = NULL;
+        Caml_ba_array_val(data)->dim[0] = 0;
+      }
+    }
+    frame_proxy_release(fp, views);
+  }
+}
+
+/* Register native code as a user of the planes of an internal_frame,
+ * while it reads or writes them without the runtime lock. Raises if
+ * they have been released by another domain. */
+static void frame_use_val(value v, frame_proxy *proxies[3])
+{
+  if (!planes_use(Field(v, 0), proxies))
+    caml_failwith("invalid frame dimension");
+}
+
+/* Fill the components of frame with the planes of an internal_frame,
+ * checking their dimensions. Data pointers refer to the Bigarrays.
+ * Packed frames only have their first component set. */
+static void schro_frame_init_of_val(SchroFrame *frame, value v)
+{
   int i = 0;
-  int j = 0;
+  int j;
   int h_shift;
   int v_shift;
+  int width;
+  int height;
   int len;
   int stride;
   value plane;
   value planes;
   struct caml_ba_array *data;
-  void *tmp;
 
   planes = Field(v, i++);
   /* Get params */
@@ -91,279 +537,556 @@ static SchroFrame *schro_frame_of_val(value v)
   frame->height = Int_val(Field(v, i++));
   frame->format = Int_val(Field(v, i++));
 
-  /* Get data */
+  if (FRAME_FORMAT_IS_PACKED(frame->format)) {
+    memset(frame->components, 0, sizeof(frame->components));
+    data = Caml_ba_array_val(Field(Field(planes, 0),0));
+    stride = Int_val(Field(Field(planes, 0),1));
+    len = stride*frame->height;
+    if (stride < schroedinger_kernels_packed_row_size(PACKED_OF_FRAME_FORMAT(frame->format), frame->width) ||
+        (int)data->dim[0] != len ||
+        (data->flags & CAML_BA_KIND_MASK) != CAML_BA_UINT8)
+      caml_failwith("invalid frame dimension");
+    frame->components[0].format = frame->format;
+    frame->components[0].data = data->data;
+    frame->components[0].stride = stride;
+    frame->components[0].width = frame->width;
+    frame->components[0].height = frame->height;
+    frame->components[0].length = len;
+    return;
+  }
 
   h_shift = SCHRO_FRAME_FORMAT_H_SHIFT(frame->format);
   v_shift = SCHRO_FRAME_FORMAT_V_SHIFT(frame->format);
-  
-  /* First plane */
-  plane = Field(planes, j++);
-  data = Caml_ba_array_val(Field(plane,0));
-  stride = Int_val(Field(plane,1));
-  len = stride*frame->height;
-  if (stride < frame->width || 
-      (int)data->dim[0] != len)
-    caml_failwith("invalid frame dimension");
-  tmp = malloc(len);
-  if (tmp == NULL)
+
+  for (j=0; j<3; j++) {
+    /* First plane is luma, secondary planes are chroma. */
+    width = j == 0 ? frame->width : ROUND_UP_SHIFT(frame->width, h_shift);
+    height = j == 0 ? frame->height : ROUND_UP_SHIFT(frame->height, v_shift);
+    plane = Field(planes, j);
+    data = Caml_ba_array_val(Field(plane,0));
+    stride = Int_val(Field(plane,1));
+    len = stride*height;
+    if (stride < width ||
+        (int)data->dim[0] != len ||
+        (data->flags & CAML_BA_KIND_MASK) != FRAME_FORMAT_BA_KIND(frame->format))
+      caml_failwith("invalid frame dimension");
+    frame->components[j].format = frame->format;
+    frame->components[j].data = data->data;
+    frame->components[j].stride = stride*FRAME_FORMAT_SAMPLE_SIZE(frame->format);
+    frame->components[j].width = width;
+    frame->components[j].height = height;
+    frame->components[j].length = len*FRAME_FORMAT_SAMPLE_SIZE(frame->format);
+    frame->components[j].h_shift = j == 0 ? 0 : h_shift;
+    frame->components[j].v_shift = j == 0 ? 0 : v_shift;
+  }
+}
+
+static SchroFrame *schro_frame_alloc(SchroFrameFormat format, int width, int height);
+
+/* Convert the packed frame src into the planar frame dst, which has the
+ * same dimensions. Chroma goes through temporary planes when dst does
+ * not have the subsampling of the packed format. Does not use the OCaml
+ * runtime. Returns -1 when out of memory. */
+static int frame_unpack(SchroFrame *dst, SchroFrame *src)
+{
+  int packed = PACKED_OF_FRAME_FORMAT(src->format);
+  int h_shift = schroedinger_kernels_packed_h_shift(packed);
+  int cw = ROUND_UP_SHIFT(src->width, h_shift);
+  int direct = SCHRO_FRAME_FORMAT_H_SHIFT(dst->format) == h_shift &&
+               SCHRO_FRAME_FORMAT_V_SHIFT(dst->format) == 0;
+  uint8_t *u = dst->components[1].data;
+  uint8_t *v = dst->components[2].data;
+  int cstride = dst->components[1].stride;
+  uint8_t *tmp = NULL;
+  int ret = 0;
+  int i, j;
+
+  if (!direct) {
+    tmp = malloc(2*cw*src->height);
+    if (tmp == NULL)
+      return -1;
+    u = tmp;
+    v = tmp + cw*src->height;
+    cstride = cw;
+  }
+
+  for (i=0; i<src->height; i++)
+    schroedinger_kernels_unpack_row(packed,
+                                    (uint8_t *)src->components[0].data + i*src->components[0].stride,
+                                    (uint8_t *)dst->components[0].data + i*dst->components[0].stride,
+                                    u + i*cstride, v + i*cstride, src->width);
+
+  if (!direct) {
+    for (j=1; j<3 && ret == 0; j++)
+      ret = schroedinger_kernels_scale_plane(j == 1 ? u : v, cw, cw, src->height,
+                                             dst->components[j].data,
+                                             dst->components[j].stride,
+                                             dst->components[j].width,
+                                             dst->components[j].height,
+                                             SCALE_BOX);
+    free(tmp);
+  }
+
+  return ret;
+}
+
+/* Reverse of frame_unpack. */
+static int frame_pack(SchroFrame *dst, SchroFrame *src)
+{
+  int packed = PACKED_OF_FRAME_FORMAT(dst->format);
+  int h_shift = schroedinger_kernels_packed_h_shift(packed);
+  int cw = ROUND_UP_SHIFT(dst->width, h_shift);
+  int direct = SCHRO_FRAME_FORMAT_H_SHIFT(src->format) == h_shift &&
+               SCHRO_FRAME_FORMAT_V_SHIFT(src->format) == 0;
+  uint8_t *u = src->components[1].data;
+  uint8_t *v = src->components[2].data;
+  int cstride = src->components[1].stride;
+  uint8_t *tmp = NULL;
+  int ret = 0;
+  int i, j;
+
+  if (!direct) {
+    tmp = malloc(2*cw*dst->height);
+    if (tmp == NULL)
+      return -1;
+    u = tmp;
+    v = tmp + cw*dst->height;
+    cstride = cw;
+    for (j=1; j<3 && ret == 0; j++)
+      ret = schroedinger_kernels_scale_plane(src->components[j].data,
+                                             src->components[j].stride,
+                                             src->components[j].width,
+                                             src->components[j].height,
+                                             j == 1 ? u : v, cw, cw, dst->height,
+                                             SCALE_BILINEAR);
+  }
+
+  for (i=0; i<dst->height && ret == 0; i++)
+    schroedinger_kernels_pack_row(packed,
+                                  (uint8_t *)src->components[0].data + i*src->components[0].stride,
+                                  u + i*cstride, v + i*cstride,
+                                  (uint8_t *)dst->components[0].data + i*dst->components[0].stride,
+                                  dst->width);
+
+  free(tmp);
+
+  return ret;
+}
+
+/* Copy src into dst, which must have the same format and dimensions. */
+static void schro_frame_copy_into(SchroFrame *dst, SchroFrame *src)
+{
+  int i, j;
+  uint8_t *s, *d;
+
+  for (j=0; j<3; j++) {
+    s = src->components[j].data;
+    d = dst->components[j].data;
+    for (i=0; i<dst->components[j].height; i++) {
+      memcpy(d, s, dst->components[j].width*FRAME_FORMAT_SAMPLE_SIZE(dst->format));
+      s += src->components[j].stride;
+      d += dst->components[j].stride;
+    }
+  }
+}
+
+/* Packed frames are converted to the planar format, otherwise
+ * planes are copied as they are. The caller keeps v alive and the
+ * planes' memory is kept while they are used, so the copy is done
+ * without holding the runtime lock. */
+static SchroFrame *schro_frame_of_val(value v, SchroFrameFormat planar)
+{
+  SchroFrame tmpl;
+  SchroFrame *frame;
+  frame_proxy *proxies[3];
+  int packed;
+  int ret = 0;
+
+  schro_frame_init_of_val(&tmpl, v);
+  packed = FRAME_FORMAT_IS_PACKED(tmpl.format);
+
+  frame = schro_frame_alloc(packed ? planar : tmpl.format, tmpl.width, tmpl.height);
+  if (frame == NULL)
     caml_raise_out_of_memory();
-  memcpy(tmp,data->data,len);
-  frame->components[0].format = frame->format;
-  frame->components[0].data = tmp;
-  frame->components[0].stride = stride;
-  frame->components[0].width = frame->width;
-  frame->components[0].height = frame->height;
-  frame->components[0].length = len;
-  frame->components[0].h_shift = 0;
-  frame->components[0].v_shift = 0;
-
-  /* Secondary planes */
-  plane = Field(planes, j++);
-  data = Caml_ba_array_val(Field(plane,0));
-  stride = Int_val(Field(plane,1));
-  len = stride*(ROUND_UP_SHIFT(frame->height, v_shift));
-  if (stride < ROUND_UP_SHIFT(frame->width, h_shift) ||
-      (int)data->dim[0] != len)
+  if (!planes_use(Field(v, 0), proxies)) {
+    schro_frame_unref(frame);
     caml_failwith("invalid frame dimension");
-  tmp = malloc(len);
-  if (tmp == NULL)
+  }
+
+  caml_enter_blocking_section();
+  if (packed)
+    ret = frame_unpack(frame, &tmpl);
+  else
+    schro_frame_copy_into(frame, &tmpl);
+  planes_unuse(proxies);
+  caml_leave_blocking_section();
+
+  if (ret < 0) {
+    schro_frame_unref(frame);
+    caml_raise_out_of_memory();
+  }
+
+  return frame;
+}
+
+/* Native reference to the planes of a frame handed to schroedinger
+ * without a copy: the planes are kept alive and their memory is not
+ * given back, even if the frame is released. */
+typedef struct {
+  pinned_value *planes;
+  frame_proxy *proxies[3];
+} frame_pin;
+
+static void frame_pin_free(SchroFrame *frame, void *private)
+{
+  frame_pin *pin = private;
+  planes_unuse(pin->proxies);
+  unpin_value(pin->planes);
+  free(pin);
+}
+
+/* Same as schro_frame_of_val but the returned frame points
+ * directly to the Bigarrays' data, which stay pinned until
+ * schroedinger frees the frame. Packed frames still need
+ * to be converted. */
+static SchroFrame *schro_frame_wrap_val(value v, SchroFrameFormat planar)
+{
+  SchroFrame tmpl;
+  SchroFrame *frame;
+  pinned_value *planes;
+  frame_pin *pin;
+  int j;
+
+  schro_frame_init_of_val(&tmpl, v);
+
+  if (FRAME_FORMAT_IS_PACKED(tmpl.format))
+    return schro_frame_of_val(v, planar);
+
+  planes = pin_value(Field(v, 0));
+  pin = malloc(sizeof(frame_pin));
+  if (pin == NULL) {
+    unpin_value(planes);
     caml_raise_out_of_memory();
-  memcpy(tmp,data->data,len);
-  frame->components[1].format = frame->format;
-  frame->components[1].data = tmp;
-  frame->components[1].stride = stride;
-  frame->components[1].width = ROUND_UP_SHIFT(frame->width, h_shift);
-  frame->components[1].height = ROUND_UP_SHIFT(frame->height, v_shift);
-  frame->components[1].length = len;
-  frame->components[1].h_shift = h_shift;
-  frame->components[1].v_shift = v_shift;
-
-  plane = Field(planes, j++);
-  data = Caml_ba_array_val(Field(plane,0));
-  stride = Int_val(Field(plane,1));
-  len = stride*(ROUND_UP_SHIFT(frame->height, v_shift));
-  if (stride < (ROUND_UP_SHIFT(frame->width, h_shift)) ||
-      (int)data->dim[0] != len)
+  }
+  pin->planes = planes;
+  /* The planes may have been released by another domain. */
+  if (!planes_use(Field(v, 0), pin->proxies)) {
+    unpin_value(planes);
+    free(pin);
     caml_failwith("invalid frame dimension");
-  tmp = malloc(len);
-  if (tmp == NULL)
+  }
+  frame = schro_frame_new();
+  if (frame == NULL) {
+    frame_pin_free(NULL, pin);
     caml_raise_out_of_memory();
-  memcpy(tmp,data->data,len);
-  frame->components[2].format = frame->format;
-  frame->components[2].data = tmp;
-  frame->components[2].stride = stride;
-  frame->components[2].width = ROUND_UP_SHIFT(frame->width, h_shift);
-  frame->components[2].height = ROUND_UP_SHIFT(frame->height, v_shift);
-  frame->components[2].length = len;
-  frame->components[2].h_shift = h_shift;
-  frame->components[2].v_shift = v_shift;
-
-  schro_frame_set_free_callback(frame,frame_planar_free,NULL);
+  }
+  frame->width = tmpl.width;
+  frame->height = tmpl.height;
+  frame->format = tmpl.format;
+  for (j=0; j<3; j++)
+    frame->components[j] = tmpl.components[j];
+
+  schro_frame_set_free_callback(frame,frame_pin_free,pin);
 
   return frame;
 }
 
-static SchroFrame *schro_frame_alloc(SchroFrameFormat format, int width, int height)
+/* Set the components of frame for a frame of the given format and
+ * dimensions in a single block, with the offsets of the planes in
+ * the block. Packed frames only have one component. Returns the
+ * size of the block. */
+static size_t frame_layout(SchroFrame *frame, int format, int width, int height, size_t offsets[3])
 {
-  SchroFrame *frame = schro_frame_new();
-  if (frame == NULL)
-    caml_raise_out_of_memory();
   int h_shift;
   int v_shift;
-  int len;
-  int stride;
-  char *tmp;
+  size_t size = 0;
+  int j;
 
-  /* Set params */
+  memset(frame->components, 0, sizeof(frame->components));
+  memset(offsets, 0, 3*sizeof(size_t));
   frame->width = width;
   frame->height = height;
   frame->format = format;
 
-  /* Get data */
+  if (FRAME_FORMAT_IS_PACKED(format)) {
+    frame->components[0].format = format;
+    frame->components[0].width = width;
+    frame->components[0].height = height;
+    frame->components[0].stride =
+      ALIGN_UP(schroedinger_kernels_packed_row_size(PACKED_OF_FRAME_FORMAT(format), width));
+    frame->components[0].length = frame->components[0].stride*height;
+    return frame->components[0].length;
+  }
 
-  h_shift = SCHRO_FRAME_FORMAT_H_SHIFT(frame->format);
-  v_shift = SCHRO_FRAME_FORMAT_V_SHIFT(frame->format);
-  
-  /* First plane */
-  stride = frame->width;
-  len = stride*frame->height;
-  tmp = malloc(len);
-  if (tmp == NULL)
-    caml_raise_out_of_memory();
-  frame->components[0].format = format;
-  frame->components[0].data = tmp;
-  frame->components[0].stride = stride;
-  frame->components[0].width = frame->width;
-  frame->components[0].height = frame->height;
-  frame->components[0].length = len;
-  frame->components[0].h_shift = 0;
-  frame->components[0].v_shift = 0;
-
-  /* Secondary planes */
-  stride = ROUND_UP_SHIFT(frame->width, h_shift);
-  len = stride*(ROUND_UP_SHIFT(frame->height, v_shift));
-  tmp = malloc(len);
-  if (tmp == NULL)
-    caml_raise_out_of_memory();
-  frame->components[1].format = format;
-  frame->components[1].data = tmp;
-  frame->components[1].stride = stride;
-  frame->components[1].width = ROUND_UP_SHIFT(frame->width, h_shift);
-  frame->components[1].height = ROUND_UP_SHIFT(frame->height, v_shift);
-  frame->components[1].length = len;
-  frame->components[1].h_shift = h_shift;
-  frame->components[1].v_shift = v_shift;
-
-  stride = ROUND_UP_SHIFT(frame->width, h_shift);
-  len = stride*(ROUND_UP_SHIFT(frame->height, v_shift));
-  tmp = malloc(len);
-  if (tmp == NULL)
-    caml_raise_out_of_memory();
-  frame->components[2].format = format;
-  frame->components[2].data = tmp;
-  frame->components[2].stride = stride;
-  frame->components[2].width = ROUND_UP_SHIFT(frame->width, h_shift);
-  frame->components[2].height = ROUND_UP_SHIFT(frame->height, v_shift);
-  frame->components[2].length = len;
-  frame->components[2].h_shift = h_shift;
-  frame->components[2].v_shift = v_shift;
+  h_shift = SCHRO_FRAME_FORMAT_H_SHIFT(format);
+  v_shift = SCHRO_FRAME_FORMAT_V_SHIFT(format);
+
+  for (j=0; j<3; j++) {
+    /* First plane is luma, secondary planes are chroma. */
+    frame->components[j].format = format;
+    frame->components[j].width = j == 0 ? width : ROUND_UP_SHIFT(width, h_shift);
+    frame->components[j].height = j == 0 ? height : ROUND_UP_SHIFT(height, v_shift);
+    frame->components[j].stride =
+      ALIGN_UP(frame->components[j].width*FRAME_FORMAT_SAMPLE_SIZE(format));
+    frame->components[j].length = frame->components[j].stride*frame->components[j].height;
+    frame->components[j].h_shift = j == 0 ? 0 : h_shift;
+    frame->components[j].v_shift = j == 0 ? 0 : v_shift;
+    offsets[j] = size;
+    size += frame->components[j].length;
+  }
+
+  return size;
+}
+
+/* Does not use the OCaml runtime so that it can be called from any
+ * thread. Returns NULL when out of memory. */
+static SchroFrame *schro_frame_alloc(SchroFrameFormat format, int width, int height)
+{
+  SchroFrame *frame;
+  size_t offsets[3];
+  size_t size;
+  void *block;
+  int j;
+
+  frame = schro_frame_new();
+  if (frame == NULL)
+    return NULL;
+
+  size = frame_layout(frame, format, width, height, offsets);
+  if (posix_memalign(&block, FRAME_ALIGN, size) != 0) {
+    schro_frame_unref(frame);
+    return NULL;
+  }
+  for (j=0; j<3; j++)
+    frame->components[j].data = (uint8_t *)block + offsets[j];
 
-  schro_frame_set_free_callback(frame,frame_planar_free,NULL);
+  schro_frame_set_free_callback(frame,frame_block_free,NULL);
 
   return frame;
 }
 
-static value val_of_schro_frame(SchroFrame *frame)
+/* Returns the planes of a frame of the given format, laid out as in
+ * schro_frame_alloc. They share a frame_proxy owning the block, so that
+ * the memory is only freed once no native code uses it anymore. */
+CAMLprim value ocaml_schroedinger_frame_create(value _format, value _width, value _height)
 {
   CAMLparam0();
-  CAMLlocal4(ret, planes, plane, data);
-  intnat len;
-  void *tmp;
+  CAMLlocal1(planes);
+  SchroFrame frame;
+  int format = Int_val(_format);
+  int width = Int_val(_width);
+  int height = Int_val(_height);
+  size_t offsets[3];
+  size_t len;
+  frame_proxy *fp;
+  void *block;
   int j;
 
-  /* Init result and planes array */
-  ret = caml_alloc_tuple(4);
-  planes = caml_alloc_tuple(3);
-  /* Store planes array */
-  Store_field (ret, 0, planes);
-  /* Store frame infos */
-  Store_field (ret, 1, Val_int(frame->width));
-  Store_field (ret, 2, Val_int(frame->height));
-  Store_field (ret, 3, Val_int(frame->format));
+  if (width <= 0 || height <= 0)
+    caml_invalid_argument("Schroedinger.Frame.create");
 
-  /* Store data */
-  for (j=0; j<3; j++) {
-    len = frame->components[j].stride*frame->components[j].height;
-    tmp = malloc(len);
-    if (tmp == NULL)
-      caml_raise_out_of_memory();
-    memcpy(tmp,frame->components[j].data,len);
-    data = caml_ba_alloc(CAML_BA_MANAGED | CAML_BA_C_LAYOUT | CAML_BA_UINT8, 1, tmp, &len);
-    plane = caml_alloc_tuple(2);
-    Store_field(plane, 0, data);
-    Store_field(plane, 1, Val_int(frame->components[j].stride));
-    Store_field(planes, j, plane);
+  len = frame_layout(&frame, format, width, height, offsets);
+  if (posix_memalign(&block, FRAME_ALIGN, len) != 0)
+    caml_raise_out_of_memory();
+  for (j=0; j<3; j++)
+    frame.components[j].data = (uint8_t *)block + offsets[j];
+
+  planes = frame_proxy_planes(&frame);
+  fp = frame_proxy_new(NULL, NULL, NULL, block);
+  if (fp == NULL) {
+    free(block);
+    caml_raise_out_of_memory();
   }
+  frame_proxy_attach(planes, fp);
 
-  CAMLreturn(ret);
+  CAMLreturn(planes);
 }
 
-CAMLprim value caml_schroedinger_init(value unit)
+CAMLprim value ocaml_schroedinger_frame_release(value planes)
 {
-  CAMLparam0();
-  schro_init();
+  CAMLparam1(planes);
+  planes_release(planes);
   CAMLreturn(Val_unit);
 }
 
-CAMLprim value ocaml_schroedinger_int_of_define(value v)
-{
-  CAMLparam1(v);
-  char *s = String_val(v);
-  if (!strcmp(s,"SCHRO_FRAME_FORMAT_U8_444"))
-    CAMLreturn(Val_int(SCHRO_FRAME_FORMAT_U8_444)) ;
-  if (!strcmp(s,"SCHRO_FRAME_FORMAT_U8_422"))
-    CAMLreturn(Val_int(SCHRO_FRAME_FORMAT_U8_422)) ;
-  if (!strcmp(s,"SCHRO_FRAME_FORMAT_U8_420"))
-    CAMLreturn(Val_int(SCHRO_FRAME_FORMAT_U8_420)) ;
-  if (!strcmp(s,"SCHRO_VIDEO_FORMAT_CUSTOM"))
-    CAMLreturn(Val_int(SCHRO_VIDEO_FORMAT_CUSTOM)) ;
-  if (!strcmp(s,"SCHRO_VIDEO_FORMAT_QSIF"))
-    CAMLreturn(Val_int(SCHRO_VIDEO_FORMAT_QSIF)) ;
-  if (!strcmp(s,"SCHRO_VIDEO_FORMAT_QCIF"))
-    CAMLreturn(Val_int(SCHRO_VIDEO_FORMAT_QCIF)) ;
-  if (!strcmp(s,"SCHRO_VIDEO_FORMAT_SIF"))
-    CAMLreturn(Val_int(SCHRO_VIDEO_FORMAT_SIF)) ;
-  if (!strcmp(s,"SCHRO_VIDEO_FORMAT_CIF"))
-    CAMLreturn(Val_int(SCHRO_VIDEO_FORMAT_CIF)) ;
-  if (!strcmp(s,"SCHRO_VIDEO_FORMAT_4SIF"))
-    CAMLreturn(Val_int(SCHRO_VIDEO_FORMAT_4SIF)) ;
-  if (!strcmp(s,"SCHRO_VIDEO_FORMAT_4CIF"))
-    CAMLreturn(Val_int(SCHRO_VIDEO_FORMAT_4CIF)) ;
-  if (!strcmp(s,"SCHRO_VIDEO_FORMAT_SD480I_60"))
-    CAMLreturn(Val_int(SCHRO_VIDEO_FORMAT_SD480I_60)) ;
-  if (!strcmp(s,"SCHRO_VIDEO_FORMAT_SD576I_50"))
-    CAMLreturn(Val_int(SCHRO_VIDEO_FORMAT_SD576I_50)) ;
-  if (!strcmp(s,"SCHRO_VIDEO_FORMAT_HD720P_60"))
-    CAMLreturn(Val_int(SCHRO_VIDEO_FORMAT_HD720P_60)) ;
-  if (!strcmp(s,"SCHRO_VIDEO_FORMAT_HD720P_50"))
-    CAMLreturn(Val_int(SCHRO_VIDEO_FORMAT_HD720P_50)) ;
-  if (!strcmp(s,"SCHRO_VIDEO_FORMAT_HD1080I_60"))
-    CAMLreturn(Val_int(SCHRO_VIDEO_FORMAT_HD1080I_60)) ;
-  if (!strcmp(s,"SCHRO_VIDEO_FORMAT_HD1080I_50"))
-    CAMLreturn(Val_int(SCHRO_VIDEO_FORMAT_HD1080I_50)) ;
-  if (!strcmp(s,"SCHRO_VIDEO_FORMAT_HD1080P_60"))
-    CAMLreturn(Val_int(SCHRO_VIDEO_FORMAT_HD1080P_60)) ;
-  if (!strcmp(s,"SCHRO_VIDEO_FORMAT_HD1080P_50"))
-    CAMLreturn(Val_int(SCHRO_VIDEO_FORMAT_HD1080P_50)) ;
-  if (!strcmp(s,"SCHRO_VIDEO_FORMAT_DC2K_24"))
-    CAMLreturn(Val_int(SCHRO_VIDEO_FORMAT_DC2K_24)) ;
-  if (!strcmp(s,"SCHRO_VIDEO_FORMAT_DC4K_24"))
-    CAMLreturn(Val_int(SCHRO_VIDEO_FORMAT_DC4K_24)) ;
-  if (!strcmp(s,"SCHRO_CHROMA_444"))
-    CAMLreturn(Val_int(SCHRO_CHROMA_444)) ;
-  if (!strcmp(s,"SCHRO_CHROMA_422"))
-    CAMLreturn(Val_int(SCHRO_CHROMA_422)) ;
-  if (!strcmp(s,"SCHRO_CHROMA_420"))
-    CAMLreturn(Val_int(SCHRO_CHROMA_420)) ;
-  if (!strcmp(s,"SCHRO_COLOUR_PRIMARY_HDTV"))
-    CAMLreturn(Val_int(SCHRO_COLOUR_PRIMARY_HDTV)) ;
-  if (!strcmp(s,"SCHRO_COLOUR_PRIMARY_SDTV_525"))
-    CAMLreturn(Val_int(SCHRO_COLOUR_PRIMARY_SDTV_525)) ;
-  if (!strcmp(s,"SCHRO_COLOUR_PRIMARY_SDTV_625"))
-    CAMLreturn(Val_int(SCHRO_COLOUR_PRIMARY_SDTV_625)) ;
-  if (!strcmp(s,"SCHRO_COLOUR_PRIMARY_CINEMA"))
-    CAMLreturn(Val_int(SCHRO_COLOUR_PRIMARY_CINEMA)) ;
-  if (!strcmp(s,"SCHRO_COLOUR_MATRIX_HDTV"))
-    CAMLreturn(Val_int(SCHRO_COLOUR_MATRIX_HDTV)) ;
-  if (!strcmp(s,"SCHRO_COLOUR_MATRIX_SDTV"))
-    CAMLreturn(Val_int(SCHRO_COLOUR_MATRIX_SDTV)) ;
-  if (!strcmp(s,"SCHRO_COLOUR_MATRIX_REVERSIBLE"))
-    CAMLreturn(Val_int(SCHRO_COLOUR_MATRIX_REVERSIBLE)) ;
-  if (!strcmp(s,"SCHRO_TRANSFER_CHAR_TV_GAMMA"))
-    CAMLreturn(Val_int(SCHRO_TRANSFER_CHAR_TV_GAMMA)) ;
-  if (!strcmp(s,"SCHRO_TRANSFER_CHAR_EXTENDED_GAMUT"))
-    CAMLreturn(Val_int(SCHRO_TRANSFER_CHAR_EXTENDED_GAMUT)) ;
-  if (!strcmp(s,"SCHRO_TRANSFER_CHAR_LINEAR"))
-    CAMLreturn(Val_int(SCHRO_TRANSFER_CHAR_LINEAR)) ;
-  if (!strcmp(s,"SCHRO_TRANSFER_CHAR_DCI_GAMMA"))
-    CAMLreturn(Val_int(SCHRO_TRANSFER_CHAR_DCI_GAMMA)) ;
-  if (!strcmp(s,"SCHRO_SIGNAL_RANGE_CUSTOM"))
-    CAMLreturn(Val_int(SCHRO_SIGNAL_RANGE_CUSTOM)) ;
-  if (!strcmp(s,"SCHRO_SIGNAL_RANGE_8BIT_FULL"))
-    CAMLreturn(Val_int(SCHRO_SIGNAL_RANGE_8BIT_FULL)) ;
-  if (!strcmp(s,"SCHRO_SIGNAL_RANGE_8BIT_VIDEO"))
-    CAMLreturn(Val_int(SCHRO_SIGNAL_RANGE_8BIT_VIDEO)) ;
-  if (!strcmp(s,"SCHRO_SIGNAL_RANGE_10BIT_VIDEO"))
-    CAMLreturn(Val_int(SCHRO_SIGNAL_RANGE_10BIT_VIDEO)) ;
-  if (!strcmp(s,"SCHRO_SIGNAL_RANGE_12BIT_VIDEO"))
-    CAMLreturn(Val_int(SCHRO_SIGNAL_RANGE_12BIT_VIDEO)) ;
-
-
-  caml_failwith("unknown value");
+/* Scale each plane of the src frame into the corresponding plane
+ * of the dst frame. Both frames may have different formats. */
+CAMLprim value ocaml_schroedinger_frame_scale(value _src, value _dst, value _filter)
+{
+  CAMLparam2(_src, _dst);
+  SchroFrame src;
+  SchroFrame dst;
+  frame_proxy *src_proxies[3];
+  frame_proxy *dst_proxies[3];
+  int filter = Int_val(_filter);
+  int ret = 0;
+  int j;
+
+  schro_frame_init_of_val(&src, _src);
+  schro_frame_init_of_val(&dst, _dst);
+  if (FRAME_FORMAT_IS_PACKED(src.format) || FRAME_FORMAT_IS_PACKED(dst.format) ||
+      FRAME_FORMAT_IS_S16(src.format) || FRAME_FORMAT_IS_S16(dst.format))
+    caml_invalid_argument("Schroedinger.Frame.scale_into");
+
+  /* The planes are kept alive by _src and _dst. */
+  frame_use_val(_src, src_proxies);
+  if (!planes_use(Field(_dst, 0), dst_proxies)) {
+    planes_unuse(src_proxies);
+    caml_failwith("invalid frame dimension");
+  }
+  caml_enter_blocking_section();
+  for (j=0; j<3 && ret == 0; j++)
+    ret = schroedinger_kernels_scale_plane(src.components[j].data,
+                                           src.components[j].stride,
+                                           src.components[j].width,
+                                           src.components[j].height,
+                                           dst.components[j].data,
+                                           dst.components[j].stride,
+                                           dst.components[j].width,
+                                           dst.components[j].height,
+                                           filter);
+  planes_unuse(src_proxies);
+  planes_unuse(dst_proxies);
+  caml_leave_blocking_section();
+
+  if (ret < 0)
+    caml_raise_out_of_memory();
+
+  CAMLreturn(Val_unit);
 }
 
-/* Takes internal_video_format */
-static SchroVideoFormat *schro_video_format_of_val(value v, SchroVideoFormat *format)
+/* The module may be initialised again, possibly from several
+ * domains at once, by programs linking it more than once. */
+static pthread_once_t schro_init_once = PTHREAD_ONCE_INIT;
+
+CAMLprim value caml_schroedinger_init(value unit)
+{
+  CAMLparam0();
+  CAMLlocal1(ba);
+
+  pthread_once(&schro_init_once, schro_init);
+
+  /* The operations of frame planes are copied from a Bigarray's. */
+  ba = caml_ba_alloc_dims(CAML_BA_UINT8 | CAML_BA_C_LAYOUT, 1, NULL, (intnat)1);
+  pthread_mutex_lock(&frame_ba_ops_lock);
+  if (!frame_ba_ops_ready) {
+    frame_ba_ops = *Custom_ops_val(ba);
+    frame_ba_ops.finalize = frame_ba_finalize;
+    frame_ba_ops_ready = 1;
+  }
+  pthread_mutex_unlock(&frame_ba_ops_lock);
+
+  CAMLreturn(Val_unit);
+}
+
+/* Constants, in the order of the constructors
+ * of the corresponding OCaml types. */
+
+static const int frame_formats[] = {
+  SCHRO_FRAME_FORMAT_U8_422,
+  SCHRO_FRAME_FORMAT_U8_444,
+  SCHRO_FRAME_FORMAT_U8_420,
+  FRAME_FORMAT_PACKED | PACKED_YUYV,
+  FRAME_FORMAT_PACKED | PACKED_UYVY,
+  FRAME_FORMAT_PACKED | PACKED_V210,
+  FRAME_FORMAT_PACKED | PACKED_RGBA,
+  SCHRO_FRAME_FORMAT_S16_422,
+  SCHRO_FRAME_FORMAT_S16_444,
+  SCHRO_FRAME_FORMAT_S16_420
+};
+
+static const int video_formats[] = {
+  SCHRO_VIDEO_FORMAT_CUSTOM,
+  SCHRO_VIDEO_FORMAT_QSIF,
+  SCHRO_VIDEO_FORMAT_QCIF,
+  SCHRO_VIDEO_FORMAT_SIF,
+  SCHRO_VIDEO_FORMAT_CIF,
+  SCHRO_VIDEO_FORMAT_4SIF,
+  SCHRO_VIDEO_FORMAT_4CIF,
+  SCHRO_VIDEO_FORMAT_SD480I_60,
+  SCHRO_VIDEO_FORMAT_SD576I_50,
+  SCHRO_VIDEO_FORMAT_HD720P_60,
+  SCHRO_VIDEO_FORMAT_HD720P_50,
+  SCHRO_VIDEO_FORMAT_HD1080I_60,
+  SCHRO_VIDEO_FORMAT_HD1080I_50,
+  SCHRO_VIDEO_FORMAT_HD1080P_60,
+  SCHRO_VIDEO_FORMAT_HD1080P_50,
+  SCHRO_VIDEO_FORMAT_DC2K_24,
+  SCHRO_VIDEO_FORMAT_DC4K_24
+};
+
+static const int chroma_formats[] = {
+  SCHRO_CHROMA_422,
+  SCHRO_CHROMA_444,
+  SCHRO_CHROMA_420
+};
+
+static const int colour_primaries[] = {
+  SCHRO_COLOUR_PRIMARY_HDTV,
+  SCHRO_COLOUR_PRIMARY_SDTV_525,
+  SCHRO_COLOUR_PRIMARY_SDTV_625,
+  SCHRO_COLOUR_PRIMARY_CINEMA
+};
+
+static const int colour_matrices[] = {
+  SCHRO_COLOUR_MATRIX_HDTV,
+  SCHRO_COLOUR_MATRIX_SDTV,
+  SCHRO_COLOUR_MATRIX_REVERSIBLE
+};
+
+static const int transfer_functions[] = {
+  SCHRO_TRANSFER_CHAR_TV_GAMMA,
+  SCHRO_TRANSFER_CHAR_EXTENDED_GAMUT,
+  SCHRO_TRANSFER_CHAR_LINEAR,
+  SCHRO_TRANSFER_CHAR_DCI_GAMMA
+};
+
+static const int signal_ranges[] = {
+  SCHRO_SIGNAL_RANGE_CUSTOM,
+  SCHRO_SIGNAL_RANGE_8BIT_FULL,
+  SCHRO_SIGNAL_RANGE_8BIT_VIDEO,
+  SCHRO_SIGNAL_RANGE_10BIT_VIDEO,
+  SCHRO_SIGNAL_RANGE_12BIT_VIDEO
+};
+
+#define N_ELEMS(a) (sizeof(a)/sizeof(a[0]))
+
+static value value_of_int_array(const int *a, int len)
+{
+  value ret = caml_alloc_tuple(len);
+  int i;
+  for (i=0; i<len; i++)
+    Store_field(ret, i, Val_int(a[i]));
+  return ret;
+}
+
+/* Returns all the constants at once, as an array of int arrays. */
+CAMLprim value ocaml_schroedinger_defines(value unit)
+{
+  CAMLparam0();
+  CAMLlocal2(ret, tmp);
+
+  ret = caml_alloc_tuple(7);
+  tmp = value_of_int_array(frame_formats, N_ELEMS(frame_formats));
+  Store_field(ret, 0, tmp);
+  tmp = value_of_int_array(video_formats, N_ELEMS(video_formats));
+  Store_field(ret, 1, tmp);
+  tmp = value_of_int_array(chroma_formats, N_ELEMS(chroma_formats));
+  Store_field(ret, 2, tmp);
+  tmp = value_of_int_array(colour_primaries, N_ELEMS(colour_primaries));
+  Store_field(ret, 3, tmp);
+  tmp = value_of_int_array(colour_matrices, N_ELEMS(colour_matrices));
+  Store_field(ret, 4, tmp);
+  tmp = value_of_int_array(transfer_functions, N_ELEMS(transfer_functions));
+  Store_field(ret, 5, tmp);
+  tmp = value_of_int_array(signal_ranges, N_ELEMS(signal_ranges));
+  Store_field(ret, 6, tmp);
+
+  CAMLreturn(ret);
+}
+
+/* Takes internal_video_format */
+static SchroVideoFormat *schro_video_format_of_val(value v, SchroVideoFormat *format)
 {
   int i = 0;
   format->index = Int_val(Field(v, i++));
@@ -440,126 +1163,94 @@ CAMLprim value ocaml_schroedinger_get_default_video_format(value index)
 
 /* Settings */
 
-static double double_of_setting(value n, value v)
-{
-  char *s = String_val(n);
-
-  if (!strcmp(s,"rate_control")) return (double)Int_val(v);
-  if (!strcmp(s,"bitrate")) return (double)Int_val(v);
-  if (!strcmp(s,"max_bitrate")) return (double)Int_val(v);
-  if (!strcmp(s,"min_bitrate")) return (double)Int_val(v);
-  if (!strcmp(s,"buffer_size")) return (double)Int_val(v);
-  if (!strcmp(s,"buffer_level")) return (double)Int_val(v);
-  if (!strcmp(s,"noise_threshold")) return Double_val(v);
-  if (!strcmp(s,"gop_structure")) return (double)Int_val(v);
-  if (!strcmp(s,"queue_depth")) return (double)Int_val(v);
-  if (!strcmp(s,"perceptual_weighting")) return (double)Int_val(v);
-  if (!strcmp(s,"perceptual_distance")) return Double_val(v);
-  if (!strcmp(s,"filtering")) return (double)Int_val(v);
-  if (!strcmp(s,"filter_value")) return Double_val(v);
-  if (!strcmp(s,"profile")) return (double)Int_val(v);
-  if (!strcmp(s,"level")) return (double)Int_val(v);
-  if (!strcmp(s,"au_distance")) return (double)Int_val(v);
-  if (!strcmp(s,"enable_psnr")) return (double)Bool_val(v);
-  if (!strcmp(s,"enable_ssim")) return (double)Bool_val(v);
-  if (!strcmp(s,"ref_distance")) return (double)Int_val(v);
-  if (!strcmp(s,"transform_depth")) return (double)Int_val(v);
-  if (!strcmp(s,"intra_wavelet")) return (double)Int_val(v);
-  if (!strcmp(s,"inter_wavelet")) return (double)Int_val(v);
-  if (!strcmp(s,"mv_precision")) return (double)Int_val(v);
-  if (!strcmp(s,"motion_block_size")) return (double)Int_val(v);
-  if (!strcmp(s,"motion_block_overlap")) return (double)Int_val(v);
-  if (!strcmp(s,"interlaced_coding")) return (double)Bool_val(v);
-  if (!strcmp(s,"enable_internal_testing")) return (double)Bool_val(v);
-  if (!strcmp(s,"enable_noarith")) return (double)Bool_val(v);
-  if (!strcmp(s,"enable_md5")) return (double)Bool_val(v);
-  if (!strcmp(s,"enable_fullscan_estimation")) return (double)Bool_val(v);
-  if (!strcmp(s,"enable_hierarchical_estimation")) return (double)Bool_val(v);
-  if (!strcmp(s,"enable_zero_estimation")) return (double)Bool_val(v);
-  if (!strcmp(s,"enable_phasecorr_estimation")) return (double)Bool_val(v);
-  if (!strcmp(s,"enable_bigblock_estimation")) return (double)Bool_val(v);
-  if (!strcmp(s,"horiz_slices")) return (double)Int_val(v);
-  if (!strcmp(s,"vert_slices")) return (double)Int_val(v);
-  if (!strcmp(s,"magic_dc_metric_offset")) return Double_val(v);
-  if (!strcmp(s,"magic_subband0_lambda_scale")) return Double_val(v);
-  if (!strcmp(s,"magic_chroma_lambda_scale")) return Double_val(v);
-  if (!strcmp(s,"magic_nonref_lambda_scale")) return Double_val(v);
-  if (!strcmp(s,"magic_allocation_scale")) return Double_val(v);
-  if (!strcmp(s,"magic_keyframe_weight")) return Double_val(v);
-  if (!strcmp(s,"magic_scene_change_threshold")) return Double_val(v);
-  if (!strcmp(s,"magic_inter_p_weight")) return Double_val(v);
-  if (!strcmp(s,"magic_inter_b_weight")) return Double_val(v);
-  if (!strcmp(s,"magic_mc_bailout_limit")) return Double_val(v);
-  if (!strcmp(s,"magic_bailout_weight")) return Double_val(v);
-  if (!strcmp(s,"magic_error_power")) return Double_val(v);
-  if (!strcmp(s,"magic_mc_lambda")) return Double_val(v);
-  if (!strcmp(s,"magic_subgroup_length")) return Double_val(v);
-  if (!strcmp(s,"magic_lambda")) return Double_val(v);
-
-  caml_failwith("unknown value");
-}
-
-static value setting_of_double(value n, double v)
-{
-  char *s = String_val(n);
-
-  if (!strcmp(s,"rate_control")) return Val_int((int)v);
-  if (!strcmp(s,"bitrate")) return Val_int((int)v);
-  if (!strcmp(s,"max_bitrate")) return Val_int((int)v);
-  if (!strcmp(s,"min_bitrate")) return Val_int((int)v);
-  if (!strcmp(s,"buffer_size")) return Val_int((int)v);
-  if (!strcmp(s,"buffer_level")) return Val_int((int)v);
-  if (!strcmp(s,"noise_threshold")) return caml_copy_double(v);
-  if (!strcmp(s,"gop_structure")) return Val_int((int)v);
-  if (!strcmp(s,"queue_depth")) return Val_int((int)v);
-  if (!strcmp(s,"perceptual_weighting")) return Val_int((int)v);
-  if (!strcmp(s,"perceptual_distance")) return caml_copy_double(v);
-  if (!strcmp(s,"filtering")) return Val_int((int)v);
-  if (!strcmp(s,"filter_value")) return caml_copy_double(v);
-  if (!strcmp(s,"profile")) return Val_int((int)v);
-  if (!strcmp(s,"level")) return Val_int((int)v);
-  if (!strcmp(s,"au_distance")) return Val_int((int)v);
-  if (!strcmp(s,"enable_psnr")) return Val_bool((int)v);
-  if (!strcmp(s,"enable_ssim")) return Val_bool((int)v);
-  if (!strcmp(s,"ref_distance")) return Val_int((int)v);
-  if (!strcmp(s,"transform_depth")) return Val_int((int)v);
-  if (!strcmp(s,"intra_wavelet")) return Val_int((int)v);
-  if (!strcmp(s,"inter_wavelet")) return Val_int((int)v);
-  if (!strcmp(s,"mv_precision")) return Val_int((int)v);
-  if (!strcmp(s,"motion_block_size")) return Val_int((int)v);
-  if (!strcmp(s,"motion_block_overlap")) return Val_int((int)v);
-  if (!strcmp(s,"interlaced_coding")) return Val_bool((int)v);
-  if (!strcmp(s,"enable_internal_testing")) return Val_bool((int)v);
-  if (!strcmp(s,"enable_noarith")) return Val_bool((int)v);
-  if (!strcmp(s,"enable_md5")) return Val_bool((int)v);
-  if (!strcmp(s,"enable_fullscan_estimation")) return Val_bool((int)v);
-  if (!strcmp(s,"enable_hierarchical_estimation")) return Val_bool((int)v);
-  if (!strcmp(s,"enable_zero_estimation")) return Val_bool((int)v);
-  if (!strcmp(s,"enable_phasecorr_estimation")) return Val_bool((int)v);
-  if (!strcmp(s,"enable_bigblock_estimation")) return Val_bool((int)v);
-  if (!strcmp(s,"horiz_slices")) return Val_int((int)v);
-  if (!strcmp(s,"vert_slices")) return Val_int((int)v);
-  if (!strcmp(s,"magic_dc_metric_offset")) return caml_copy_double(v);
-  if (!strcmp(s,"magic_subband0_lambda_scale")) return caml_copy_double(v);
-  if (!strcmp(s,"magic_chroma_lambda_scale")) return caml_copy_double(v);
-  if (!strcmp(s,"magic_nonref_lambda_scale")) return caml_copy_double(v);
-  if (!strcmp(s,"magic_allocation_scale")) return caml_copy_double(v);
-  if (!strcmp(s,"magic_keyframe_weight")) return caml_copy_double(v);
-  if (!strcmp(s,"magic_scene_change_threshold")) return caml_copy_double(v);
-  if (!strcmp(s,"magic_inter_p_weight")) return caml_copy_double(v);
-  if (!strcmp(s,"magic_inter_b_weight")) return caml_copy_double(v);
-  if (!strcmp(s,"magic_mc_bailout_limit")) return caml_copy_double(v);
-  if (!strcmp(s,"magic_bailout_weight")) return caml_copy_double(v);
-  if (!strcmp(s,"magic_error_power")) return caml_copy_double(v);
-  if (!strcmp(s,"magic_mc_lambda")) return caml_copy_double(v);
-  if (!strcmp(s,"magic_subgroup_length")) return caml_copy_double(v);
-  if (!strcmp(s,"magic_lambda")) return caml_copy_double(v);
-
-  caml_failwith("unknown value");
-}
+/* Encoder settings, in the order of the fields of Encoder.settings.
+ * Settings are referred to by their index in this table. */
+static const char *setting_names[] = {
+  "rate_control",
+  "bitrate",
+  "max_bitrate",
+  "min_bitrate",
+  "buffer_size",
+  "buffer_level",
+  "noise_threshold",
+  "gop_structure",
+  "queue_depth",
+  "perceptual_weighting",
+  "perceptual_distance",
+  "filtering",
+  "filter_value",
+  "profile",
+  "level",
+  "au_distance",
+  "enable_psnr",
+  "enable_ssim",
+  "ref_distance",
+  "transform_depth",
+  "intra_wavelet",
+  "inter_wavelet",
+  "mv_precision",
+  "motion_block_size",
+  "motion_block_overlap",
+  "interlaced_coding",
+  "enable_internal_testing",
+  "enable_noarith",
+  "enable_md5",
+  "enable_fullscan_estimation",
+  "enable_hierarchical_estimation",
+  "enable_zero_estimation",
+  "enable_phasecorr_estimation",
+  "enable_bigblock_estimation",
+  "horiz_slices",
+  "vert_slices",
+  "magic_dc_metric_offset",
+  "magic_subband0_lambda_scale",
+  "magic_chroma_lambda_scale",
+  "magic_nonref_lambda_scale",
+  "magic_allocation_scale",
+  "magic_keyframe_weight",
+  "magic_scene_change_threshold",
+  "magic_inter_p_weight",
+  "magic_inter_b_weight",
+  "magic_mc_bailout_limit",
+  "magic_bailout_weight",
+  "magic_error_power",
+  "magic_mc_lambda",
+  "magic_subgroup_length",
+  "magic_lambda",
+};
+
+#define N_SETTINGS ((int)(sizeof(setting_names)/sizeof(char *)))
 
 /* Encoding */
 
+/* Counters returned by Encoder.stats. A pipeline's thread may update
+ * them while they are read, hence the relaxed atomic accesses. */
+typedef struct {
+  ogg_int64_t frames_pushed;
+  /* Picture packets. */
+  ogg_int64_t frames_out;
+  ogg_int64_t packets;
+  ogg_int64_t bytes;
+  ogg_int64_t sync_points;
+  /* Time spent in schro_encoder_wait, in nanoseconds. */
+  ogg_int64_t wait;
+  ogg_int64_t max_wait;
+} enc_stats;
+
+#define Stat_add(enc, field, n) __atomic_add_fetch(&(enc)->stats.field, (n), __ATOMIC_RELAXED)
+#define Stat_get(enc, field) __atomic_load_n(&(enc)->stats.field, __ATOMIC_RELAXED)
+
+/* Raise a counter to n if it is lower. Another thread may update it
+ * meanwhile, so the new value is only stored if it is still lower. */
+static void stat_max(ogg_int64_t *field, ogg_int64_t n)
+{
+  ogg_int64_t cur = __atomic_load_n(field, __ATOMIC_RELAXED);
+
+  while (n > cur &&
+         !__atomic_compare_exchange_n(field, &cur, n, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
 typedef struct {
   SchroEncoder *encoder;
   SchroVideoFormat format;
@@ -569,17 +1260,71 @@ typedef struct {
   ogg_int64_t presented_frame_number;
   ogg_int64_t encoded_frame_number;
   ogg_int64_t packet_no;
+  /* One reference for the OCaml value and one per pipeline. */
+  int refs;
+  /* Encoded sequence header, NULL until needed. */
+  SchroBuffer *header;
+  /* ENC_PIPELINE while a pipeline's thread drives the encoder,
+   * ENC_PARALLEL while a parallel encoder uses its settings. */
+  int pipelined;
+  enc_stats stats;
 } encoder_t;
 
-#define Schro_enc_val(v) (*((encoder_t**)Data_custom_val(v)))
+#define ENC_PIPELINE 1
+#define ENC_PARALLEL 2
 
-static void finalize_schro_enc(value v)
+/* NULL once the encoder has been closed. */
+#define Schro_enc_ptr(v) (*((encoder_t**)Data_custom_val(v)))
+
+static encoder_t *enc_of_val(value v)
+{
+  encoder_t *enc = Schro_enc_ptr(v);
+  if (enc == NULL)
+    raise_named_exn(EXN_CLOSED);
+  return enc;
+}
+
+#define Schro_enc_val(v) enc_of_val(v)
+
+/* Encoders driven by a pipeline or a parallel encoder must only be
+ * used through it. Their video format, statistics and cached sequence
+ * header can still be read, and the settings of a parallel encoder's
+ * one changed: owner is the one allowed besides OCaml code. */
+static encoder_t *enc_of_val_unpipelined(value v, int owner)
+{
+  encoder_t *enc = enc_of_val(v);
+  int pipelined = __atomic_load_n(&enc->pipelined, __ATOMIC_SEQ_CST);
+  if (pipelined != 0 && pipelined != owner)
+    caml_invalid_argument(pipelined == ENC_PIPELINE ?
+                          "Schroedinger.Encoder: encoder used by a pipeline" :
+                          "Schroedinger.Encoder: encoder used by a parallel encoder");
+  return enc;
+}
+
+#define Schro_enc_direct_val(v) enc_of_val_unpipelined(v, 0)
+#define Schro_enc_settings_val(v) enc_of_val_unpipelined(v, ENC_PARALLEL)
+
+/* Planar format of the frames given to the encoder. */
+#define Enc_frame_format(enc) \
+  schro_frame_format_of_chroma_format((enc)->format.chroma_format)
+
+static void enc_unref(encoder_t *enc)
 {
-  encoder_t *enc = Schro_enc_val(v);
+  if (__atomic_sub_fetch(&enc->refs, 1, __ATOMIC_SEQ_CST) > 0)
+    return;
+  if (enc->header != NULL)
+    schro_buffer_unref(enc->header);
   schro_encoder_free(enc->encoder);
   free(enc);
 }
 
+static void finalize_schro_enc(value v)
+{
+  if (Schro_enc_ptr(v) != NULL)
+    enc_unref(Schro_enc_ptr(v));
+  release_pinned_values();
+}
+
 static struct custom_operations schro_enc_ops =
 {
   "ocaml_schro_enc",
@@ -593,7 +1338,15 @@ static struct custom_operations schro_enc_ops =
 /* Granule shift is always 22 for Dirac */
 static const int DIRAC_GRANULE_SHIFT = 22;
 
-static void calculate_granulepos(encoder_t *dd, ogg_packet *op, ogg_int64_t *pts)
+/* An encoded packet. */
+typedef struct {
+  SchroBuffer *buffer;
+  ogg_int64_t granulepos;
+  ogg_int64_t packetno;
+  int is_sync_point;
+} enc_packet;
+
+static void calculate_granulepos(encoder_t *dd, enc_packet *op, ogg_int64_t *pts)
 {
     ogg_int64_t granulepos_hi;
     ogg_int64_t granulepos_low;
@@ -627,6 +1380,13 @@ static void calculate_granulepos(encoder_t *dd, ogg_packet *op, ogg_int64_t *pts
     op->packetno = dd->packet_no++;
     if (update == 1)
       dd->encoded_frame_number++;
+
+    Stat_add(dd, packets, 1);
+    Stat_add(dd, bytes, op->buffer->length);
+    if (op->is_sync_point)
+      Stat_add(dd, sync_points, 1);
+    if (SCHRO_PARSE_CODE_IS_PICTURE(op->buffer->data[4]))
+      Stat_add(dd, frames_out, 1);
 }
 
 CAMLprim value ocaml_schroedinger_frames_of_granulepos(value _granulepos, value interlaced)
@@ -680,6 +1440,10 @@ encoder_t *create_enc(SchroVideoFormat *format)
   enc->distance_from_sync = 0;
   enc->packet_no = 0;
   enc->is_sync_point = 1;
+  enc->refs = 1;
+  enc->header = NULL;
+  enc->pipelined = 0;
+  memset(&enc->stats, 0, sizeof(enc_stats));
   memcpy(&enc->format,format,sizeof(SchroVideoFormat));
  
   SchroEncoder *encoder = schro_encoder_new();
@@ -714,8 +1478,45 @@ CAMLprim value ocaml_schroedinger_create_enc(value f)
   schro_video_format_of_val(f, &format);
   encoder_t *enc = create_enc(&format);
 
-  ret = caml_alloc_custom(&schro_enc_ops, sizeof(encoder_t*), 1, 0);
-  Schro_enc_val(ret) = enc;
+  ret = caml_alloc_custom_mem(&schro_enc_ops, sizeof(encoder_t*),
+                              ENC_FOOTPRINT_FRAMES*video_format_frame_size(&format));
+  Schro_enc_ptr(ret) = enc;
+
+  CAMLreturn(ret);
+}
+
+/* Encoders shared with a pipeline or parallel encoder
+ * are only freed once these are done with them. */
+CAMLprim value ocaml_schroedinger_enc_close(value _enc)
+{
+  CAMLparam1(_enc);
+  encoder_t *enc = Schro_enc_ptr(_enc);
+
+  if (enc != NULL) {
+    Schro_enc_ptr(_enc) = NULL;
+    enc_unref(enc);
+    release_pinned_values();
+  }
+
+  CAMLreturn(Val_unit);
+}
+
+CAMLprim value ocaml_schroedinger_enc_stats(value _enc)
+{
+  CAMLparam1(_enc);
+  CAMLlocal1(ret);
+  encoder_t *enc = Schro_enc_val(_enc);
+  ogg_int64_t pushed = Stat_get(enc, frames_pushed);
+  ogg_int64_t out = Stat_get(enc, frames_out);
+
+  ret = caml_alloc_tuple(7);
+  Store_field(ret, 0, Val_long(pushed));
+  Store_field(ret, 1, Val_long(Stat_get(enc, packets)));
+  Store_field(ret, 2, Val_long(Stat_get(enc, bytes)));
+  Store_field(ret, 3, Val_long(Stat_get(enc, sync_points)));
+  Store_field(ret, 4, Val_long(pushed > out ? pushed - out : 0));
+  Store_field(ret, 5, caml_copy_double(Stat_get(enc, wait) / 1e9));
+  Store_field(ret, 6, caml_copy_double(Stat_get(enc, max_wait) / 1e9));
 
   CAMLreturn(ret);
 }
@@ -727,18 +1528,31 @@ CAMLprim value ocaml_schroedinger_enc_video_format(value _enc)
   CAMLreturn(value_of_video_format(&enc->format));
 }
 
-/* This function allocates op->packet */
-int enc_get_packet(encoder_t *enc, ogg_packet *op)
+/* In nanoseconds. */
+static ogg_int64_t monotonic_time(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ogg_int64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+/* Wrapper around schro_encoder_wait/pull. Returns 1 and fills p
+ * when a packet is available, 0 when the encoder needs a new frame,
+ * 2 when it should be called again and -1 at the end of the stream.
+ * The caller owns p->buffer. */
+static int enc_get_packet_nolock(encoder_t *enc, enc_packet *p)
 {
-  SchroStateEnum state;
   SchroBuffer *enc_buf;
-  int dts;
+  int dts, state;
   void *priv = NULL;
- 
-  /* Add a new ogg packet */
-  caml_enter_blocking_section();
+  ogg_int64_t wait = monotonic_time();
+
   state = schro_encoder_wait(enc->encoder);
-  caml_leave_blocking_section();
+
+  wait = monotonic_time() - wait;
+  Stat_add(enc, wait, wait);
+  stat_max(&enc->stats.max_wait, wait);
+
   switch(state)
   {
   case SCHRO_STATE_NEED_FRAME:
@@ -746,10 +1560,7 @@ int enc_get_packet(encoder_t *enc, ogg_packet *op)
   case SCHRO_STATE_END_OF_STREAM:
       return -1;
   case SCHRO_STATE_HAVE_BUFFER:
-      caml_enter_blocking_section();
       enc_buf = schro_encoder_pull_full(enc->encoder, &dts, &priv);
-      caml_enter_blocking_section();
-      op->b_o_s = 0;
       if (SCHRO_PARSE_CODE_IS_SEQ_HEADER(enc_buf->data[4]))
       {
           enc->is_sync_point = 1;
@@ -758,320 +1569,3390 @@ int enc_get_packet(encoder_t *enc, ogg_packet *op)
       {
           enc->is_sync_point = 0;
       }
-      op->e_o_s = 0;
-      op->packet = malloc(enc_buf->length);
-      if (op->packet == NULL) 
-        caml_raise_out_of_memory();
-      memcpy(op->packet, enc_buf->data, enc_buf->length);
-      op->bytes = enc_buf->length;
-
-      calculate_granulepos(enc, op, (ogg_int64_t *)priv);
+      p->buffer = enc_buf;
+      p->is_sync_point = enc->is_sync_point;
+
+      calculate_granulepos(enc, p, (ogg_int64_t *)priv);
       if (priv != NULL)
         free(priv);
-      schro_buffer_unref(enc_buf);
       return 1;
   case SCHRO_STATE_AGAIN:
       return 2;
   default:
-      caml_failwith("unknown encoder state");
+      return -2;
+  }
+}
+
+static int enc_get_packet(encoder_t *enc, enc_packet *p)
+{
+  int ret;
+
+  caml_enter_blocking_section();
+  ret = enc_get_packet_nolock(enc, p);
+  caml_leave_blocking_section();
+  if (ret == -2)
+    caml_failwith("unknown encoder state");
+
+  return ret;
+}
+
+/* Put an encoded packet in the ogg stream and release it. */
+static void enc_packetin(ogg_stream_state *os, enc_packet *p)
+{
+  ogg_packet op;
+
+  op.packet = p->buffer->data;
+  op.bytes = p->buffer->length;
+  op.b_o_s = 0;
+  op.e_o_s = 0;
+  op.granulepos = p->granulepos;
+  op.packetno = p->packetno;
+  ogg_stream_packetin(os, &op);
+  schro_buffer_unref(p->buffer);
+}
+
+static void enc_push_frame(encoder_t *enc, SchroFrame *f)
+{
+  ogg_int64_t *pts = malloc(sizeof(ogg_int64_t));
+  if (pts == NULL)
+  {
+    schro_frame_unref(f);
+    caml_raise_out_of_memory();
   }
+  memcpy(pts,&enc->presentation_frame_number,sizeof(ogg_int64_t));
+ 
+  /* Put the frame into the encoder. */
+  caml_enter_blocking_section();
+  schro_encoder_push_frame_full(enc->encoder, f, pts);
+  caml_leave_blocking_section();
+  enc->presentation_frame_number++;
+  Stat_add(enc, frames_pushed, 1);
 }
 
 CAMLprim value ocaml_schroedinger_enc_eos(value _enc, value _os)
 {
   CAMLparam2(_enc,_os);
-  encoder_t *enc = Schro_enc_val(_enc);
+  encoder_t *enc = Schro_enc_direct_val(_enc);
   ogg_stream_state *os = Stream_state_val(_os);
   ogg_packet op;  
+  enc_packet p;
+  int ret;
+
+  schro_encoder_end_of_stream(enc->encoder);
+  ret = enc_get_packet(enc,&p);
+  while (ret != -1)
+  {
+    if (ret == 1)
+      enc_packetin(os, &p);
+    ret = enc_get_packet(enc,&p);
+  }
+
+  /* Add last packet */
+  op.packet = NULL;
+  op.bytes = 0;
+  op.e_o_s = 1;
+  op.b_o_s = 0;
+  ogg_stream_packetin(os, &op);
+
+  release_pinned_values();
+
+  CAMLreturn(Val_unit);
+}
+
+static void enc_encode_frame(encoder_t *enc, SchroFrame *f, ogg_stream_state *os)
+{
+  enc_packet p;
+  int ret = 2;
+
+  enc_push_frame(enc, f);
+ 
+  while (ret > 0) {
+    ret = enc_get_packet(enc, &p);
+    if (ret == 1)
+      enc_packetin(os, &p);
+  }
+
+  /* Frames released by the encoder in the meantime. */
+  release_pinned_values();
+}
+
+CAMLprim value ocaml_schroedinger_encode_frame(value _enc, value frame, value _os)
+{
+  CAMLparam3(_enc, frame, _os);
+  ogg_stream_state *os = Stream_state_val(_os);
+  encoder_t *enc = Schro_enc_direct_val(_enc);
+
+  enc_encode_frame(enc, schro_frame_of_val(frame, Enc_frame_format(enc)), os);
+
+  CAMLreturn(Val_unit);
+}
+
+CAMLprim value ocaml_schroedinger_encode_frame_nocopy(value _enc, value frame, value _os)
+{
+  CAMLparam3(_enc, frame, _os);
+  ogg_stream_state *os = Stream_state_val(_os);
+  encoder_t *enc = Schro_enc_direct_val(_enc);
+
+  enc_encode_frame(enc, schro_frame_wrap_val(frame, Enc_frame_format(enc)), os);
+
+  CAMLreturn(Val_unit);
+}
+
+/* Encode the same frame with each encoder of encs, putting packets in
+ * the corresponding ogg stream of streams. The frame is converted once
+ * and shared by all the encoders. They are all given the frame before
+ * waiting for any of them, so that they encode concurrently. */
+CAMLprim value ocaml_schroedinger_ladder_encode_frame(value _encs, value _streams, value frame, value _copy)
+{
+  CAMLparam4(_encs, _streams, frame, _copy);
+  int n = Wosize_val(_encs);
+  SchroFrame *f;
+  encoder_t *enc;
+  enc_packet p;
+  int i, ret;
+
+  if (Wosize_val(_streams) != n)
+    caml_invalid_argument("Schroedinger.Encoder.Ladder.encode_frame");
+  if (n == 0)
+    CAMLreturn(Val_unit);
+
+  /* Check all the encoders before pushing the frame to any. */
+  for (i=0; i<n; i++)
+    Schro_enc_direct_val(Field(_encs, i));
+
+  /* All the encoders have the same format. */
+  enc = Schro_enc_val(Field(_encs, 0));
+  f = Bool_val(_copy) ? schro_frame_of_val(frame, Enc_frame_format(enc)) :
+                        schro_frame_wrap_val(frame, Enc_frame_format(enc));
+
+  for (i=0; i<n; i++)
+    enc_push_frame(Schro_enc_val(Field(_encs, i)), schro_frame_ref(f));
+  schro_frame_unref(f);
+
+  for (i=0; i<n; i++)
+  {
+    enc = Schro_enc_val(Field(_encs, i));
+    do {
+      ret = enc_get_packet(enc, &p);
+      if (ret == 1)
+        enc_packetin(Stream_state_val(Field(_streams, i)), &p);
+    } while (ret > 0);
+  }
+
+  release_pinned_values();
+
+  CAMLreturn(Val_unit);
+}
+
+/* Packet API */
+
+CAMLprim value ocaml_schroedinger_enc_push_frame(value _enc, value frame)
+{
+  CAMLparam2(_enc, frame);
+  encoder_t *enc = Schro_enc_direct_val(_enc);
+  enc_push_frame(enc, schro_frame_of_val(frame, Enc_frame_format(enc)));
+  CAMLreturn(Val_unit);
+}
+
+CAMLprim value ocaml_schroedinger_enc_push_frame_nocopy(value _enc, value frame)
+{
+  CAMLparam2(_enc, frame);
+  encoder_t *enc = Schro_enc_direct_val(_enc);
+  enc_push_frame(enc, schro_frame_wrap_val(frame, Enc_frame_format(enc)));
+  release_pinned_values();
+  CAMLreturn(Val_unit);
+}
+
+CAMLprim value ocaml_schroedinger_enc_end_of_stream(value _enc)
+{
+  CAMLparam1(_enc);
+  schro_encoder_end_of_stream(Schro_enc_direct_val(_enc)->encoder);
+  CAMLreturn(Val_unit);
+}
+
+/* Returns Some (data, granulepos, packet_no, sync_point). data points
+ * to p->buffer, owned by a frame_proxy shared with all its views. */
+static value value_of_enc_packet(enc_packet *p)
+{
+  CAMLparam0();
+  CAMLlocal3(ret, packet, tmp);
+  frame_proxy *fp;
+
+  tmp = frame_proxy_array(p->buffer->data, p->buffer->length, CAML_BA_UINT8, 1);
+  fp = frame_proxy_new(NULL, NULL, NULL, NULL);
+  if (fp == NULL) {
+    schro_buffer_unref(p->buffer);
+    caml_raise_out_of_memory();
+  }
+  fp->buffer = p->buffer;
+  Caml_ba_array_val(tmp)->proxy = &fp->proxy;
+  Proxy_ref(&fp->proxy);
+  packet = caml_alloc_tuple(4);
+  Store_field(packet, 0, tmp);
+  tmp = caml_copy_int64(p->granulepos);
+  Store_field(packet, 1, tmp);
+  tmp = caml_copy_int64(p->packetno);
+  Store_field(packet, 2, tmp);
+  Store_field(packet, 3, Val_bool(p->is_sync_point));
+
+  ret = caml_alloc_tuple(1);
+  Store_field(ret, 0, packet);
+
+  CAMLreturn(ret);
+}
+
+/* Returns (data, granulepos, packet_no, sync_point) option. */
+CAMLprim value ocaml_schroedinger_enc_pull_packet(value _enc)
+{
+  CAMLparam1(_enc);
+  encoder_t *enc = Schro_enc_direct_val(_enc);
+  enc_packet p;
+  int state;
+
+  do
+    state = enc_get_packet(enc, &p);
+  while (state == 2);
+
+  release_pinned_values();
+
+  if (state != 1)
+    CAMLreturn(Val_int(0));
+
+  CAMLreturn(value_of_enc_packet(&p));
+}
+
+/* Settings such as the profile and level change the sequence header. */
+static void enc_drop_header(encoder_t *enc)
+{
+  if (enc->header == NULL)
+    return;
+  schro_buffer_unref(enc->header);
+  enc->header = NULL;
+}
+
+/* The sequence header only depends on the video format and the
+ * settings, so it is only encoded once per encoder. */
+static SchroBuffer *enc_sequence_header(encoder_t *enc)
+{
+  if (enc->header == NULL)
+    enc->header = schro_encoder_encode_sequence_header(enc->encoder);
+  if (enc->header == NULL)
+    caml_failwith("schro_encoder_encode_sequence_header");
+  return enc->header;
+}
+
+/* Pipelined encoder. A native thread moves queued frames into the
+ * encoder whenever it accepts one and collects encoded packets in
+ * an output queue. Packet availability is also signaled by making
+ * a pipe readable, so that the application can wait on it along
+ * with its other file descriptors. */
+
+typedef struct pipe_frame {
+  SchroFrame *frame; /* NULL for end of stream. */
+  struct pipe_frame *next;
+} pipe_frame;
+
+typedef struct pipe_packet {
+  enc_packet p;
+  struct pipe_packet *next;
+} pipe_packet;
+
+typedef struct {
+  encoder_t *enc;
+  pthread_t thread;
+  int running;
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  /* Frames not yet accepted by the encoder. */
+  pipe_frame *input;
+  pipe_frame *input_last;
+  int queued;
+  int queue_depth;
+  pipe_packet *output;
+  pipe_packet *output_last;
+  int stop;
+  /* The worker has exited: 1 at the end of
+   * the stream, -1 on encoding error. */
+  int done;
+  /* notify[0] is readable while packets are available. */
+  int notify[2];
+  int notified;
+} pipeline_t;
+
+#define Pipeline_val(v) (*((pipeline_t **)Data_custom_val(v)))
+
+/* Must be called with the pipeline's lock held. */
+static void pipeline_notify(pipeline_t *pl)
+{
+  char c = 0;
+
+  pthread_cond_broadcast(&pl->cond);
+  if (pl->notified)
+    return;
+  if (write(pl->notify[1], &c, 1) == 1)
+    pl->notified = 1;
+}
+
+/* Must be called with the pipeline's lock held. */
+static void pipeline_clear_notify(pipeline_t *pl)
+{
+  char buf[16];
+
+  if (!pl->notified)
+    return;
+  while (read(pl->notify[0], buf, sizeof(buf)) > 0);
+  pl->notified = 0;
+}
+
+static void *pipeline_worker(void *arg)
+{
+  pipeline_t *pl = arg;
+  encoder_t *enc = pl->enc;
+  pipe_frame *in;
+  pipe_packet *out;
+  ogg_int64_t *pts;
+  enc_packet p;
   int ret;
+  int done = 0;
+
+  while (!done) {
+    ret = enc_get_packet_nolock(enc, &p);
+    switch (ret) {
+      case 0:
+        /* The encoder accepts a new frame. */
+        pthread_mutex_lock(&pl->lock);
+        while (pl->input == NULL && !pl->stop)
+          pthread_cond_wait(&pl->cond, &pl->lock);
+        if (pl->stop)
+        {
+          pthread_mutex_unlock(&pl->lock);
+          done = 1;
+          break;
+        }
+        in = pl->input;
+        pl->input = in->next;
+        if (pl->input == NULL)
+          pl->input_last = NULL;
+        if (in->frame != NULL)
+          pl->queued--;
+        /* Room for a new frame. */
+        pthread_cond_broadcast(&pl->cond);
+        pthread_mutex_unlock(&pl->lock);
+
+        if (in->frame == NULL)
+          schro_encoder_end_of_stream(enc->encoder);
+        else
+        {
+          pts = malloc(sizeof(ogg_int64_t));
+          if (pts != NULL)
+            *pts = enc->presentation_frame_number;
+          enc->presentation_frame_number++;
+          Stat_add(enc, frames_pushed, 1);
+          schro_encoder_push_frame_full(enc->encoder, in->frame, pts);
+        }
+        free(in);
+        break;
+      case 1:
+        out = malloc(sizeof(pipe_packet));
+        if (out == NULL)
+        {
+          schro_buffer_unref(p.buffer);
+          done = -1;
+          break;
+        }
+        out->p = p;
+        out->next = NULL;
+        pthread_mutex_lock(&pl->lock);
+        if (pl->output_last == NULL)
+          pl->output = out;
+        else
+          pl->output_last->next = out;
+        pl->output_last = out;
+        pipeline_notify(pl);
+        pthread_mutex_unlock(&pl->lock);
+        break;
+      case 2:
+        break;
+      case -1:
+        done = 1;
+        break;
+      default:
+        done = -1;
+        break;
+    }
+  }
+
+  pthread_mutex_lock(&pl->lock);
+  pl->done = done;
+  pipeline_notify(pl);
+  pthread_mutex_unlock(&pl->lock);
+
+  return NULL;
+}
+
+/* Stop and join the worker. Can be called without the runtime lock. */
+static void pipeline_stop(pipeline_t *pl)
+{
+  if (!pl->running)
+    return;
+  pthread_mutex_lock(&pl->lock);
+  pl->stop = 1;
+  pthread_cond_broadcast(&pl->cond);
+  pthread_mutex_unlock(&pl->lock);
+  pthread_join(pl->thread, NULL);
+  pl->running = 0;
+}
+
+static void finalize_pipeline(value v)
+{
+  pipeline_t *pl = Pipeline_val(v);
+  pipe_frame *in;
+  pipe_packet *out;
+
+  pipeline_stop(pl);
+  while (pl->input != NULL)
+  {
+    in = pl->input;
+    pl->input = in->next;
+    if (in->frame != NULL)
+      schro_frame_unref(in->frame);
+    free(in);
+  }
+  while (pl->output != NULL)
+  {
+    out = pl->output;
+    pl->output = out->next;
+    schro_buffer_unref(out->p.buffer);
+    free(out);
+  }
+  close(pl->notify[0]);
+  close(pl->notify[1]);
+  pthread_cond_destroy(&pl->cond);
+  pthread_mutex_destroy(&pl->lock);
+  __atomic_store_n(&pl->enc->pipelined, 0, __ATOMIC_SEQ_CST);
+  enc_unref(pl->enc);
+  free(pl);
+  release_pinned_values();
+}
+
+static struct custom_operations pipeline_ops =
+{
+  "ocaml_schro_enc_pipeline",
+  finalize_pipeline,
+  custom_compare_default,
+  custom_hash_default,
+  custom_serialize_default,
+  custom_deserialize_default
+};
+
+CAMLprim value ocaml_schroedinger_pipeline_create(value _enc, value _depth)
+{
+  CAMLparam2(_enc, _depth);
+  CAMLlocal1(ret);
+  encoder_t *enc = Schro_enc_direct_val(_enc);
+  pipeline_t *pl;
+
+  if (Int_val(_depth) <= 0)
+    caml_invalid_argument("Schroedinger.Encoder.Pipeline.create");
+
+  /* Encoder.encode_header only reads the cached header
+   * once the pipeline's thread uses the encoder. */
+  enc_sequence_header(enc);
+
+  pl = calloc(1, sizeof(pipeline_t));
+  if (pl == NULL)
+    caml_raise_out_of_memory();
+  if (pipe(pl->notify) != 0)
+  {
+    free(pl);
+    caml_failwith("pipe");
+  }
+  fcntl(pl->notify[0], F_SETFL, O_NONBLOCK);
+  fcntl(pl->notify[1], F_SETFL, O_NONBLOCK);
+  pl->queue_depth = Int_val(_depth);
+  pl->enc = enc;
+  __atomic_add_fetch(&enc->refs, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_init(&pl->lock, NULL);
+  pthread_cond_init(&pl->cond, NULL);
+
+  /* The encoder is accounted by its own value. */
+  ret = caml_alloc_custom_mem(&pipeline_ops, sizeof(pipeline_t*),
+                              pl->queue_depth*video_format_frame_size(&enc->format));
+  Pipeline_val(ret) = pl;
+
+  __atomic_store_n(&enc->pipelined, ENC_PIPELINE, __ATOMIC_SEQ_CST);
+  if (pthread_create(&pl->thread, NULL, pipeline_worker, pl) != 0)
+    caml_failwith("pthread_create");
+  pl->running = 1;
+
+  CAMLreturn(ret);
+}
+
+/* Queue a frame, or the end of the stream if f is NULL. Waits for
+ * some room in the queue when block is not zero. Returns 0 if the
+ * queue is full. Takes ownership of f. */
+static int pipeline_push(pipeline_t *pl, SchroFrame *f, int block)
+{
+  pipe_frame *in = malloc(sizeof(pipe_frame));
+  if (in == NULL)
+  {
+    if (f != NULL)
+      schro_frame_unref(f);
+    caml_raise_out_of_memory();
+  }
+  in->frame = f;
+  in->next = NULL;
+
+  pthread_mutex_lock(&pl->lock);
+  /* The runtime lock must not be taken while holding ours. */
+  while (f != NULL && block && pl->queued >= pl->queue_depth && !pl->done)
+  {
+    pthread_mutex_unlock(&pl->lock);
+    caml_enter_blocking_section();
+    pthread_mutex_lock(&pl->lock);
+    while (pl->queued >= pl->queue_depth && !pl->done)
+      pthread_cond_wait(&pl->cond, &pl->lock);
+    pthread_mutex_unlock(&pl->lock);
+    caml_leave_blocking_section();
+    pthread_mutex_lock(&pl->lock);
+  }
+
+  if (pl->done || (f != NULL && pl->queued >= pl->queue_depth))
+  {
+    pthread_mutex_unlock(&pl->lock);
+    if (f != NULL)
+      schro_frame_unref(f);
+    free(in);
+    return 0;
+  }
+  if (pl->input_last == NULL)
+    pl->input = in;
+  else
+    pl->input_last->next = in;
+  pl->input_last = in;
+  if (f != NULL)
+    pl->queued++;
+  pthread_cond_broadcast(&pl->cond);
+  pthread_mutex_unlock(&pl->lock);
+
+  return 1;
+}
+
+CAMLprim value ocaml_schroedinger_pipeline_push_frame(value _pl, value frame, value _copy, value _block)
+{
+  CAMLparam2(_pl, frame);
+  pipeline_t *pl = Pipeline_val(_pl);
+  SchroFrame *f;
+  int ret;
+
+  f = Bool_val(_copy) ? schro_frame_of_val(frame, Enc_frame_format(pl->enc)) :
+                        schro_frame_wrap_val(frame, Enc_frame_format(pl->enc));
+  ret = pipeline_push(pl, f, Bool_val(_block));
+  release_pinned_values();
+
+  CAMLreturn(Val_bool(ret));
+}
+
+CAMLprim value ocaml_schroedinger_pipeline_end_of_stream(value _pl)
+{
+  CAMLparam1(_pl);
+  pipeline_push(Pipeline_val(_pl), NULL, 0);
+  CAMLreturn(Val_unit);
+}
+
+/* Same as enc_pull_packet. When block is not zero, waits for
+ * a packet until the end of the stream. */
+CAMLprim value ocaml_schroedinger_pipeline_poll_packet(value _pl, value _block)
+{
+  CAMLparam2(_pl, _block);
+  pipeline_t *pl = Pipeline_val(_pl);
+  pipe_packet *out;
+  enc_packet p;
+  int done;
+
+  if (Bool_val(_block))
+  {
+    caml_enter_blocking_section();
+    pthread_mutex_lock(&pl->lock);
+    while (pl->output == NULL && !pl->done)
+      pthread_cond_wait(&pl->cond, &pl->lock);
+    pthread_mutex_unlock(&pl->lock);
+    caml_leave_blocking_section();
+  }
+
+  pthread_mutex_lock(&pl->lock);
+  out = pl->output;
+  if (out != NULL)
+  {
+    pl->output = out->next;
+    if (pl->output == NULL)
+    {
+      pl->output_last = NULL;
+      pipeline_clear_notify(pl);
+    }
+  }
+  done = pl->done;
+  pthread_mutex_unlock(&pl->lock);
+
+  release_pinned_values();
+
+  if (out == NULL)
+  {
+    if (done < 0)
+      caml_failwith("unknown encoder state");
+    CAMLreturn(Val_int(0));
+  }
+
+  p = out->p;
+  free(out);
+  CAMLreturn(value_of_enc_packet(&p));
+}
+
+CAMLprim value ocaml_schroedinger_pipeline_notify_fd(value _pl)
+{
+  CAMLparam1(_pl);
+  CAMLreturn(Val_int(Pipeline_val(_pl)->notify[0]));
+}
+
+CAMLprim value ocaml_schroedinger_encode_header(value _enc, value _os)
+{
+  CAMLparam2(_enc, _os);
+  ogg_stream_state *os = Stream_state_val(_os);
+  encoder_t *enc = Schro_enc_val(_enc); 
+  SchroBuffer *header = enc_sequence_header(enc);
+  ogg_packet op;
+
+  op.packet = header->data;
+  op.b_o_s = 1;
+  op.e_o_s = 0;
+  op.bytes = header->length;
+  op.granulepos = 0;
+  op.packetno = 0;
+
+  /* Put the packet in the ogg stream. */
+  ogg_stream_packetin(os, &op);
+
+  CAMLreturn(Val_unit);
+}
+
+CAMLprim value ocaml_schroedinger_set_setting(value _enc, value _n, value _val)
+{
+  CAMLparam3(_enc,_n,_val);
+  encoder_t *enc = Schro_enc_settings_val(_enc);
+  int n = Int_val(_n);
+
+  if (n < 0 || n >= N_SETTINGS)
+    caml_invalid_argument("Schroedinger.Encoder.set");
+  schro_encoder_setting_set_double(enc->encoder,setting_names[n],Double_val(_val));
+  enc_drop_header(enc);
+
+  CAMLreturn(Val_unit);
+}
+
+CAMLprim value ocaml_schroedinger_get_setting(value _enc, value _n)
+{
+  CAMLparam2(_enc,_n);
+  encoder_t *enc = Schro_enc_val(_enc);
+  int n = Int_val(_n);
+
+  if (n < 0 || n >= N_SETTINGS)
+    caml_invalid_argument("Schroedinger.Encoder.get");
+
+  CAMLreturn(caml_copy_double(schro_encoder_setting_get_double(enc->encoder,setting_names[n])));
+}
+
+/* Settings are passed as a float array in the table's order. */
+CAMLprim value ocaml_schroedinger_set_settings(value _enc, value _settings)
+{
+  CAMLparam2(_enc,_settings);
+  encoder_t *enc = Schro_enc_settings_val(_enc);
+  int n;
+
+  if (Wosize_val(_settings) / Double_wosize != N_SETTINGS)
+    caml_invalid_argument("Schroedinger.Encoder.set_settings");
+
+  for (n=0; n<N_SETTINGS; n++)
+    schro_encoder_setting_set_double(enc->encoder,setting_names[n],Double_field(_settings,n));
+  enc_drop_header(enc);
+
+  CAMLreturn(Val_unit);
+}
+
+CAMLprim value ocaml_schroedinger_get_settings(value _enc)
+{
+  CAMLparam1(_enc);
+  CAMLlocal1(ret);
+  encoder_t *enc = Schro_enc_val(_enc);
+  int n;
+
+  ret = caml_alloc(N_SETTINGS * Double_wosize, Double_array_tag);
+  for (n=0; n<N_SETTINGS; n++)
+    Store_double_field(ret, n, schro_encoder_setting_get_double(enc->encoder,setting_names[n]));
+
+  CAMLreturn(ret);
+}
+
+/* Sequence header parsing */
+
+/* This reads the sequence header following the Dirac specification
+ * (section 10), without creating a decoder or copying data. */
+
+#define PARSE_INFO_SIZE 13
+
+typedef struct {
+  const uint8_t *data;
+  long len;
+  long pos; /* In bits. */
+  int overrun;
+} bit_reader;
+
+static int read_bool(bit_reader *br)
+{
+  int ret;
+  if (br->pos >= br->len*8)
+  {
+    /* Stops read_uint. */
+    br->overrun = 1;
+    return 1;
+  }
+  ret = (br->data[br->pos>>3] >> (7 - (br->pos & 7))) & 1;
+  br->pos++;
+  return ret;
+}
+
+/* Interleaved exp-Golomb code. */
+static unsigned int read_uint(bit_reader *br)
+{
+  unsigned int v = 1;
+  while (!read_bool(br))
+  {
+    if (v >= 1<<30)
+    {
+      br->overrun = 1;
+      return 0;
+    }
+    v <<= 1;
+    if (read_bool(br))
+      v++;
+  }
+  return v - 1;
+}
+
+/* Returns the length of the sequence header parse unit
+ * starting at data, or 0 if there is none. */
+static long sequence_header_length(const uint8_t *data, long len)
+{
+  long header_len;
+
+  if (len < PARSE_INFO_SIZE ||
+      data[0] != 'B' ||
+      data[1] != 'B' ||
+      data[2] != 'C' ||
+      data[3] != 'D' ||
+      !SCHRO_PARSE_CODE_IS_SEQ_HEADER(data[4]))
+    return 0;
+
+  header_len = ((uint32_t)data[5] << 24) +
+               ((uint32_t)data[6] << 16) +
+               ((uint32_t)data[7] << 8) +
+                (uint32_t)data[8];
+
+  if (header_len <= PARSE_INFO_SIZE || header_len > len)
+    return 0;
+
+  return header_len;
+}
+
+/* Fill format with the sequence header starting at data.
+ * Returns 0 if the header is invalid. */
+static int parse_sequence_header(const uint8_t *data, long len, SchroVideoFormat *format)
+{
+  bit_reader br;
+  unsigned int index;
+  long header_len = sequence_header_length(data, len);
+
+  if (header_len == 0)
+    return 0;
+
+  br.data = data + PARSE_INFO_SIZE;
+  br.len = header_len - PARSE_INFO_SIZE;
+  br.pos = 0;
+  br.overrun = 0;
+
+  /* Parse parameters: version, profile and level. */
+  read_uint(&br);
+  read_uint(&br);
+  read_uint(&br);
+  read_uint(&br);
+
+  /* Base video format, then source parameters overriding it. */
+  index = read_uint(&br);
+  if (index > SCHRO_VIDEO_FORMAT_DC4K_24)
+    return 0;
+  schro_video_format_set_std_video_format(format, index);
+
+  /* Frame size */
+  if (read_bool(&br))
+  {
+    format->width = read_uint(&br);
+    format->height = read_uint(&br);
+  }
+
+  /* Chroma sampling format */
+  if (read_bool(&br))
+  {
+    index = read_uint(&br);
+    if (index > SCHRO_CHROMA_420)
+      return 0;
+    format->chroma_format = index;
+  }
+
+  /* Scan format */
+  if (read_bool(&br))
+    format->interlaced = read_uint(&br);
+
+  /* Frame rate */
+  if (read_bool(&br))
+  {
+    index = read_uint(&br);
+    if (index == 0)
+    {
+      format->frame_rate_numerator = read_uint(&br);
+      format->frame_rate_denominator = read_uint(&br);
+    }
+    else if (index <= 10)
+      schro_video_format_set_std_frame_rate(format, index);
+    else
+      return 0;
+  }
+
+  /* Pixel aspect ratio */
+  if (read_bool(&br))
+  {
+    index = read_uint(&br);
+    if (index == 0)
+    {
+      format->aspect_ratio_numerator = read_uint(&br);
+      format->aspect_ratio_denominator = read_uint(&br);
+    }
+    else if (index <= 6)
+      schro_video_format_set_std_aspect_ratio(format, index);
+    else
+      return 0;
+  }
+
+  /* Clean area */
+  if (read_bool(&br))
+  {
+    format->clean_width = read_uint(&br);
+    format->clean_height = read_uint(&br);
+    format->left_offset = read_uint(&br);
+    format->top_offset = read_uint(&br);
+  }
+
+  /* Signal range */
+  if (read_bool(&br))
+  {
+    index = read_uint(&br);
+    if (index == 0)
+    {
+      format->luma_offset = read_uint(&br);
+      format->luma_excursion = read_uint(&br);
+      format->chroma_offset = read_uint(&br);
+      format->chroma_excursion = read_uint(&br);
+    }
+    else if (index <= SCHRO_SIGNAL_RANGE_12BIT_VIDEO)
+      schro_video_format_set_std_signal_range(format, index);
+    else
+      return 0;
+  }
+
+  /* Colour specification */
+  if (read_bool(&br))
+  {
+    index = read_uint(&br);
+    if (index == 0)
+    {
+      if (read_bool(&br))
+      {
+        index = read_uint(&br);
+        if (index > SCHRO_COLOUR_PRIMARY_CINEMA)
+          return 0;
+        format->colour_primaries = index;
+      }
+      if (read_bool(&br))
+      {
+        index = read_uint(&br);
+        if (index > SCHRO_COLOUR_MATRIX_REVERSIBLE)
+          return 0;
+        format->colour_matrix = index;
+      }
+      if (read_bool(&br))
+      {
+        index = read_uint(&br);
+        if (index > SCHRO_TRANSFER_CHAR_DCI_GAMMA)
+          return 0;
+        format->transfer_function = index;
+      }
+    }
+    else if (index <= 4)
+      schro_video_format_set_std_colour_spec(format, index);
+    else
+      return 0;
+  }
+
+  /* Picture coding mode */
+  format->interlaced_coding = read_uint(&br);
+
+  return !br.overrun;
+}
+
+CAMLprim value ocaml_schroedinger_check_header(value packet)
+{
+  CAMLparam1(packet);
+  ogg_packet *op = Packet_val(packet);
+  CAMLreturn(Val_bool(sequence_header_length(op->packet, op->bytes) > 0));
+}
+
+static value probe(const uint8_t *data, long len)
+{
+  SchroVideoFormat format;
+
+  if (!parse_sequence_header(data, len, &format))
+    raise_named_exn(EXN_INVALID_HEADER);
+
+  return value_of_video_format(&format);
+}
+
+CAMLprim value ocaml_schroedinger_probe(value packet)
+{
+  CAMLparam1(packet);
+  ogg_packet *op = Packet_val(packet);
+  CAMLreturn(probe(op->packet, op->bytes));
+}
+
+CAMLprim value ocaml_schroedinger_probe_data(value _data, value _ofs, value _len)
+{
+  CAMLparam1(_data);
+  struct caml_ba_array *data = Caml_ba_array_val(_data);
+  intnat ofs = Long_val(_ofs);
+  intnat len = Long_val(_len);
+
+  if (ofs < 0 || len < 0 || ofs + len > data->dim[0])
+    caml_invalid_argument("Schroedinger.Decoder.probe_data");
+
+  CAMLreturn(probe((uint8_t *)data->data + ofs, len));
+}
+
+/* GOP parallel encoding. The input is split into groups of pictures
+ * starting with a sync point, each one being encoded by its own
+ * encoder in a thread of a pool. Encoded packets are then put back
+ * in order: picture numbers are shifted by the group's first frame,
+ * intermediate end of sequence parse units are dropped, parse offsets
+ * are linked across groups and granule positions are computed by a
+ * master encoder_t as for a serial encoding. */
+
+typedef enum {
+  GOP_FILLING,
+  GOP_QUEUED,
+  GOP_RUNNING,
+  GOP_DONE,
+  GOP_ERROR
+} gop_state;
+
+typedef struct {
+  SchroBuffer *buffer;
+  ogg_int64_t pts; /* -1 when not a picture. */
+} gop_packet;
+
+typedef struct gop_job {
+  gop_state state;
+  ogg_int64_t first_frame;
+  /* Settings of the master encoder when the group was started. */
+  double settings[N_SETTINGS];
+  SchroFrame **frames;
+  int nframes;
+  int pushed;
+  /* Keep the final end of sequence. */
+  int last;
+  gop_packet *packets;
+  int npackets;
+  int packets_len;
+  /* Next packet to output. */
+  int out;
+  struct gop_job *next;
+} gop_job;
+
+typedef struct {
+  encoder_t *master;
+  int gop_size;
+
+  int nthreads;
+  pthread_t *threads;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  /* Jobs which have not been output yet, in order. */
+  gop_job *jobs;
+  gop_job *jobs_last;
+  /* Job being filled, only used by OCaml. Workers
+   * only look at the other ones. */
+  gop_job *filling;
+  /* Jobs submitted and not output yet, encoded or not. */
+  int pending;
+  int stop;
+  int eos;
+  ogg_int64_t frames;
+  /* Size of the last parse unit output. */
+  uint32_t last_unit;
+} parallel_t;
+
+#define Parallel_val(v) (*((parallel_t **)Data_custom_val(v)))
+
+static uint32_t read32be(const uint8_t *p)
+{
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+         ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static void write32be(uint8_t *p, uint32_t v)
+{
+  p[0] = v >> 24;
+  p[1] = (v >> 16) & 0xff;
+  p[2] = (v >> 8) & 0xff;
+  p[3] = v & 0xff;
+}
+
+/* Shift the picture numbers of the parse units in data and drop end of
+ * sequence units unless keep_eos is set. The previous parse offset of
+ * each kept unit is set from *last_unit, the size of the unit output
+ * before it, which is updated. Returns the new length. */
+static long patch_parse_units(uint8_t *data, long len, uint32_t shift,
+                              int keep_eos, uint32_t *last_unit)
+{
+  long pos = 0;
+  long next;
+  uint8_t code;
+
+  while (pos + PARSE_INFO_SIZE <= len)
+  {
+    code = data[pos+4];
+    next = read32be(data+pos+5);
+    if (next < PARSE_INFO_SIZE || pos + next > len)
+      next = len - pos;
+    if (SCHRO_PARSE_CODE_IS_END_OF_SEQUENCE(code) && !keep_eos)
+    {
+      memmove(data+pos, data+pos+next, len-pos-next);
+      len -= next;
+      continue;
+    }
+    write32be(data+pos+9, *last_unit);
+    *last_unit = next;
+    if (SCHRO_PARSE_CODE_IS_PICTURE(code) && next >= PARSE_INFO_SIZE + 4)
+      write32be(data+pos+PARSE_INFO_SIZE,
+                read32be(data+pos+PARSE_INFO_SIZE) + shift);
+    pos += next;
+  }
+
+  return len;
+}
+
+static int gop_add_packet(gop_job *job, SchroBuffer *buffer, ogg_int64_t pts)
+{
+  gop_packet *packets;
+
+  if (job->npackets == job->packets_len)
+  {
+    packets = realloc(job->packets, (2*job->packets_len+8)*sizeof(gop_packet));
+    if (packets == NULL)
+      return 0;
+    job->packets = packets;
+    job->packets_len = 2*job->packets_len+8;
+  }
+  job->packets[job->npackets].buffer = buffer;
+  job->packets[job->npackets].pts = pts;
+  job->npackets++;
+  return 1;
+}
+
+/* Encode a group with a new encoder. Does not use the OCaml runtime.
+ * Returns 0 on error or if the pool was stopped. */
+static int encode_gop(parallel_t *par, gop_job *job)
+{
+  SchroEncoder *encoder = schro_encoder_new();
+  SchroBuffer *buffer;
+  ogg_int64_t *pts;
+  void *priv;
+  int dts, i;
+  int eos_pushed = 0;
+  int ret = -1;
+
+  if (encoder == NULL)
+    return 0;
+
+  schro_encoder_set_packet_assembly(encoder, TRUE);
+  schro_encoder_set_video_format(encoder, &par->master->format);
+  for (i=0; i<N_SETTINGS; i++)
+    schro_encoder_setting_set_double(encoder, setting_names[i], job->settings[i]);
+  schro_encoder_start(encoder);
+
+  while (ret < 0) {
+    if (__atomic_load_n(&par->stop, __ATOMIC_SEQ_CST))
+    {
+      ret = 0;
+      break;
+    }
+    switch (schro_encoder_wait(encoder)) {
+      case SCHRO_STATE_NEED_FRAME:
+        if (job->pushed < job->nframes)
+        {
+          pts = malloc(sizeof(ogg_int64_t));
+          if (pts != NULL)
+            *pts = job->pushed;
+          schro_encoder_push_frame_full(encoder, job->frames[job->pushed++], pts);
+        }
+        else if (!eos_pushed)
+        {
+          schro_encoder_end_of_stream(encoder);
+          eos_pushed = 1;
+        }
+        else
+          ret = 0;
+        break;
+      case SCHRO_STATE_HAVE_BUFFER:
+        priv = NULL;
+        buffer = schro_encoder_pull_full(encoder, &dts, &priv);
+        if (!gop_add_packet(job, buffer, priv == NULL ? -1 : *(ogg_int64_t *)priv))
+        {
+          schro_buffer_unref(buffer);
+          ret = 0;
+        }
+        if (priv != NULL)
+          free(priv);
+        break;
+      case SCHRO_STATE_AGAIN:
+        break;
+      case SCHRO_STATE_END_OF_STREAM:
+        ret = 1;
+        break;
+      default:
+        ret = 0;
+        break;
+    }
+  }
+
+  schro_encoder_free(encoder);
+  return ret;
+}
+
+static void *parallel_worker(void *arg)
+{
+  parallel_t *par = arg;
+  gop_job *job;
+  int ret;
+
+  pthread_mutex_lock(&par->lock);
+  while (!par->stop) {
+    for (job = par->jobs; job != NULL; job = job->next)
+      if (job->state == GOP_QUEUED)
+        break;
+    if (job == NULL)
+    {
+      pthread_cond_wait(&par->cond, &par->lock);
+      continue;
+    }
+    job->state = GOP_RUNNING;
+    pthread_mutex_unlock(&par->lock);
+
+    ret = encode_gop(par, job);
+
+    pthread_mutex_lock(&par->lock);
+    job->state = ret ? GOP_DONE : GOP_ERROR;
+    pthread_cond_broadcast(&par->cond);
+  }
+  pthread_mutex_unlock(&par->lock);
+
+  return NULL;
+}
+
+static void gop_free(gop_job *job)
+{
+  int i;
+  for (i=job->pushed; i<job->nframes; i++)
+    schro_frame_unref(job->frames[i]);
+  for (i=job->out; i<job->npackets; i++)
+    schro_buffer_unref(job->packets[i].buffer);
+  free(job->frames);
+  free(job->packets);
+  free(job);
+}
+
+static void finalize_parallel(value v)
+{
+  parallel_t *par = Parallel_val(v);
+  gop_job *job;
+  int i;
+
+  pthread_mutex_lock(&par->lock);
+  __atomic_store_n(&par->stop, 1, __ATOMIC_SEQ_CST);
+  pthread_cond_broadcast(&par->cond);
+  pthread_mutex_unlock(&par->lock);
+  for (i=0; i<par->nthreads; i++)
+    pthread_join(par->threads[i], NULL);
+
+  while (par->jobs != NULL)
+  {
+    job = par->jobs;
+    par->jobs = job->next;
+    gop_free(job);
+  }
+  free(par->threads);
+  pthread_cond_destroy(&par->cond);
+  pthread_mutex_destroy(&par->lock);
+  __atomic_store_n(&par->master->pipelined, 0, __ATOMIC_SEQ_CST);
+  enc_unref(par->master);
+  free(par);
+  release_pinned_values();
+}
+
+static struct custom_operations parallel_ops =
+{
+  "ocaml_schro_enc_parallel",
+  finalize_parallel,
+  custom_compare_default,
+  custom_hash_default,
+  custom_serialize_default,
+  custom_deserialize_default
+};
+
+CAMLprim value ocaml_schroedinger_parallel_create(value _enc, value _jobs, value _gop_size)
+{
+  CAMLparam3(_enc, _jobs, _gop_size);
+  CAMLlocal1(ret);
+  encoder_t *enc = Schro_enc_direct_val(_enc);
+  int nthreads = Int_val(_jobs);
+  int gop_size = Int_val(_gop_size);
+  parallel_t *par;
+  int i;
+
+  if (nthreads <= 0)
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads <= 0)
+    nthreads = 1;
+  if (gop_size <= 0)
+    caml_invalid_argument("Schroedinger.Encoder.Parallel.create");
+
+  par = calloc(1, sizeof(parallel_t));
+  if (par == NULL)
+    caml_raise_out_of_memory();
+  par->threads = malloc(nthreads*sizeof(pthread_t));
+  if (par->threads == NULL)
+  {
+    free(par);
+    caml_raise_out_of_memory();
+  }
+  par->gop_size = gop_size;
+  par->master = enc;
+  __atomic_add_fetch(&enc->refs, 1, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&enc->pipelined, ENC_PARALLEL, __ATOMIC_SEQ_CST);
+  pthread_mutex_init(&par->lock, NULL);
+  pthread_cond_init(&par->cond, NULL);
+
+  /* One encoder per thread, and the frames of the jobs. */
+  ret = caml_alloc_custom_mem(&parallel_ops, sizeof(parallel_t*),
+                              (nthreads*ENC_FOOTPRINT_FRAMES + (nthreads+1)*gop_size)*
+                              video_format_frame_size(&enc->format));
+  Parallel_val(ret) = par;
+
+  for (i=0; i<nthreads; i++)
+  {
+    if (pthread_create(&par->threads[i], NULL, parallel_worker, par) != 0)
+      caml_failwith("pthread_create");
+    par->nthreads++;
+  }
+
+  CAMLreturn(ret);
+}
+
+static int parallel_next_packet(parallel_t *par, int block, enc_packet *p);
+
+/* Submit the group being filled, if any. */
+static void parallel_submit(parallel_t *par, int last)
+{
+  gop_job *job = par->filling;
+
+  if (job == NULL)
+    return;
+
+  pthread_mutex_lock(&par->lock);
+  job->state = GOP_QUEUED;
+  job->last = last;
+  par->pending++;
+  pthread_cond_broadcast(&par->cond);
+  pthread_mutex_unlock(&par->lock);
+  par->filling = NULL;
+}
+
+/* Queue a frame. At most nthreads groups are kept besides the one being
+ * filled, counting the encoded ones whose packets have not been output:
+ * before starting a new group, the packets of the oldest ones are put in
+ * os, waiting for them to be encoded. Without os, the caller has to get
+ * them first. */
+static void parallel_push_frame(parallel_t *par, value frame, ogg_stream_state *os)
+{
+  gop_job *job = par->filling;
+  enc_packet p;
+  SchroFrame *f;
+  int i;
+
+  if (par->eos)
+    caml_invalid_argument("Schroedinger.Encoder.Parallel.push_frame");
+
+  if (job == NULL)
+    while (par->pending > par->nthreads)
+    {
+      if (os == NULL)
+        caml_invalid_argument("Schroedinger.Encoder.Parallel.push_frame");
+      if (!parallel_next_packet(par, 1, &p))
+        break;
+      enc_packetin(os, &p);
+    }
+
+  f = schro_frame_of_val(frame, Enc_frame_format(par->master));
+
+  if (job == NULL)
+  {
+    job = calloc(1, sizeof(gop_job));
+    if (job != NULL)
+      job->frames = malloc(par->gop_size*sizeof(SchroFrame *));
+    if (job == NULL || job->frames == NULL)
+    {
+      free(job);
+      schro_frame_unref(f);
+      caml_raise_out_of_memory();
+    }
+    job->state = GOP_FILLING;
+    job->first_frame = par->frames;
+    /* Settings changed with Encoder.set apply from the next group. */
+    for (i=0; i<N_SETTINGS; i++)
+      job->settings[i] = schro_encoder_setting_get_double(par->master->encoder, setting_names[i]);
+    /* Only OCaml adds jobs, workers only look
+     * at them with the lock held. */
+    pthread_mutex_lock(&par->lock);
+    if (par->jobs_last == NULL)
+      par->jobs = job;
+    else
+      par->jobs_last->next = job;
+    par->jobs_last = job;
+    pthread_mutex_unlock(&par->lock);
+    par->filling = job;
+  }
+
+  job->frames[job->nframes++] = f;
+  par->frames++;
+  Stat_add(par->master, frames_pushed, 1);
+
+  if (job->nframes == par->gop_size)
+    parallel_submit(par, 0);
+}
+
+CAMLprim value ocaml_schroedinger_parallel_push_frame(value _par, value frame)
+{
+  CAMLparam2(_par, frame);
+  parallel_push_frame(Parallel_val(_par), frame, NULL);
+  CAMLreturn(Val_unit);
+}
+
+static void parallel_end_of_stream(parallel_t *par)
+{
+  if (par->eos)
+    return;
+  par->eos = 1;
+
+  if (par->filling != NULL)
+    parallel_submit(par, 1);
+  else if (par->jobs_last != NULL)
+    /* Only read by OCaml. */
+    par->jobs_last->last = 1;
+}
+
+CAMLprim value ocaml_schroedinger_parallel_end_of_stream(value _par)
+{
+  CAMLparam1(_par);
+  parallel_end_of_stream(Parallel_val(_par));
+  CAMLreturn(Val_unit);
+}
+
+/* Get the next packet in order. When block is not zero, waits for
+ * the group it belongs to be encoded. Returns 0 if no packet is
+ * available: either the groups being filled or encoded are needed
+ * when not blocking, or the end of the stream has been reached. */
+static int parallel_next_packet(parallel_t *par, int block, enc_packet *p)
+{
+  encoder_t *enc = par->master;
+  gop_job *job;
+  gop_packet *gp;
+  gop_state state;
+  ogg_int64_t pts;
+  long len;
+
+  while (1) {
+    job = par->jobs;
+    if (job == NULL || job == par->filling)
+      return 0;
+
+    pthread_mutex_lock(&par->lock);
+    state = job->state;
+    pthread_mutex_unlock(&par->lock);
+
+    if (state == GOP_QUEUED || state == GOP_RUNNING)
+    {
+      if (!block)
+        return 0;
+      caml_enter_blocking_section();
+      pthread_mutex_lock(&par->lock);
+      while (job->state == GOP_QUEUED || job->state == GOP_RUNNING)
+        pthread_cond_wait(&par->cond, &par->lock);
+      pthread_mutex_unlock(&par->lock);
+      caml_leave_blocking_section();
+      continue;
+    }
+
+    if (state == GOP_ERROR)
+      caml_failwith("unknown encoder state");
+
+    if (job->out == job->npackets)
+    {
+      pthread_mutex_lock(&par->lock);
+      par->jobs = job->next;
+      if (par->jobs == NULL)
+        par->jobs_last = NULL;
+      par->pending--;
+      pthread_mutex_unlock(&par->lock);
+      gop_free(job);
+      continue;
+    }
+
+    /* The last packet of a group is its end of sequence, which
+     * is only kept at the end of the stream. Wait until we know. */
+    if (job->out == job->npackets - 1 && job->next == NULL && !par->eos)
+      return 0;
+
+    gp = &job->packets[job->out++];
+    len = patch_parse_units(gp->buffer->data, gp->buffer->length,
+                            job->first_frame, job->last, &par->last_unit);
+    if (len == 0)
+    {
+      schro_buffer_unref(gp->buffer);
+      continue;
+    }
+    gp->buffer->length = len;
+
+    enc->is_sync_point = SCHRO_PARSE_CODE_IS_SEQ_HEADER(gp->buffer->data[4]);
+    p->buffer = gp->buffer;
+    p->is_sync_point = enc->is_sync_point;
+    pts = job->first_frame + gp->pts;
+    calculate_granulepos(enc, p, gp->pts < 0 ? NULL : &pts);
+
+    return 1;
+  }
+}
+
+CAMLprim value ocaml_schroedinger_parallel_poll_packet(value _par, value _block)
+{
+  CAMLparam2(_par, _block);
+  enc_packet p;
+
+  if (!parallel_next_packet(Parallel_val(_par), Bool_val(_block), &p))
+    CAMLreturn(Val_int(0));
+
+  CAMLreturn(value_of_enc_packet(&p));
+}
+
+CAMLprim value ocaml_schroedinger_parallel_encode_frame(value _par, value frame, value _os)
+{
+  CAMLparam3(_par, frame, _os);
+  parallel_t *par = Parallel_val(_par);
+  ogg_stream_state *os = Stream_state_val(_os);
+  enc_packet p;
+
+  parallel_push_frame(par, frame, os);
+  while (parallel_next_packet(par, 0, &p))
+    enc_packetin(os, &p);
+
+  CAMLreturn(Val_unit);
+}
+
+CAMLprim value ocaml_schroedinger_parallel_eos(value _par, value _os)
+{
+  CAMLparam2(_par, _os);
+  parallel_t *par = Parallel_val(_par);
+  ogg_stream_state *os = Stream_state_val(_os);
+  ogg_packet op;
+  enc_packet p;
+
+  parallel_end_of_stream(par);
+  while (parallel_next_packet(par, 1, &p))
+    enc_packetin(os, &p);
+
+  /* Add last packet */
+  op.packet = NULL;
+  op.bytes = 0;
+  op.e_o_s = 1;
+  op.b_o_s = 0;
+  ogg_stream_packetin(os, &op);
+
+  CAMLreturn(Val_unit);
+}
+
+/* Decoder */
+
+/* Output frames are taken from a per-decoder pool. Decoded frames are
+ * handed to OCaml as Bigarrays pointing to the pooled memory, sharing
+ * a frame_proxy which puts the frame back in the pool once no plane is
+ * reachable anymore. */
+
+/* Frames kept by the pool. When they are all in use, for instance
+ * because OCaml holds on to many decoded frames, further frames are
+ * allocated outside of the pool and freed once they are collected. */
+#define POOL_SIZE 16
+
+typedef enum {
+  SLOT_FREE,
+  SLOT_DECODING,
+  SLOT_EXPOSED
+} slot_state;
+
+struct pool_slot {
+  SchroFrame *frame;
+  slot_state state;
+};
+
+struct frame_pool {
+  /* One reference for the decoder and one per exposed frame. */
+  int refs;
+  pool_slot slots[POOL_SIZE];
+  /* Frames may be taken from a decoding thread
+   * while exposed ones are finalized by OCaml. */
+  pthread_mutex_t lock;
+};
+
+static frame_pool *pool_create(void)
+{
+  frame_pool *pool = calloc(1, sizeof(frame_pool));
+  if (pool == NULL)
+    caml_raise_out_of_memory();
+  pool->refs = 1;
+  pthread_mutex_init(&pool->lock, NULL);
+  return pool;
+}
+
+static void pool_ref(frame_pool *pool)
+{
+  pthread_mutex_lock(&pool->lock);
+  pool->refs++;
+  pthread_mutex_unlock(&pool->lock);
+}
+
+static void pool_unref(frame_pool *pool)
+{
+  int i, refs;
+
+  pthread_mutex_lock(&pool->lock);
+  refs = --pool->refs;
+  pthread_mutex_unlock(&pool->lock);
+  if (refs > 0)
+    return;
+
+  for (i=0; i<POOL_SIZE; i++)
+    if (pool->slots[i].frame != NULL)
+      schro_frame_unref(pool->slots[i].frame);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool);
+}
+
+/* Get a free frame for the given format and dimensions, allocating
+ * a new one if none is available. The returned frame holds a new
+ * reference. Returns NULL when out of memory. Does not use the
+ * OCaml runtime. */
+static SchroFrame *pool_get(frame_pool *pool, SchroFrameFormat format, int width, int height)
+{
+  SchroFrame *ret = NULL;
+  pool_slot *slot = NULL;
+  int i;
+
+  pthread_mutex_lock(&pool->lock);
+
+  for (i=0; i<POOL_SIZE; i++)
+  {
+    if (pool->slots[i].state != SLOT_FREE)
+      continue;
+    if (pool->slots[i].frame != NULL &&
+        pool->slots[i].frame->format == format &&
+        pool->slots[i].frame->width == width &&
+        pool->slots[i].frame->height == height)
+    {
+      slot = &pool->slots[i];
+      slot->state = SLOT_DECODING;
+      ret = schro_frame_ref(slot->frame);
+      goto done;
+    }
+    if (slot == NULL)
+      slot = &pool->slots[i];
+  }
+
+  /* The pool is full. */
+  if (slot == NULL)
+  {
+    pthread_mutex_unlock(&pool->lock);
+    return schro_frame_alloc(format, width, height);
+  }
+
+  /* Free slot with a frame of the wrong size, drop it. */
+  if (slot->frame != NULL)
+  {
+    schro_frame_unref(slot->frame);
+    slot->frame = NULL;
+  }
+  slot->frame = schro_frame_alloc(format, width, height);
+  if (slot->frame == NULL)
+    goto done;
+  slot->state = SLOT_DECODING;
+  ret = schro_frame_ref(slot->frame);
+
+done:
+  pthread_mutex_unlock(&pool->lock);
+  return ret;
+}
+
+/* Set the state of the slot holding frame. Returns
+ * the slot, or NULL if frame is not pooled. */
+static pool_slot *pool_mark(frame_pool *pool, SchroFrame *frame, slot_state state)
+{
+  pool_slot *ret = NULL;
+  int i;
+
+  pthread_mutex_lock(&pool->lock);
+  for (i=0; i<POOL_SIZE; i++)
+    if (pool->slots[i].frame == frame)
+    {
+      pool->slots[i].state = state;
+      ret = &pool->slots[i];
+      break;
+    }
+  pthread_mutex_unlock(&pool->lock);
+
+  return ret;
+}
+
+static void pool_put(frame_pool *pool, pool_slot *slot)
+{
+  pthread_mutex_lock(&pool->lock);
+  slot->state = SLOT_FREE;
+  pthread_mutex_unlock(&pool->lock);
+}
+
+/* Expose the frame's planes without copying them. The
+ * frame's reference is taken over by the planes. */
+static value val_of_schro_frame_nocopy(frame_pool *pool, SchroFrame *frame)
+{
+  CAMLparam0();
+  CAMLlocal2(ret, planes);
+  pool_slot *slot;
+  frame_proxy *fp;
+
+  planes = frame_proxy_planes(frame);
+
+  slot = pool_mark(pool, frame, SLOT_EXPOSED);
+  if (slot != NULL) {
+    /* The pool keeps its own reference. */
+    schro_frame_unref(frame);
+    pool_ref(pool);
+    fp = frame_proxy_new(pool, slot, NULL, NULL);
+  } else
+    fp = frame_proxy_new(NULL, NULL, frame, NULL);
+  if (fp == NULL) {
+    if (slot != NULL) {
+      pool_put(pool, slot);
+      pool_unref(pool);
+    } else
+      schro_frame_unref(frame);
+    caml_raise_out_of_memory();
+  }
+  frame_proxy_attach(planes, fp);
+
+  ret = caml_alloc_tuple(4);
+  Store_field (ret, 0, planes);
+  Store_field (ret, 1, Val_int(frame->width));
+  Store_field (ret, 2, Val_int(frame->height));
+  Store_field (ret, 3, Val_int(frame->format));
+
+  CAMLreturn(ret);
+}
+
+typedef struct {
+  SchroDecoder *decoder;
+  frame_pool *pool;
+  /* Output pictures given to the decoder and not pulled yet. */
+  int queued;
+  int eos_pushed;
+  /* Output S16 frames instead of U8 ones. */
+  int s16;
+} decoder_t;
+
+/* NULL once the decoder has been closed. */
+#define Schro_dec_ptr(v) (*((decoder_t **)Data_custom_val(v)))
+
+static decoder_t *dec_of_val(value v)
+{
+  decoder_t *dec = Schro_dec_ptr(v);
+  if (dec == NULL)
+    raise_named_exn(EXN_CLOSED);
+  return dec;
+}
+
+#define Schro_dec_val(v) dec_of_val(v)
+
+static decoder_t *dec_new(void)
+{
+  decoder_t *dec = malloc(sizeof(decoder_t));
+  if (dec == NULL)
+    caml_raise_out_of_memory();
+  dec->pool = pool_create();
+  dec->decoder = schro_decoder_new();
+  dec->eos_pushed = 0;
+  dec->queued = 0;
+  dec->s16 = 0;
+  return dec;
+}
+
+static void dec_free(decoder_t *dec)
+{
+  schro_decoder_free(dec->decoder);
+  pool_unref(dec->pool);
+  free(dec);
+}
+
+static void finalize_schro_dec(value v)
+{
+  if (Schro_dec_ptr(v) != NULL)
+    dec_free(Schro_dec_ptr(v));
+}
+
+static struct custom_operations schro_dec_ops =
+{
+  "ocaml_schro_dec",
+  finalize_schro_dec,
+  custom_compare_default,
+  custom_hash_default,
+  custom_serialize_default,
+  custom_deserialize_default
+};
+
+/* mem is the decoder's footprint, when known. */
+static value alloc_dec(mlsize_t mem)
+{
+  value ret;
+  decoder_t *dec = dec_new();
+
+  ret = caml_alloc_custom_mem(&schro_dec_ops, sizeof(decoder_t*), sizeof(decoder_t) + mem);
+  Schro_dec_ptr(ret) = dec;
+
+  return ret;
+}
+
+CAMLprim value ocaml_schroedinger_create_dec(value packet1, value packet2)
+{
+  CAMLparam2(packet1, packet2);
+  CAMLlocal1(ret);
+  ogg_packet *op1 = Packet_val(packet1);
+  ogg_packet *op2 = Packet_val(packet2);
+  SchroVideoFormat format;
+  mlsize_t mem = 0;
+  decoder_t *dec;
+
+  if (sequence_header_length(op1->packet, op1->bytes) == 0)
+    raise_named_exn(EXN_INVALID_HEADER);
+  if (parse_sequence_header(op1->packet, op1->bytes, &format))
+    mem = DEC_FOOTPRINT_FRAMES*video_format_frame_size(&format);
+
+  ret = alloc_dec(mem);
+  dec = Schro_dec_val(ret);
+  schro_decoder_autoparse_push(dec->decoder, schro_buffer_of_ogg_packet(op1));
+  if (op2->bytes > 0)
+    schro_decoder_autoparse_push(dec->decoder, schro_buffer_of_ogg_packet(op2));
+
+  CAMLreturn(ret);
+}
+
+CAMLprim value ocaml_schroedinger_create_dec_raw(value unit)
+{
+  CAMLparam0();
+  CAMLreturn(alloc_dec(0));
+}
+
+CAMLprim value ocaml_schroedinger_decoder_close(value _dec)
+{
+  CAMLparam1(_dec);
+  decoder_t *dec = Schro_dec_ptr(_dec);
+
+  if (dec != NULL) {
+    Schro_dec_ptr(_dec) = NULL;
+    dec_free(dec);
+    release_pinned_values();
+  }
+
+  CAMLreturn(Val_unit);
+}
+
+CAMLprim value ocaml_schroedinger_decoder_get_format(value dec)
+{
+  CAMLparam1(dec);
+  CAMLlocal1(ret);
+  SchroDecoder *decoder = Schro_dec_val(dec)->decoder;
+  SchroVideoFormat *format = schro_decoder_get_video_format(decoder);
+  ret = value_of_video_format(format);
+  free(format);
+  CAMLreturn(ret);
+}
+
+/* Must be set before decoding any frame. */
+CAMLprim value ocaml_schroedinger_decoder_set_s16(value dec, value s16)
+{
+  Schro_dec_val(dec)->s16 = Bool_val(s16);
+  return Val_unit;
+}
+
+CAMLprim value ocaml_schroedinger_decoder_s16(value dec)
+{
+  return Val_bool(Schro_dec_val(dec)->s16);
+}
+
+CAMLprim value ocaml_schroedinger_decoder_get_picture_number(value dec)
+{
+  CAMLparam1(dec);
+  SchroDecoder *decoder = Schro_dec_val(dec)->decoder;
+  CAMLreturn(Val_int(schro_decoder_get_picture_number(decoder)));
+}
+
+/* Drop the decoder's state, for instance after seeking. Decoding
+ * restarts at the next sequence header. */
+CAMLprim value ocaml_schroedinger_decoder_reset(value _dec)
+{
+  CAMLparam1(_dec);
+  decoder_t *dec = Schro_dec_val(_dec);
+
+  caml_enter_blocking_section();
+  schro_decoder_reset(dec->decoder);
+  caml_leave_blocking_section();
+  dec->eos_pushed = 0;
+  /* Queued pictures are dropped with the decoder's state. */
+  dec->queued = 0;
+
+  CAMLreturn(Val_unit);
+}
+
+typedef enum {
+  DEC_FRAME,
+  DEC_REPEAT,
+  DEC_NEED_DATA,
+  DEC_EOS,
+  DEC_OUT_OF_SYNC,
+  DEC_ERROR,
+  DEC_OUT_OF_MEMORY
+} dec_status;
+
+/* Format of the output pictures, or -1 for invalid chroma formats. */
+static int dec_output_format(int chroma_format, int s16)
+{
+  switch (chroma_format) {
+    case SCHRO_CHROMA_444:
+    case SCHRO_CHROMA_422:
+    case SCHRO_CHROMA_420:
+      return s16 ? schro_s16_frame_format_of_chroma_format(chroma_format)
+                 : schro_frame_format_of_chroma_format(chroma_format);
+    default:
+      return -1;
+  }
+}
+
+/* Run the decoder until a frame is available and store it in frame.
+ * Input is taken from os, or only from previously pushed data if os
+ * is NULL. When target is not NULL and no other output picture is
+ * queued, a reference to target is handed to the decoder as the next
+ * output picture instead of a pooled frame, and target_queued is set.
+ * Errors are returned rather than raised, so that the caller can
+ * take care of target first. */
+static dec_status dec_decode_frame(decoder_t *dec, ogg_stream_state *os, SchroFrame *target, int *target_queued, SchroFrame **frame)
+{
+  SchroDecoder *decoder = dec->decoder;
+  SchroVideoFormat *format;
+  int frame_format;
+  SchroFrame *out;
+  ogg_packet op;
+  int state, err;
+
+  while (1) {
+    /* Check what the decoder wants now. */
+    caml_enter_blocking_section();
+    state = schro_decoder_autoparse_wait(decoder);
+    caml_leave_blocking_section();
+    switch (state) {
+      case SCHRO_DECODER_FIRST_ACCESS_UNIT:
+      case SCHRO_DECODER_NEED_BITS:
+        /* Grap a packet */
+        err = os == NULL ? 0 : ogg_stream_packetout(os,&op);
+        if (err == 0 && os != NULL && os->e_o_s && !dec->eos_pushed)
+        {
+          /* No more packets: let the decoder output
+           * its remaining pictures. */
+          dec->eos_pushed = 1;
+          caml_enter_blocking_section();
+          schro_decoder_autoparse_push_end_of_sequence(decoder);
+          caml_leave_blocking_section();
+          break;
+        }
+        if (err == 0) 
+          return DEC_NEED_DATA;
+        if (err == -1)
+          return DEC_OUT_OF_SYNC;
+        /* Feed the decoder */
+        caml_enter_blocking_section();
+        schro_decoder_autoparse_push(decoder,schro_buffer_of_ogg_packet(&op));
+        caml_leave_blocking_section();
+        break;
+      case SCHRO_DECODER_NEED_FRAME:
+        format = schro_decoder_get_video_format(decoder);
+        frame_format = dec_output_format(format->chroma_format, dec->s16);
+        if (frame_format < 0)
+        {
+          free(format);
+          return DEC_ERROR;
+        }
+        if (target != NULL && !*target_queued && dec->queued == 0 &&
+            target->format == frame_format &&
+            target->width == format->width &&
+            target->height == format->height)
+        {
+          free(format);
+          schro_decoder_add_output_picture(decoder, schro_frame_ref(target));
+          *target_queued = 1;
+          dec->queued++;
+          break;
+        }
+        out = pool_get(dec->pool, frame_format, format->width, format->height);
+        free(format);
+        if (out == NULL)
+          return DEC_OUT_OF_MEMORY;
+        schro_decoder_add_output_picture(decoder, out);
+        dec->queued++;
+        break;
+      case SCHRO_DECODER_OK:
+        caml_enter_blocking_section();
+        *frame = schro_decoder_pull(decoder);
+        caml_leave_blocking_section();
+        dec->queued--;
+        if ((*frame)->width == 0 || (*frame)->height == 0) {
+          pool_mark(dec->pool, *frame, SLOT_FREE);
+          schro_frame_unref(*frame);
+          *frame = NULL;
+          return DEC_REPEAT;
+        }
+        return DEC_FRAME;
+      case SCHRO_DECODER_EOS:
+        return DEC_EOS;
+      /* TODO: proper error raising.. */
+      case SCHRO_DECODER_STALLED: 
+      case SCHRO_DECODER_WAIT:
+      case SCHRO_DECODER_ERROR:
+      default:
+        return DEC_ERROR;
+      }
+  }
+}
+
+/* Exceptions raised by all the decoding functions. */
+static void dec_raise_error(dec_status status)
+{
+  switch (status) {
+    case DEC_OUT_OF_SYNC:
+      raise_named_exn(EXN_OGG_OUT_OF_SYNC);
+    case DEC_ERROR:
+      raise_named_exn(EXN_ERROR);
+    case DEC_OUT_OF_MEMORY:
+      caml_raise_out_of_memory();
+    default:
+      break;
+  }
+}
+
+/* Exceptions raised by the functions returning a frame. */
+static void dec_raise_status(dec_status status)
+{
+  dec_raise_error(status);
+  switch (status) {
+    case DEC_REPEAT:
+      raise_named_exn(EXN_SKIP);
+    case DEC_NEED_DATA:
+    case DEC_EOS:
+      raise_named_exn(EXN_OGG_NOT_ENOUGH_DATA);
+    default:
+      break;
+  }
+}
+
+static value dec_frame_value(decoder_t *dec, SchroFrame *frame)
+{
+  return val_of_schro_frame_nocopy(dec->pool, frame);
+}
+
+/* Returns the internal_result value for status. */
+static value dec_result_value(decoder_t *dec, dec_status status, SchroFrame *frame)
+{
+  CAMLparam0();
+  CAMLlocal2(ret, tmp);
+
+  dec_raise_error(status);
+  switch (status) {
+    case DEC_FRAME:
+      tmp = dec_frame_value(dec, frame);
+      ret = caml_alloc(1, 0);
+      Store_field(ret, 0, tmp);
+      break;
+    case DEC_REPEAT:
+      ret = Val_int(0);
+      break;
+    case DEC_NEED_DATA:
+      ret = Val_int(1);
+      break;
+    case DEC_EOS:
+    default:
+      ret = Val_int(2);
+      break;
+  }
+
+  CAMLreturn(ret);
+}
+
+CAMLprim value ocaml_schroedinger_decoder_decode_frame(value _dec, value _os)
+{
+  CAMLparam2(_dec, _os);
+  decoder_t *dec = Schro_dec_val(_dec);
+  SchroFrame *frame;
+  dec_status status = dec_decode_frame(dec, Stream_state_val(_os), NULL, NULL, &frame);
+  dec_raise_status(status);
+  CAMLreturn(dec_frame_value(dec, frame));
+}
+
+CAMLprim value ocaml_schroedinger_decoder_decode(value _dec, value _os)
+{
+  CAMLparam2(_dec, _os);
+  decoder_t *dec = Schro_dec_val(_dec);
+  SchroFrame *frame = NULL;
+  dec_status status = dec_decode_frame(dec, Stream_state_val(_os), NULL, NULL, &frame);
+  CAMLreturn(dec_result_value(dec, status, frame));
+}
+
+CAMLprim value ocaml_schroedinger_decoder_pull_frame(value _dec)
+{
+  CAMLparam1(_dec);
+  CAMLlocal1(ret);
+  decoder_t *dec = Schro_dec_val(_dec);
+  SchroFrame *frame;
+  dec_status status = dec_decode_frame(dec, NULL, NULL, NULL, &frame);
+  release_pinned_values();
+  dec_raise_status(status);
+  ret = dec_frame_value(dec, frame);
+  CAMLreturn(ret);
+}
+
+CAMLprim value ocaml_schroedinger_decoder_pull(value _dec)
+{
+  CAMLparam1(_dec);
+  CAMLlocal1(ret);
+  decoder_t *dec = Schro_dec_val(_dec);
+  SchroFrame *frame = NULL;
+  dec_status status = dec_decode_frame(dec, NULL, NULL, NULL, &frame);
+  release_pinned_values();
+  ret = dec_result_value(dec, status, frame);
+  CAMLreturn(ret);
+}
+
+static void buffer_pinned_free(SchroBuffer *buffer, void *private)
+{
+  unpin_value((pinned_value *)private);
+}
+
+CAMLprim value ocaml_schroedinger_decoder_push_data(value _dec, value _data, value _ofs, value _len)
+{
+  CAMLparam2(_dec, _data);
+  decoder_t *dec = Schro_dec_val(_dec);
+  struct caml_ba_array *data = Caml_ba_array_val(_data);
+  intnat ofs = Long_val(_ofs);
+  intnat len = Long_val(_len);
+  SchroBuffer *buffer;
+
+  if (ofs < 0 || len < 0 || ofs + len > data->dim[0])
+    caml_invalid_argument("Schroedinger.Decoder.push_data");
+
+  buffer = schro_buffer_new_with_data((uint8_t *)data->data + ofs, len);
+  buffer->free = buffer_pinned_free;
+  buffer->priv = pin_value(_data);
+
+  caml_enter_blocking_section();
+  schro_decoder_autoparse_push(dec->decoder, buffer);
+  caml_leave_blocking_section();
+
+  release_pinned_values();
+
+  CAMLreturn(Val_unit);
+}
+
+/* Memory mapped input. Packets of a stream are read from an Ogg file
+ * mapped in memory and handed to the decoder as slices of the mapping,
+ * except for packets spanning several pages, which are reassembled. */
+typedef struct {
+  ogg_uint32_t serial;
+  /* Whether serial is known, otherwise the first Dirac stream is read. */
+  int has_serial;
+  /* Offset of the next page. */
+  intnat next_page;
+  /* Current page: offset of its lacing values, their number, the
+   * index of the next one and the offset of the next packet. */
+  intnat lacing;
+  int segments;
+  int segment;
+  intnat data;
+  /* Drop the end of a packet started before the first page read. */
+  int skip;
+  /* Packet spanning several pages. */
+  unsigned char *partial;
+  size_t partial_len;
+  size_t partial_size;
+  int in_partial;
+} mmap_reader;
+
+#define Mmap_reader_val(v) (*((mmap_reader **)Data_custom_val(v)))
+
+static void mmap_reader_seek(mmap_reader *r, intnat offset)
+{
+  r->next_page = offset;
+  r->segments = 0;
+  r->segment = 0;
+  r->skip = 0;
+  r->partial_len = 0;
+  r->in_partial = 0;
+}
+
+/* Returns the size of the page at p, or 0 if there is no valid
+ * page header there. Checksums are not verified. */
+static intnat mmap_page_size(const unsigned char *buf, intnat n, intnat p)
+{
+  intnat size;
+  int i;
+
+  if (n - p < 27 || memcmp(buf+p, "OggS", 4) || buf[p+4] != 0 || n - p < 27 + buf[p+26])
+    return 0;
+  size = 27 + buf[p+26];
+  for (i=0; i<buf[p+26]; i++)
+    size += buf[p+27+i];
+  return n - p < size ? 0 : size;
+}
+
+static int mmap_reader_append(mmap_reader *r, const unsigned char *data, size_t len)
+{
+  unsigned char *tmp;
+  size_t size;
+
+  if (r->partial_len + len > r->partial_size) {
+    size = 2*(r->partial_len + len);
+    tmp = realloc(r->partial, size);
+    if (tmp == NULL)
+      return -1;
+    r->partial = tmp;
+    r->partial_size = size;
+  }
+  memcpy(r->partial + r->partial_len, data, len);
+  r->partial_len += len;
+  return 0;
+}
+
+/* Returns 1 with a packet of len bytes at ofs in buf, 2 with a packet
+ * reassembled in r->partial, 0 at the end of the file or -1 when out
+ * of memory. */
+static int mmap_reader_next(mmap_reader *r, const unsigned char *buf, intnat n,
+                            intnat *ofs, intnat *len)
+{
+  const unsigned char *p;
+  intnat page, size;
+  int lace;
+
+  while (1) {
+    /* Find the next page of the stream. */
+    while (r->segment >= r->segments) {
+      if (r->next_page >= n)
+        return 0;
+      page = r->next_page;
+      size = mmap_page_size(buf, n, page);
+      if (size == 0) {
+        /* Look for the next capture pattern. */
+        p = memchr(buf + page + 1, 'O', n - page - 1);
+        while (p != NULL && (n - (p - buf) < 4 || memcmp(p, "OggS", 4)))
+          p = memchr(p + 1, 'O', n - (p - buf) - 1);
+        r->next_page = p == NULL ? n : p - buf;
+        continue;
+      }
+      r->next_page += size;
+      if (!r->has_serial) {
+        if ((buf[page+5] & 1) || size < 27 + buf[page+26] + PARSE_INFO_SIZE ||
+            memcmp(buf + page + 27 + buf[page+26], "BBCD", 4))
+          continue;
+        r->serial = read32le(buf + page + 14);
+        r->has_serial = 1;
+      }
+      if (read32le(buf + page + 14) != r->serial)
+        continue;
+      r->lacing = page + 27;
+      r->segments = buf[page+26];
+      r->segment = 0;
+      r->data = page + 27 + r->segments;
+      if (buf[page+5] & 1) {
+        if (!r->in_partial)
+          r->skip = 1;
+      } else {
+        /* The end of a reassembled packet was lost. */
+        r->skip = 0;
+        r->partial_len = 0;
+        r->in_partial = 0;
+      }
+    }
+
+    /* Segments of the next packet on this page. */
+    *ofs = r->data;
+    *len = 0;
+    do {
+      lace = buf[r->lacing + r->segment++];
+      *len += lace;
+    } while (lace == 255 && r->segment < r->segments);
+    r->data += *len;
+
+    if (r->skip) {
+      if (lace < 255)
+        r->skip = 0;
+      continue;
+    }
+    if (lace == 255 || r->in_partial) {
+      if (mmap_reader_append(r, buf + *ofs, *len) < 0)
+        return -1;
+      r->in_partial = (lace == 255);
+      if (r->in_partial)
+        continue;
+      *len = r->partial_len;
+      return 2;
+    }
+    if (*len > 0)
+      return 1;
+  }
+}
+
+static void finalize_mmap_reader(value v)
+{
+  mmap_reader *r = Mmap_reader_val(v);
+  free(r->partial);
+  free(r);
+}
+
+static struct custom_operations mmap_reader_ops =
+{
+  "ocaml_schro_mmap_reader",
+  finalize_mmap_reader,
+  custom_compare_default,
+  custom_hash_default,
+  custom_serialize_default,
+  custom_deserialize_default
+};
+
+CAMLprim value ocaml_schroedinger_mmap_reader_create(value serial)
+{
+  CAMLparam1(serial);
+  CAMLlocal1(ret);
+  mmap_reader *r = malloc(sizeof(mmap_reader));
+  if (r == NULL)
+    caml_raise_out_of_memory();
+
+  /* serial is an option: None reads the first Dirac stream. */
+  r->has_serial = Is_block(serial);
+  r->serial = r->has_serial ? Serial_val(Field(serial, 0)) : 0;
+  r->partial = NULL;
+  r->partial_size = 0;
+  mmap_reader_seek(r, 0);
+  ret = caml_alloc_custom_mem(&mmap_reader_ops, sizeof(mmap_reader*), sizeof(mmap_reader));
+  Mmap_reader_val(ret) = r;
+
+  CAMLreturn(ret);
+}
+
+CAMLprim value ocaml_schroedinger_mmap_reader_serial(value _r)
+{
+  CAMLparam1(_r);
+  mmap_reader *r = Mmap_reader_val(_r);
+  if (!r->has_serial)
+    caml_raise_not_found();
+  CAMLreturn(Val_serial(r->serial));
+}
+
+/* offset must be the offset of a page, such as a sync point's. */
+CAMLprim value ocaml_schroedinger_mmap_reader_seek(value _r, value offset)
+{
+  mmap_reader_seek(Mmap_reader_val(_r), Int64_val(offset));
+  return Val_unit;
+}
+
+static void buffer_malloc_free(SchroBuffer *buffer, void *private)
+{
+  free(private);
+}
+
+/* Push the next packet of the stream to the decoder.
+ * Returns false at the end of the file. */
+CAMLprim value ocaml_schroedinger_mmap_reader_push(value _r, value _data, value _dec)
+{
+  CAMLparam3(_r, _data, _dec);
+  mmap_reader *r = Mmap_reader_val(_r);
+  struct caml_ba_array *data = Caml_ba_array_val(_data);
+  decoder_t *dec = Schro_dec_val(_dec);
+  SchroBuffer *buffer;
+  intnat ofs, len;
+  int ret;
+
+  ret = mmap_reader_next(r, data->data, data->dim[0], &ofs, &len);
+  if (ret < 0)
+    caml_raise_out_of_memory();
+  if (ret == 0)
+    CAMLreturn(Val_false);
+
+  if (ret == 1) {
+    buffer = schro_buffer_new_with_data((uint8_t *)data->data + ofs, len);
+    buffer->free = buffer_pinned_free;
+    buffer->priv = pin_value(_data);
+  } else {
+    /* The reassembled packet is given to the decoder. */
+    buffer = schro_buffer_new_with_data(r->partial, len);
+    buffer->free = buffer_malloc_free;
+    buffer->priv = r->partial;
+    r->partial = NULL;
+    r->partial_len = 0;
+    r->partial_size = 0;
+  }
+
+  caml_enter_blocking_section();
+  schro_decoder_autoparse_push(dec->decoder, buffer);
+  caml_leave_blocking_section();
+
+  release_pinned_values();
+
+  CAMLreturn(Val_true);
+}
+
+CAMLprim value ocaml_schroedinger_decoder_push_eos(value _dec)
+{
+  CAMLparam1(_dec);
+  decoder_t *dec = Schro_dec_val(_dec);
+  dec->eos_pushed = 1;
+  caml_enter_blocking_section();
+  schro_decoder_autoparse_push_end_of_sequence(dec->decoder);
+  caml_leave_blocking_section();
+  CAMLreturn(Val_unit);
+}
+
+/* Whether the end of the stream was pushed since the last reset. */
+CAMLprim value ocaml_schroedinger_decoder_eos_pushed(value _dec)
+{
+  CAMLparam1(_dec);
+  CAMLreturn(Val_bool(Schro_dec_val(_dec)->eos_pushed));
+}
+
+/* Whether the planar frame tmpl of the planes may be given new memory
+ * by planes_swap: the planes must share a frame_proxy, have no other
+ * view nor native user and be laid out as by schro_frame_alloc. */
+static int planes_can_swap(value planes, SchroFrame *tmpl)
+{
+  SchroFrame layout;
+  size_t offsets[3];
+  frame_proxy *fp;
+  value data;
+  int j;
+
+  data = Field(Field(planes, 0), 0);
+  if (!is_frame_proxy_val(data))
+    return 0;
+  fp = (frame_proxy *)Caml_ba_array_val(data)->proxy;
+  for (j=0; j<3; j++) {
+    data = Field(Field(planes, j), 0);
+    if (!is_frame_proxy_val(data) || Caml_ba_array_val(data)->proxy != &fp->proxy)
+      return 0;
+  }
+  if (!frame_proxy_is_exclusive(fp, 3))
+    return 0;
+
+  frame_layout(&layout, tmpl->format, tmpl->width, tmpl->height, offsets);
+  for (j=0; j<3; j++)
+    if (layout.components[j].stride != tmpl->components[j].stride)
+      return 0;
+
+  return 1;
+}
+
+/* Give the planes of the frame tmpl new memory, holding a copy of src
+ * if it is not NULL. Their former memory is left to its native users.
+ * Returns -1 when out of memory. */
+static int planes_swap(value planes, SchroFrame *tmpl, SchroFrame *src)
+{
+  frame_proxy *old = (frame_proxy *)Caml_ba_array_val(Field(Field(planes, 0), 0))->proxy;
+  struct caml_ba_array *b;
+  SchroFrame *frame;
+  frame_proxy *fp;
+  int j;
+
+  frame = schro_frame_alloc(tmpl->format, tmpl->width, tmpl->height);
+  if (frame == NULL)
+    return -1;
+  fp = frame_proxy_new(NULL, NULL, frame, NULL);
+  if (fp == NULL) {
+    schro_frame_unref(frame);
+    return -1;
+  }
+
+  if (src != NULL) {
+    caml_enter_blocking_section();
+    schro_frame_copy_into(frame, src);
+    caml_leave_blocking_section();
+  }
+
+  for (j=0; j<3; j++) {
+    b = Caml_ba_array_val(Field(Field(planes, j), 0));
+    b->data = frame->components[j].data;
+    b->proxy = &fp->proxy;
+    Proxy_ref(&fp->proxy);
+    if (Proxy_unref(&old->proxy) == 0)
+      frame_proxy_unuse(old);
+  }
+
+  return 0;
+}
+
+CAMLprim value ocaml_schroedinger_decoder_decode_frame_into(value _dec, value _os, value _frame)
+{
+  CAMLparam3(_dec, _os, _frame);
+  decoder_t *dec = Schro_dec_val(_dec);
+  ogg_stream_state *os = Stream_state_val(_os);
+  SchroFrame *target = NULL;
+  SchroFrame *frame = NULL;
+  SchroFrame tmpl;
+  frame_proxy *proxies[3];
+  dec_status status;
+  int queued = 0;
+  int released = 0;
+  int mismatch;
+  int ret = 0;
+
+  schro_frame_init_of_val(&tmpl, _frame);
+  if (FRAME_FORMAT_IS_PACKED(tmpl.format)) {
+    if (dec->s16)
+      caml_invalid_argument("Schroedinger.Decoder.decode_frame_into");
+    status = dec_decode_frame(dec, os, NULL, NULL, &frame);
+    release_pinned_values();
+    dec_raise_status(status);
+    pool_mark(dec->pool, frame, SLOT_FREE);
+    if (tmpl.width != frame->width || tmpl.height != frame->height) {
+      schro_frame_unref(frame);
+      caml_failwith("invalid frame dimension");
+    }
+    /* The planes are kept alive by _frame. */
+    if (!planes_use(Field(_frame, 0), proxies)) {
+      schro_frame_unref(frame);
+      caml_failwith("invalid frame dimension");
+    }
+    caml_enter_blocking_section();
+    ret = frame_pack(&tmpl, frame);
+    planes_unuse(proxies);
+    caml_leave_blocking_section();
+    schro_frame_unref(frame);
+    if (ret < 0)
+      caml_raise_out_of_memory();
+    CAMLreturn(Val_unit);
+  }
+
+  /* The planes are only handed to the decoder when they can be given
+   * new memory, in case the decoder still holds them once done here. */
+  if (dec->queued == 0 && planes_can_swap(Field(_frame, 0), &tmpl))
+    target = schro_frame_wrap_val(_frame, tmpl.format);
+
+  status = dec_decode_frame(dec, os, target, &queued, &frame);
+  mismatch = status == DEC_FRAME &&
+             (tmpl.format != frame->format ||
+              tmpl.width != frame->width ||
+              tmpl.height != frame->height);
+
+  if (queued && frame != target)
+    /* The picture was decoded into other planes, or not yet: the
+     * planes will be written by a later call and must not be the
+     * caller's anymore. */
+    ret = planes_swap(Field(_frame, 0), &tmpl, status == DEC_FRAME && !mismatch ? frame : NULL);
+  else if (status == DEC_FRAME && frame != target && !mismatch) {
+    /* The planes are kept alive by _frame. */
+    if (planes_use(Field(_frame, 0), proxies)) {
+      caml_enter_blocking_section();
+      schro_frame_copy_into(&tmpl, frame);
+      planes_unuse(proxies);
+      caml_leave_blocking_section();
+    } else
+      released = 1;
+  }
+
+  if (frame != NULL) {
+    pool_mark(dec->pool, frame, SLOT_FREE);
+    schro_frame_unref(frame);
+  }
+  if (target != NULL)
+    schro_frame_unref(target);
+  release_pinned_values();
+
+  if (ret < 0)
+    caml_raise_out_of_memory();
+  if (mismatch || released)
+    caml_failwith("invalid frame dimension");
+  dec_raise_status(status);
+
+  CAMLreturn(Val_unit);
+}
+
+/* Decoded frames are given back through their planes,
+ * the decoder is only there for the API. */
+CAMLprim value ocaml_schroedinger_decoder_release_frame(value _dec, value frame)
+{
+  CAMLparam2(_dec, frame);
+  planes_release(Field(frame, 0));
+  CAMLreturn(Val_unit);
+}
+
+/* Asynchronous decoder. A native thread feeds the decoder with the
+ * pushed input and stores decoded frames in a bounded ring, which is
+ * read by OCaml without locking. The worker only waits on the lock
+ * when the ring is full or when it runs out of input, and the reader
+ * when the ring is empty. */
+
+#define ASYNC_ERROR -1
+
+typedef struct {
+  int status; /* A dec_status or ASYNC_ERROR. */
+  SchroFrame *frame;
+} async_entry;
+
+typedef struct async_input {
+  SchroBuffer *buffer; /* NULL for end of stream. */
+  struct async_input *next;
+} async_input;
+
+typedef struct {
+  decoder_t *dec;
+  pthread_t thread;
+  int running;
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  async_input *input;
+  async_input *input_last;
+  int stop;
+  /* The worker waits for input. */
+  int starved;
+  /* The worker has exited. */
+  int done;
+  int has_format;
+  SchroVideoFormat format;
+
+  /* Single producer, single consumer ring. head is
+   * only written by the worker and tail by OCaml. */
+  unsigned int depth;
+  async_entry *ring;
+  unsigned int head;
+  unsigned int tail;
+  int worker_waiting;
+  int reader_waiting;
+} async_t;
+
+#define Async_val(v) (*((async_t **)Data_custom_val(v)))
+
+static void async_wake(async_t *a)
+{
+  pthread_mutex_lock(&a->lock);
+  pthread_cond_broadcast(&a->cond);
+  pthread_mutex_unlock(&a->lock);
+}
+
+/* Queue a decoding result. Returns 0 if the worker was stopped
+ * while waiting for some room in the ring. */
+static int async_put(async_t *a, int status, SchroFrame *frame)
+{
+  unsigned int head = a->head;
+  int stop = 0;
+
+  if (head - __atomic_load_n(&a->tail, __ATOMIC_SEQ_CST) >= a->depth)
+  {
+    pthread_mutex_lock(&a->lock);
+    __atomic_store_n(&a->worker_waiting, 1, __ATOMIC_SEQ_CST);
+    while (!a->stop &&
+           head - __atomic_load_n(&a->tail, __ATOMIC_SEQ_CST) >= a->depth)
+      pthread_cond_wait(&a->cond, &a->lock);
+    __atomic_store_n(&a->worker_waiting, 0, __ATOMIC_SEQ_CST);
+    stop = a->stop;
+    pthread_mutex_unlock(&a->lock);
+    if (stop)
+      return 0;
+  }
+
+  a->ring[head % a->depth].status = status;
+  a->ring[head % a->depth].frame = frame;
+  __atomic_store_n(&a->head, head+1, __ATOMIC_SEQ_CST);
+
+  if (__atomic_load_n(&a->reader_waiting, __ATOMIC_SEQ_CST))
+    async_wake(a);
+
+  return 1;
+}
+
+/* Dequeue a decoding result. When block is not zero, wait until
+ * one is available, the worker needs more input or has exited.
+ * Returns 0 if no result was available. */
+static int async_get(async_t *a, int block, async_entry *entry)
+{
+  unsigned int tail = a->tail;
+
+  if (tail == __atomic_load_n(&a->head, __ATOMIC_SEQ_CST))
+  {
+    if (!block)
+      return 0;
+    pthread_mutex_lock(&a->lock);
+    __atomic_store_n(&a->reader_waiting, 1, __ATOMIC_SEQ_CST);
+    while (!a->starved && !a->done &&
+           tail == __atomic_load_n(&a->head, __ATOMIC_SEQ_CST))
+      pthread_cond_wait(&a->cond, &a->lock);
+    __atomic_store_n(&a->reader_waiting, 0, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&a->lock);
+    if (tail == __atomic_load_n(&a->head, __ATOMIC_SEQ_CST))
+      return 0;
+  }
+
+  *entry = a->ring[tail % a->depth];
+  __atomic_store_n(&a->tail, tail+1, __ATOMIC_SEQ_CST);
+
+  if (__atomic_load_n(&a->worker_waiting, __ATOMIC_SEQ_CST))
+    async_wake(a);
+
+  return 1;
+}
+
+static void async_push(async_t *a, async_input *in)
+{
+  pthread_mutex_lock(&a->lock);
+  if (a->input_last == NULL)
+    a->input = in;
+  else
+    a->input_last->next = in;
+  a->input_last = in;
+  a->starved = 0;
+  pthread_cond_broadcast(&a->cond);
+  pthread_mutex_unlock(&a->lock);
+}
+
+/* Wait for the next input buffer. Returns 0 if the worker was stopped. */
+static int async_next_input(async_t *a, SchroBuffer **buffer)
+{
+  async_input *in;
+
+  pthread_mutex_lock(&a->lock);
+  while (a->input == NULL && !a->stop)
+  {
+    a->starved = 1;
+    pthread_cond_broadcast(&a->cond);
+    pthread_cond_wait(&a->cond, &a->lock);
+  }
+  if (a->stop)
+  {
+    pthread_mutex_unlock(&a->lock);
+    return 0;
+  }
+  in = a->input;
+  a->input = in->next;
+  if (a->input == NULL)
+    a->input_last = NULL;
+  pthread_mutex_unlock(&a->lock);
+
+  *buffer = in->buffer;
+  free(in);
+  return 1;
+}
+
+static void *async_worker(void *arg)
+{
+  async_t *a = arg;
+  SchroDecoder *decoder = a->dec->decoder;
+  SchroVideoFormat *format;
+  SchroBuffer *buffer;
+  SchroFrame *frame;
+  int frame_format;
+  int running = 1;
+
+  while (running) {
+    switch (schro_decoder_autoparse_wait(decoder)) {
+      case SCHRO_DECODER_FIRST_ACCESS_UNIT:
+      case SCHRO_DECODER_NEED_BITS:
+        if (!async_next_input(a, &buffer))
+          running = 0;
+        else if (buffer == NULL)
+          schro_decoder_autoparse_push_end_of_sequence(decoder);
+        else
+          schro_decoder_autoparse_push(decoder, buffer);
+        break;
+      case SCHRO_DECODER_NEED_FRAME:
+        format = schro_decoder_get_video_format(decoder);
+        pthread_mutex_lock(&a->lock);
+        a->format = *format;
+        a->has_format = 1;
+        pthread_mutex_unlock(&a->lock);
+        frame = NULL;
+        frame_format = dec_output_format(format->chroma_format, a->dec->s16);
+        if (frame_format >= 0)
+          frame = pool_get(a->dec->pool, frame_format, format->width, format->height);
+        free(format);
+        if (frame == NULL)
+        {
+          async_put(a, ASYNC_ERROR, NULL);
+          running = 0;
+          break;
+        }
+        schro_decoder_add_output_picture(decoder, frame);
+        break;
+      case SCHRO_DECODER_OK:
+        frame = schro_decoder_pull(decoder);
+        if (frame->width == 0 || frame->height == 0)
+        {
+          pool_mark(a->dec->pool, frame, SLOT_FREE);
+          schro_frame_unref(frame);
+          running = async_put(a, DEC_REPEAT, NULL);
+          break;
+        }
+        if (!async_put(a, DEC_FRAME, frame))
+        {
+          pool_mark(a->dec->pool, frame, SLOT_FREE);
+          schro_frame_unref(frame);
+          running = 0;
+        }
+        break;
+      case SCHRO_DECODER_EOS:
+        async_put(a, DEC_EOS, NULL);
+        running = 0;
+        break;
+      default:
+        async_put(a, ASYNC_ERROR, NULL);
+        running = 0;
+        break;
+    }
+  }
+
+  pthread_mutex_lock(&a->lock);
+  a->done = 1;
+  pthread_cond_broadcast(&a->cond);
+  pthread_mutex_unlock(&a->lock);
+
+  return NULL;
+}
+
+/* Stop and join the worker. Can be called without the runtime lock. */
+static void async_stop(async_t *a)
+{
+  if (!a->running)
+    return;
+  pthread_mutex_lock(&a->lock);
+  a->stop = 1;
+  pthread_cond_broadcast(&a->cond);
+  pthread_mutex_unlock(&a->lock);
+  pthread_join(a->thread, NULL);
+  a->running = 0;
+}
+
+/* Drop pending input and results. The worker must be stopped. */
+static void async_flush(async_t *a)
+{
+  async_input *in;
+  async_entry entry;
+
+  while (a->input != NULL)
+  {
+    in = a->input;
+    a->input = in->next;
+    if (in->buffer != NULL)
+      schro_buffer_unref(in->buffer);
+    free(in);
+  }
+  a->input_last = NULL;
+
+  while (async_get(a, 0, &entry))
+    if (entry.frame != NULL)
+    {
+      pool_mark(a->dec->pool, entry.frame, SLOT_FREE);
+      schro_frame_unref(entry.frame);
+    }
+}
+
+static void finalize_async(value v)
+{
+  async_t *a = Async_val(v);
+  async_stop(a);
+  async_flush(a);
+  dec_free(a->dec);
+  pthread_cond_destroy(&a->cond);
+  pthread_mutex_destroy(&a->lock);
+  free(a->ring);
+  free(a);
+}
+
+static struct custom_operations async_ops =
+{
+  "ocaml_schro_async_dec",
+  finalize_async,
+  custom_compare_default,
+  custom_hash_default,
+  custom_serialize_default,
+  custom_deserialize_default
+};
+
+CAMLprim value ocaml_schroedinger_async_create(value _depth, value _s16)
+{
+  CAMLparam2(_depth, _s16);
+  CAMLlocal1(ret);
+  int depth = Int_val(_depth);
+  async_t *a;
+
+  if (depth <= 0)
+    caml_invalid_argument("Schroedinger.Decoder.Async.create");
+
+  a = calloc(1, sizeof(async_t));
+  if (a == NULL)
+    caml_raise_out_of_memory();
+  a->ring = malloc(depth*sizeof(async_entry));
+  if (a->ring == NULL)
+  {
+    free(a);
+    caml_raise_out_of_memory();
+  }
+  a->depth = depth;
+  a->dec = dec_new();
+  /* Read by the worker. */
+  a->dec->s16 = Bool_val(_s16);
+  pthread_mutex_init(&a->lock, NULL);
+  pthread_cond_init(&a->cond, NULL);
+
+  /* The video format is not known yet. */
+  ret = caml_alloc_custom_mem(&async_ops, sizeof(async_t*),
+                              sizeof(async_t) + sizeof(decoder_t) + depth*sizeof(async_entry));
+  Async_val(ret) = a;
+
+  if (pthread_create(&a->thread, NULL, async_worker, a) != 0)
+    caml_failwith("pthread_create");
+  a->running = 1;
+
+  CAMLreturn(ret);
+}
+
+CAMLprim value ocaml_schroedinger_async_s16(value _a)
+{
+  return Val_bool(Async_val(_a)->dec->s16);
+}
+
+static void async_push_buffer(async_t *a, SchroBuffer *buffer)
+{
+  async_input *in = malloc(sizeof(async_input));
+  if (in == NULL)
+  {
+    if (buffer != NULL)
+      schro_buffer_unref(buffer);
+    caml_raise_out_of_memory();
+  }
+  in->buffer = buffer;
+  in->next = NULL;
+  async_push(a, in);
+}
+
+CAMLprim value ocaml_schroedinger_async_push_data(value _a, value _data, value _ofs, value _len)
+{
+  CAMLparam2(_a, _data);
+  struct caml_ba_array *data = Caml_ba_array_val(_data);
+  intnat ofs = Long_val(_ofs);
+  intnat len = Long_val(_len);
+  SchroBuffer *buffer;
+
+  if (ofs < 0 || len < 0 || ofs + len > data->dim[0])
+    caml_invalid_argument("Schroedinger.Decoder.Async.push_data");
+
+  buffer = schro_buffer_new_with_data((uint8_t *)data->data + ofs, len);
+  buffer->free = buffer_pinned_free;
+  buffer->priv = pin_value(_data);
+  async_push_buffer(Async_val(_a), buffer);
+
+  release_pinned_values();
+
+  CAMLreturn(Val_unit);
+}
+
+CAMLprim value ocaml_schroedinger_async_push_packet(value _a, value packet)
+{
+  CAMLparam2(_a, packet);
+  async_push_buffer(Async_val(_a), schro_buffer_of_ogg_packet(Packet_val(packet)));
+  CAMLreturn(Val_unit);
+}
+
+CAMLprim value ocaml_schroedinger_async_push_eos(value _a)
+{
+  CAMLparam1(_a);
+  async_push_buffer(Async_val(_a), NULL);
+  CAMLreturn(Val_unit);
+}
+
+CAMLprim value ocaml_schroedinger_async_get_format(value _a)
+{
+  CAMLparam1(_a);
+  CAMLlocal1(ret);
+  async_t *a = Async_val(_a);
+  SchroVideoFormat format;
+  int has_format;
+
+  pthread_mutex_lock(&a->lock);
+  has_format = a->has_format;
+  format = a->format;
+  pthread_mutex_unlock(&a->lock);
+
+  if (!has_format)
+    CAMLreturn(Val_int(0));
+
+  ret = caml_alloc_tuple(1);
+  Store_field(ret, 0, value_of_video_format(&format));
+  CAMLreturn(ret);
+}
+
+/* Returns an internal_result option, None
+ * when no result is available yet. */
+CAMLprim value ocaml_schroedinger_async_pull(value _a, value _block)
+{
+  CAMLparam2(_a, _block);
+  CAMLlocal2(ret, tmp);
+  async_t *a = Async_val(_a);
+  async_entry entry;
+  int ok, done;
+
+  if (Bool_val(_block))
+  {
+    caml_enter_blocking_section();
+    ok = async_get(a, 1, &entry);
+    caml_leave_blocking_section();
+  }
+  else
+    ok = async_get(a, 0, &entry);
 
-  schro_encoder_end_of_stream(enc->encoder);
-  ret = enc_get_packet(enc,&op);
-  while (ret != -1)
+  release_pinned_values();
+
+  if (!ok)
   {
-    if (ret == 1)
+    pthread_mutex_lock(&a->lock);
+    done = a->done;
+    pthread_mutex_unlock(&a->lock);
+    if (!done)
+      CAMLreturn(Val_int(0));
+    /* The worker may have queued a last
+     * result before exiting. */
+    if (!async_get(a, 0, &entry))
     {
-      /* Put the packet in the ogg stream. */
-      ogg_stream_packetin(os, &op);
-      free(op.packet);
+      entry.status = DEC_EOS;
+      entry.frame = NULL;
     }
-    ret = enc_get_packet(enc,&op);
   }
 
-  /* Add last packet */
-  op.packet = NULL;
-  op.bytes = 0;
-  op.e_o_s = 1;
-  op.b_o_s = 0;
-  ogg_stream_packetin(os, &op);
+  if (entry.status == ASYNC_ERROR)
+    raise_named_exn(EXN_ERROR);
 
-  CAMLreturn(Val_unit);
+  tmp = dec_result_value(a->dec, entry.status, entry.frame);
+  ret = caml_alloc_tuple(1);
+  Store_field(ret, 0, tmp);
+  CAMLreturn(ret);
 }
 
-CAMLprim value ocaml_schroedinger_encode_frame(value _enc, value frame, value _os)
+CAMLprim value ocaml_schroedinger_async_stop(value _a)
 {
-  CAMLparam3(_enc, frame, _os);
-  ogg_stream_state *os = Stream_state_val(_os);
-  encoder_t *enc = Schro_enc_val(_enc);
-  SchroFrame *f = schro_frame_of_val(frame);
-  ogg_int64_t *pts = malloc(sizeof(ogg_int64_t));
-  if (pts == NULL)
-    caml_raise_out_of_memory();
-  memcpy(pts,&enc->presentation_frame_number,sizeof(ogg_int64_t));
-  ogg_packet op;
-  int ret = 2;
- 
-  /* Put the frame into the encoder. */
+  CAMLparam1(_a);
+  async_t *a = Async_val(_a);
+
   caml_enter_blocking_section();
-  schro_encoder_push_frame_full(enc->encoder, f, pts);
+  async_stop(a);
   caml_leave_blocking_section();
-  enc->presentation_frame_number++;
- 
-  while (ret > 0) {
-    ret = enc_get_packet(enc, &op);
-    if (ret == 1)
-    {
-      /* Put the packet in the ogg stream. */
-      ogg_stream_packetin(os, &op);
-      free(op.packet);
-    }
-  }
+  async_flush(a);
+  release_pinned_values();
 
   CAMLreturn(Val_unit);
 }
 
-CAMLprim value ocaml_schroedinger_encode_header(value _enc, value _os)
+/* Seeking */
+
+/* Pages are read directly from a file descriptor, by blocks of
+ * this size. */
+#define SEEK_READ_SIZE 65536
+
+typedef struct {
+  int fd;
+  /* Offset of the next byte to read. */
+  off_t pos;
+  /* Offset of the next page returned. */
+  off_t page_offset;
+  ogg_sync_state oy;
+} page_reader;
+
+static void page_reader_init(page_reader *r, int fd, off_t offset)
 {
-  CAMLparam2(_enc, _os);
-  ogg_stream_state *os = Stream_state_val(_os);
-  encoder_t *enc = Schro_enc_val(_enc); 
-  encoder_t *tmp_enc; 
-  ogg_packet op;
-  int format;
-  long header_len;
-  uint8_t *header;
-  SchroFrame *frame;
+  r->fd = fd;
+  r->pos = offset;
+  r->page_offset = offset;
+  ogg_sync_init(&r->oy);
+}
 
+/* Returns 1 and fills page and its offset, 0 at the end
+ * of the file or -1 on error. */
+static int page_reader_next(page_reader *r, ogg_page *page, off_t *offset)
+{
+  long ret;
+  ssize_t n;
+  char *buf;
+
+  while (1) {
+    ret = ogg_sync_pageseek(&r->oy, page);
+    if (ret > 0) {
+      *offset = r->page_offset;
+      r->page_offset += ret;
+      return 1;
+    }
+    if (ret < 0) {
+      r->page_offset -= ret;
+      continue;
+    }
+    buf = ogg_sync_buffer(&r->oy, SEEK_READ_SIZE);
+    n = pread(r->fd, buf, SEEK_READ_SIZE, r->pos);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return n;
+    ogg_sync_wrote(&r->oy, n);
+    r->pos += n;
+  }
+}
 
-  /* Create a new encoder with the same format */
-  tmp_enc = create_enc(&enc->format);
+typedef struct {
+  /* Offset of the page where the sequence header starts. */
+  off_t offset;
+  /* Number of the following picture. */
+  uint32_t picture;
+} sync_point;
+
+/* Follows the packets of a stream to find its sync points, a
+ * sequence header followed by a picture. */
+typedef struct {
+  ogg_uint32_t serial;
+  ogg_stream_state os;
+  int os_init;
+  /* Offset of the page where the next packet starts. */
+  off_t packet_start;
+  /* Offset of a sequence header waiting for its picture, or -1. */
+  off_t pending;
+  sync_point *points;
+  int len;
+  int size;
+} sync_scanner;
 
-  /* Create dummy frame */
-  format = schro_frame_format_of_chroma_format(enc->format.chroma_format);
+static void sync_scanner_init(sync_scanner *s, ogg_uint32_t serial)
+{
+  s->serial = serial;
+  s->os_init = 0;
+  s->packet_start = -1;
+  s->pending = -1;
+  s->points = NULL;
+  s->len = 0;
+  s->size = 0;
+}
 
-  /* Encode a frame until a packet is ready */
-  do
-  {
-    frame = schro_frame_new_and_alloc(NULL, format, enc->format.width, enc->format.height);
-    schro_encoder_push_frame(tmp_enc->encoder, frame);
-  }
-  while (enc_get_packet(tmp_enc, &op) != 1);   
-
-  /* Get the encoded buffer */
-  header = op.packet;
-  if (header[0] != 'B' ||
-      header[1] != 'B' ||
-      header[2] != 'C' ||
-      header[3] != 'D' ||
-      header[4] != 0x0)
-  {
-    /* TODO: proper exception */
-    schro_encoder_free(tmp_enc->encoder);
-    free(tmp_enc);
-    caml_failwith("invalid header identifier");
+static void sync_scanner_clear(sync_scanner *s)
+{
+  if (s->os_init)
+    ogg_stream_clear(&s->os);
+  s->os_init = 0;
+  free(s->points);
+  s->points = NULL;
+  s->len = 0;
+  s->size = 0;
+}
+
+/* Feed a page of the stream, found at offset. Sequence headers
+ * starting on a page at or after stop are ignored. Returns 0, or
+ * -1 when out of memory. */
+static int sync_scanner_page(sync_scanner *s, ogg_page *page, off_t offset, off_t stop)
+{
+  ogg_packet op;
+  sync_point *tmp;
+  off_t cur;
+  int ret;
+
+  if (!s->os_init) {
+    ogg_stream_init(&s->os, s->serial);
+    s->os_init = 1;
   }
-  header_len = (header[5] << 24) +
-               (header[6] << 16) +
-               (header[7] << 8) +
-                header[8];
 
-  if (header_len <= 13)
-  {
-    /* TODO: proper exception */
-    schro_encoder_free(tmp_enc->encoder);
-    free(tmp_enc);
-    caml_failwith("invalid header: length too short");
+  /* Starting earlier than the actual page is harmless:
+   * the decoder skips incomplete packets. */
+  if (s->packet_start < 0 || !ogg_page_continued(page))
+    s->packet_start = offset;
+  ogg_stream_pagein(&s->os, page);
+
+  while ((ret = ogg_stream_packetout(&s->os, &op)) != 0) {
+    cur = s->packet_start;
+    s->packet_start = offset;
+    if (ret < 0 || op.bytes < PARSE_INFO_SIZE || memcmp(op.packet, "BBCD", 4))
+      continue;
+    if (SCHRO_PARSE_CODE_IS_SEQ_HEADER(op.packet[4])) {
+      if (cur < stop)
+        s->pending = cur;
+    } else if (SCHRO_PARSE_CODE_IS_PICTURE(op.packet[4]) && s->pending >= 0 &&
+               op.bytes >= PARSE_INFO_SIZE + 4) {
+      if (s->len == s->size) {
+        tmp = realloc(s->points, (s->size ? 2*s->size : 64)*sizeof(sync_point));
+        if (tmp == NULL)
+          return -1;
+        s->points = tmp;
+        s->size = s->size ? 2*s->size : 64;
+      }
+      s->points[s->len].offset = s->pending;
+      s->points[s->len].picture = ((uint32_t)op.packet[13] << 24) | (op.packet[14] << 16) |
+                                  (op.packet[15] << 8) | op.packet[16];
+      s->len++;
+      s->pending = -1;
+    }
   }
-  if (header_len > op.bytes)
-  {
-    /* TODO: proper exception */
-    schro_encoder_free(tmp_enc->encoder);
-    free(tmp_enc);
-    caml_failwith("invalid header: length too big");
+
+  return 0;
+}
+
+/* Find the sync points whose sequence header starts on a page
+ * before stop. When *found is 0, the first Dirac stream found is
+ * used, its serial stored in s->serial and *found set. On success,
+ * the scanner holds the sync points and must be cleared. Returns 0,
+ * or -1 on error. */
+static int seek_scan(int fd, ogg_uint32_t serial, int *found, off_t start, off_t stop,
+                     sync_scanner *s)
+{
+  page_reader r;
+  ogg_page page;
+  off_t offset;
+  int ret;
+
+  sync_scanner_init(s, serial);
+  page_reader_init(&r, fd, start);
+
+  while ((ret = page_reader_next(&r, &page, &offset)) == 1) {
+    if (!*found) {
+      if (ogg_page_continued(&page) || page.body_len < PARSE_INFO_SIZE ||
+          memcmp(page.body, "BBCD", 4))
+        continue;
+      s->serial = Page_serial(&page);
+      *found = 1;
+    }
+    if (Page_serial(&page) != s->serial)
+      continue;
+    if (offset >= stop && s->pending < 0)
+      break;
+    if (sync_scanner_page(s, &page, offset, stop) < 0) {
+      ret = -1;
+      break;
+    }
   }
-  op.b_o_s = 1;
-  op.e_o_s = 0;
-  op.bytes = header_len;
-  op.granulepos = 0;
 
-  /* Put the packet in the ogg stream. */
-  ogg_stream_packetin(os, &op);
+  ogg_sync_clear(&r.oy);
+  if (ret < 0) {
+    sync_scanner_clear(s);
+    return -1;
+  }
+  return 0;
+}
 
-  /* Clean temporary encoder and op.packet */
-  free(op.packet);
-  schro_encoder_free(tmp_enc->encoder);
-  free(tmp_enc);
+static value val_of_sync_points(sync_point *p, int len)
+{
+  CAMLparam0();
+  CAMLlocal2(points, point);
+  int i;
+
+  points = caml_alloc_tuple(len);
+  for (i=0; i<len; i++) {
+    point = caml_alloc_tuple(2);
+    Store_field(point, 0, caml_copy_int64(p[i].offset));
+    Store_field(point, 1, Val_int(p[i].picture));
+    Store_field(points, i, point);
+  }
 
-  CAMLreturn(Val_unit);
+  CAMLreturn(points);
 }
 
-CAMLprim value ocaml_schroedinger_set_setting(value _enc, value _name, value _val)
+CAMLprim value ocaml_schroedinger_seek_scan(value _fd, value _serial, value _start, value _stop)
 {
-  CAMLparam2(_enc,_name);
-  encoder_t *enc = Schro_enc_val(_enc);
-  schro_encoder_setting_set_double(enc->encoder,String_val(_name),double_of_setting(_name,_val));
-  CAMLreturn(Val_unit);
+  CAMLparam4(_fd, _serial, _start, _stop);
+  CAMLlocal2(ret, points);
+  int fd = Int_val(_fd);
+  /* _serial is an option: None picks the first Dirac stream. */
+  int found = Is_block(_serial);
+  ogg_uint32_t serial = found ? Serial_val(Field(_serial, 0)) : 0;
+  off_t start = Int64_val(_start);
+  off_t stop = Int64_val(_stop);
+  sync_scanner s;
+  int err;
+
+  caml_enter_blocking_section();
+  err = seek_scan(fd, serial, &found, start, stop, &s);
+  caml_leave_blocking_section();
+
+  if (err < 0)
+    caml_failwith("seek_scan");
+  if (!found)
+    caml_raise_not_found();
+
+  serial = s.serial;
+  points = val_of_sync_points(s.points, s.len);
+  sync_scanner_clear(&s);
+
+  ret = caml_alloc_tuple(2);
+  Store_field(ret, 0, Val_serial(serial));
+  Store_field(ret, 1, points);
+
+  CAMLreturn(ret);
 }
 
-CAMLprim value ocaml_schroedinger_get_setting(value _enc, value _name)
+/* Returns the offset and granule position of the first page of
+ * the stream with a granule position at or after start. */
+CAMLprim value ocaml_schroedinger_seek_next_granule(value _fd, value _serial, value _start)
 {
-  CAMLparam2(_enc,_name);
+  CAMLparam3(_fd, _serial, _start);
   CAMLlocal1(ret);
-  encoder_t *enc = Schro_enc_val(_enc);
-  double x = schro_encoder_setting_get_double(enc->encoder,String_val(_name));
-  CAMLreturn(setting_of_double(_name,x));
-}
+  int fd = Int_val(_fd);
+  ogg_uint32_t serial = Serial_val(_serial);
+  off_t start = Int64_val(_start);
+  page_reader r;
+  ogg_page page;
+  ogg_int64_t granulepos = -1;
+  off_t offset;
+  int err;
 
-/* Decoder */
+  caml_enter_blocking_section();
+  page_reader_init(&r, fd, start);
+  while ((err = page_reader_next(&r, &page, &offset)) == 1) {
+    if (Page_serial(&page) != serial)
+      continue;
+    granulepos = ogg_page_granulepos(&page);
+    if (granulepos != -1)
+      break;
+  }
+  ogg_sync_clear(&r.oy);
+  caml_leave_blocking_section();
 
-#define Schro_dec_val(v) (*((SchroDecoder **)Data_custom_val(v)))
+  if (err < 0)
+    caml_failwith("seek_next_granule");
+  if (err == 0)
+    caml_raise_not_found();
 
-static void finalize_schro_dec(value v)
+  ret = caml_alloc_tuple(2);
+  Store_field(ret, 0, caml_copy_int64(offset));
+  Store_field(ret, 1, caml_copy_int64(granulepos));
+
+  CAMLreturn(ret);
+}
+
+/* Sync points of a stream being written, fed with its pages. */
+#define Indexer_val(v) (*((sync_scanner **)Data_custom_val(v)))
+
+static void finalize_indexer(value v)
 {
-  SchroDecoder *dec = Schro_dec_val(v);
-  schro_decoder_free(dec);
+  sync_scanner *s = Indexer_val(v);
+  sync_scanner_clear(s);
+  free(s);
 }
 
-static struct custom_operations schro_dec_ops =
+static struct custom_operations indexer_ops =
 {
-  "ocaml_schro_dec",
-  finalize_schro_dec,
+  "ocaml_schro_indexer",
+  finalize_indexer,
   custom_compare_default,
   custom_hash_default,
   custom_serialize_default,
   custom_deserialize_default
 };
 
-CAMLprim value ocaml_schroedinger_create_dec(value packet)
+CAMLprim value ocaml_schroedinger_indexer_create(value serial)
 {
-  CAMLparam1(packet);
+  CAMLparam1(serial);
   CAMLlocal1(ret);
-  ogg_packet *op = Packet_val(packet);
-  unsigned char *header;
-  long header_len;
-
-
-  /* Get the encoded buffer */
-  header = op->packet;
-  if (header[0] != 'B' ||
-      header[1] != 'B' ||
-      header[2] != 'C' ||
-      header[3] != 'D' ||
-      header[4] != 0x0)
-    caml_raise_constant(*caml_named_value("schro_exn_invalid_header"));
-
-  header_len = (header[5] << 24) +
-               (header[6] << 16) +
-               (header[7] << 8) +
-                header[8];
-
-   if (header_len <= 13 ||
-       header_len > op->bytes)
-     caml_raise_constant(*caml_named_value("schro_exn_invalid_header"));
-
-  SchroDecoder *dec = schro_decoder_new();
-  SchroBuffer *buffer = schro_buffer_of_ogg_packet(op);
-  schro_decoder_autoparse_push(dec, buffer);
+  sync_scanner *s = malloc(sizeof(sync_scanner));
+  if (s == NULL)
+    caml_raise_out_of_memory();
 
-  ret = caml_alloc_custom(&schro_dec_ops, sizeof(SchroDecoder*), 1, 0);
-  Schro_dec_val(ret) = dec;
+  sync_scanner_init(s, Serial_val(serial));
+  ret = caml_alloc_custom_mem(&indexer_ops, sizeof(sync_scanner*), sizeof(sync_scanner));
+  Indexer_val(ret) = s;
 
   CAMLreturn(ret);
 }
 
-CAMLprim value ocaml_schroedinger_decoder_get_format(value dec)
+/* Pages of other streams are ignored. */
+CAMLprim value ocaml_schroedinger_indexer_add_page(value _s, value offset, value _page)
 {
-  CAMLparam1(dec);
-  CAMLlocal1(ret);
-  SchroDecoder *decoder = Schro_dec_val(dec);
-  SchroVideoFormat *format = schro_decoder_get_video_format(decoder);
-  ret = value_of_video_format(format);
-  free(format);
-  CAMLreturn(ret);
+  CAMLparam3(_s, offset, _page);
+  sync_scanner *s = Indexer_val(_s);
+  ogg_page page;
+
+  page.header = (unsigned char *)String_val(Field(_page, 0));
+  page.header_len = caml_string_length(Field(_page, 0));
+  page.body = (unsigned char *)String_val(Field(_page, 1));
+  page.body_len = caml_string_length(Field(_page, 1));
+
+  if (Page_serial(&page) == s->serial &&
+      sync_scanner_page(s, &page, Int64_val(offset), INT64_MAX) < 0)
+    caml_raise_out_of_memory();
+
+  CAMLreturn(Val_unit);
 }
 
-CAMLprim value ocaml_schroedinger_decoder_get_picture_number(value dec)
+CAMLprim value ocaml_schroedinger_indexer_serial(value _s)
 {
-  CAMLparam1(dec);
-  SchroDecoder *decoder = Schro_dec_val(dec);
-  CAMLreturn(Val_int(schro_decoder_get_picture_number(decoder)));
+  CAMLparam1(_s);
+  CAMLreturn(Val_serial(Indexer_val(_s)->serial));
 }
 
-CAMLprim value ocaml_schroedinger_decoder_decode_frame(value dec, value _os)
+CAMLprim value ocaml_schroedinger_indexer_sync_points(value _s)
 {
-  CAMLparam2(dec, _os);
-  CAMLlocal1(ret);
-  SchroDecoder *decoder = Schro_dec_val(dec);
-  ogg_stream_state *os = Stream_state_val(_os);
-  SchroVideoFormat *format;
-  ogg_packet op;
-  SchroFrame *frame;
-  int state, err;
-
-  while (1) {
-    /* Check what the decoder wants now. */
-    caml_enter_blocking_section();
-    state = schro_decoder_autoparse_wait(decoder);
-    caml_leave_blocking_section();
-    switch (state) {
-      case SCHRO_DECODER_FIRST_ACCESS_UNIT:
-      case SCHRO_DECODER_NEED_BITS:
-        /* Grap a packet */
-        err = ogg_stream_packetout(os,&op);
-        if (err == 0) 
-          caml_raise_constant(*caml_named_value("ogg_exn_not_enough_data"));
-        if (err == -1)
-          caml_raise_constant(*caml_named_value("ogg_exn_out_of_sync"));
-        /* Feed the decoder */
-        caml_enter_blocking_section();
-        schro_decoder_autoparse_push(decoder,schro_buffer_of_ogg_packet(&op));
-        caml_leave_blocking_section();
-        break;
-      case SCHRO_DECODER_NEED_FRAME:
-        format = schro_decoder_get_video_format(decoder);
-        schro_decoder_add_output_picture(decoder,
-                                         schro_frame_alloc(schro_frame_format_of_chroma_format(format->chroma_format), 
-                                                           format->width, format->height));
-        free(format);
-        break;
-      case SCHRO_DECODER_OK:
-        caml_enter_blocking_section();
-        frame = schro_decoder_pull(decoder);
-        caml_leave_blocking_section();
-        if (frame->width != 0 && frame->height != 0) {
-          ret = val_of_schro_frame(frame);
-          schro_frame_unref(frame);
-          CAMLreturn(ret);
-        } else {
-          schro_frame_unref(frame); 
-          caml_raise_constant(*caml_named_value("schro_exn_skip"));
-        }
-        break;
-      /* TODO: proper error raising.. */
-      case SCHRO_DECODER_STALLED: 
-      case SCHRO_DECODER_WAIT:
-      case SCHRO_DECODER_ERROR:
-      default:
-        caml_raise_constant(*caml_named_value("schro_exn_dec_error"));
-      }
-  }
-
-  caml_failwith("unknown error");  
+  CAMLparam1(_s);
+  sync_scanner *s = Indexer_val(_s);
+  CAMLreturn(val_of_sync_points(s->points, s->len));
 }
 
 /* Ogg skeleton interface */
 
 /* Wrappers */
+static void write16le(unsigned char *ptr,ogg_uint32_t v)
+{
+  ptr[0]=v&0xff;
+  ptr[1]=(v>>8)&0xff;
+}
+
 static void write32le(unsigned char *ptr,ogg_uint32_t v)
 {
   ptr[0]=v&0xff;
@@ -1093,11 +4974,44 @@ static void write64le(unsigned char *ptr,ogg_int64_t v)
   ptr[7]=(hi>>24)&0xff;
 }
 
-/* Values from http://xiph.org/ogg/doc/skeleton.html */
+/* Values from http://wiki.xiph.org/SkeletonHeaders, version 4.0 */
+#define FISHEAD_IDENTIFIER "fishead\0"
+#define FISHEAD_SIZE 80
+#define SKELETON_VERSION_MAJOR 4
+#define SKELETON_VERSION_MINOR 0
 #define FISBONE_IDENTIFIER "fisbone\0"
 #define FISBONE_MESSAGE_HEADER_OFFSET 44
 #define FISBONE_SIZE 52
 
+/* presentation and base are (numerator, denominator) pairs. */
+CAMLprim value ocaml_schroedinger_skeleton_fishead(value presentation, value base, value segment_length, value content_offset)
+{
+  CAMLparam4(presentation, base, segment_length, content_offset);
+  CAMLlocal1(packet);
+  unsigned char data[FISHEAD_SIZE];
+  ogg_packet op;
+
+  memset(data, 0, FISHEAD_SIZE);
+  memcpy(data, FISHEAD_IDENTIFIER, 8);
+  write16le(data+8, SKELETON_VERSION_MAJOR);
+  write16le(data+10, SKELETON_VERSION_MINOR);
+  write64le(data+12, Int64_val(Field(presentation, 0))); /* presentation time numerator */
+  write64le(data+20, Int64_val(Field(presentation, 1))); /* presentation time denominator */
+  write64le(data+28, Int64_val(Field(base, 0))); /* base time numerator */
+  write64le(data+36, Int64_val(Field(base, 1))); /* base time denominator */
+  /* UTC time, 20 bytes left empty. */
+  write64le(data+64, Int64_val(segment_length)); /* segment length in bytes */
+  write64le(data+72, Int64_val(content_offset)); /* offset of the first non-header page */
+
+  memset(&op, 0, sizeof(op));
+  op.packet = data;
+  op.bytes = FISHEAD_SIZE;
+  op.b_o_s = 1;
+
+  packet = value_of_packet(&op);
+  CAMLreturn(packet);
+}
+
 CAMLprim value ocaml_schroedinger_skeleton_fisbone(value serial, value info, value start, value content)
 {
   CAMLparam4(serial,info,start,content);
@@ -1116,7 +5030,7 @@ CAMLprim value ocaml_schroedinger_skeleton_fisbone(value serial, value info, val
   /* it will be the fisbone packet for the theora video */
   memcpy (op.packet, FISBONE_IDENTIFIER, 8); /* identifier */
   write32le(op.packet+8, FISBONE_MESSAGE_HEADER_OFFSET); /* offset of the message header fields */
-  write32le(op.packet+12, Nativeint_val(serial)); /* serialno of the theora stream */
+  write32le(op.packet+12, Serial_val(serial)); /* serialno of the theora stream */
   write32le(op.packet+16, 1); /* number of header packets */
   /* granulerate, temporal resolution of the bitstream in samples/microsecond */
   write64le(op.packet+20, (ogg_int64_t)format.frame_rate_numerator); /* granulrate numerator */
@@ -1135,3 +5049,198 @@ CAMLprim value ocaml_schroedinger_skeleton_fisbone(value serial, value info, val
   CAMLreturn(packet);
 }
 
+/* Skeleton 4 index packets, see http://wiki.xiph.org/Ogg_Index */
+#define INDEX_IDENTIFIER "index\0"
+#define INDEX_KEYPOINTS_OFFSET 42
+/* Maximal size of a keypoint, made of two variable length numbers. */
+#define INDEX_KEYPOINT_MAX_SIZE 20
+/* patch_index rewrites a single page: 255 lacing values,
+ * the last one being less than 255. */
+#define INDEX_MAX_SIZE (255*255-1)
+
+static ogg_int64_t read64le(unsigned char *ptr)
+{
+  ogg_int64_t v = 0;
+  int i;
+
+  for (i=7; i>=0; i--)
+    v = (v << 8) | ptr[i];
+  return v;
+}
+
+/* Numbers are written 7 bits per byte, least significant
+ * first, the last byte having its high bit set. */
+static unsigned char *write_vint(unsigned char *ptr, uint64_t v)
+{
+  while (v >= 0x80) {
+    *ptr++ = v & 0x7f;
+    v >>= 7;
+  }
+  *ptr++ = v | 0x80;
+  return ptr;
+}
+
+/* Returns NULL if the number does not end before end. */
+static unsigned char *read_vint(unsigned char *ptr, unsigned char *end, uint64_t *v)
+{
+  int shift = 0;
+
+  *v = 0;
+  while (ptr < end && shift < 64) {
+    *v |= (uint64_t)(*ptr & 0x7f) << shift;
+    if (*ptr++ & 0x80)
+      return ptr;
+    shift += 7;
+  }
+  return NULL;
+}
+
+/* points are (offset, time numerator) pairs, range is the (first,
+ * last) pair of sample time numerators. The packet is padded with
+ * zeros when shorter than size bytes, so that it can be rewritten
+ * in place. */
+CAMLprim value ocaml_schroedinger_skeleton_index(value serial, value points, value den, value range, value _size)
+{
+  CAMLparam5(serial, points, den, range, _size);
+  CAMLlocal1(packet);
+  int len = Wosize_val(points);
+  int size = Int_val(_size);
+  ogg_int64_t offset = 0, time = 0, o, t;
+  unsigned char *ptr;
+  ogg_packet op;
+  int i;
+
+  if (size < INDEX_KEYPOINTS_OFFSET + len*INDEX_KEYPOINT_MAX_SIZE)
+    size = INDEX_KEYPOINTS_OFFSET + len*INDEX_KEYPOINT_MAX_SIZE;
+
+  memset(&op, 0, sizeof(op));
+  op.packet = calloc(size, 1);
+  if (op.packet == NULL)
+    caml_raise_out_of_memory();
+
+  memcpy(op.packet, INDEX_IDENTIFIER, 6);
+  write32le(op.packet+6, Serial_val(serial));
+  write64le(op.packet+10, len);
+  write64le(op.packet+18, Int64_val(den));
+  write64le(op.packet+26, Int64_val(Field(range, 0)));
+  write64le(op.packet+34, Int64_val(Field(range, 1)));
+
+  /* Keypoints are stored as differences with the previous one. */
+  ptr = op.packet+INDEX_KEYPOINTS_OFFSET;
+  for (i=0; i<len; i++) {
+    o = Int64_val(Field(Field(points, i), 0));
+    t = Int64_val(Field(Field(points, i), 1));
+    if (o < offset || t < time) {
+      free(op.packet);
+      caml_invalid_argument("Skeleton.index: unordered sync points");
+    }
+    ptr = write_vint(ptr, o - offset);
+    ptr = write_vint(ptr, t - time);
+    offset = o;
+    time = t;
+  }
+
+  op.bytes = ptr - op.packet;
+  if (op.bytes < Int_val(_size))
+    op.bytes = Int_val(_size);
+  if (op.bytes > INDEX_MAX_SIZE) {
+    free(op.packet);
+    caml_invalid_argument("Skeleton.index: index does not fit in a page");
+  }
+
+  packet = value_of_packet(&op);
+  free(op.packet);
+  CAMLreturn(packet);
+}
+
+/* Returns (serial, den, (first, last), points), in
+ * the same form as ocaml_schroedinger_skeleton_index. */
+CAMLprim value ocaml_schroedinger_skeleton_parse_index(value packet)
+{
+  CAMLparam1(packet);
+  CAMLlocal4(ret, points, point, range);
+  ogg_packet *op = Packet_val(packet);
+  unsigned char *ptr, *end = op->packet + op->bytes;
+  uint64_t o, t;
+  ogg_int64_t offset = 0, time = 0, len;
+  int i;
+
+  if (op->bytes < INDEX_KEYPOINTS_OFFSET || memcmp(op->packet, INDEX_IDENTIFIER, 6))
+    caml_failwith("invalid skeleton index");
+  len = read64le(op->packet+10);
+  /* Each keypoint takes at least two bytes. */
+  if (len < 0 || len > (op->bytes - INDEX_KEYPOINTS_OFFSET)/2)
+    caml_failwith("invalid skeleton index");
+
+  points = caml_alloc_tuple(len);
+  ptr = op->packet+INDEX_KEYPOINTS_OFFSET;
+  for (i=0; i<len; i++) {
+    ptr = read_vint(ptr, end, &o);
+    if (ptr != NULL)
+      ptr = read_vint(ptr, end, &t);
+    if (ptr == NULL)
+      caml_failwith("invalid skeleton index");
+    offset += o;
+    time += t;
+    point = caml_alloc_tuple(2);
+    Store_field(point, 0, caml_copy_int64(offset));
+    Store_field(point, 1, caml_copy_int64(time));
+    Store_field(points, i, point);
+  }
+
+  range = caml_alloc_tuple(2);
+  Store_field(range, 0, caml_copy_int64(read64le(op->packet+26)));
+  Store_field(range, 1, caml_copy_int64(read64le(op->packet+34)));
+
+  ret = caml_alloc_tuple(4);
+  Store_field(ret, 0, Val_serial(read32le(op->packet+6)));
+  Store_field(ret, 1, caml_copy_int64(read64le(op->packet+18)));
+  Store_field(ret, 2, range);
+  Store_field(ret, 3, points);
+
+  CAMLreturn(ret);
+}
+
+/* Replace the index packet alone on the page found at offset by
+ * packet, which must have the same size, and update the page's
+ * checksum. */
+CAMLprim value ocaml_schroedinger_skeleton_patch_index(value _fd, value _offset, value packet)
+{
+  CAMLparam3(_fd, _offset, packet);
+  ogg_packet *op = Packet_val(packet);
+  int fd = Int_val(_fd);
+  off_t offset = Int64_val(_offset);
+  unsigned char header[27+255];
+  ogg_page page;
+  long body_len = 0;
+  int err = 0, i;
+
+  caml_enter_blocking_section();
+  if (pread(fd, header, 27, offset) != 27 || memcmp(header, "OggS", 4) ||
+      pread(fd, header+27, header[26], offset+27) != header[26])
+    err = -1;
+  else {
+    for (i=0; i<header[26]; i++)
+      body_len += header[27+i];
+    if (body_len != op->bytes)
+      err = -2;
+    else {
+      page.header = header;
+      page.header_len = 27+header[26];
+      page.body = op->packet;
+      page.body_len = op->bytes;
+      ogg_page_checksum_set(&page);
+      if (pwrite(fd, header, page.header_len, offset) != page.header_len ||
+          pwrite(fd, page.body, page.body_len, offset+page.header_len) != page.body_len)
+        err = -1;
+    }
+  }
+  caml_leave_blocking_section();
+
+  if (err == -2)
+    caml_invalid_argument("Skeleton.patch_index: size mismatch");
+  if (err < 0)
+    caml_failwith("patch_index");
+
+  CAMLreturn(Val_unit);
+}